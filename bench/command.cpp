@@ -0,0 +1,71 @@
+/*
+ * Command microbenchmark
+ *
+ * Measures how fast Command fills in its placeholders, using long
+ * arguments and replacements that match many times.
+ *
+ * Usage: bench_command [nbFills [argumentLength]]
+ */
+
+#include "api.hpp"
+#include "command.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+using namespace std;
+using namespace worker;
+
+typedef chrono::steady_clock clock_type;
+
+struct Case {
+    const char *name;
+    const char *command;
+};
+
+int main(int argc, char **argv) {
+    uint nbFills = argc > 1 ? atoi(argv[1]) : 100000;
+    uint argumentLength = argc > 2 ? atoi(argv[2]) : 4096;
+
+    const Case cases[] = {
+        { "plain",       "cat {0} {1} > {0}.out" },
+        { "suffix",      "cat {0} {1/%.part1/.part2} > {0/%.part1/}" },
+        { "replace_all", "convert {0} {0//e/E} {1//e/} {1//tree/t}" },
+    };
+
+    // a long path with many matches for the replacements
+    string argument;
+    while (argument.length() < argumentLength)
+        argument += "/some/deep/directory/tree/file.part1";
+
+    Command::arguments_t arguments;
+    arguments.push_back(argument);
+    arguments.push_back(argument);
+
+    for (uint c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+        clock_type::time_point start = clock_type::now();
+        Command command(cases[c].command);
+        chrono::duration<double> parsed = clock_type::now() - start;
+
+        string filled;
+        size_t totalLength = 0;
+
+        start = clock_type::now();
+        for (uint i = 0; i < nbFills; i++) {
+            command.fillArguments(arguments, filled);
+            totalLength += filled.length();
+        }
+        chrono::duration<double> elapsed = clock_type::now() - start;
+
+        printf("command case=%s argument_length=%u fills=%u parse_us=%.1f seconds=%.6f ns_per_fill=%.1f mb_per_sec=%.1f\n",
+            cases[c].name, uint(argument.length()), nbFills, parsed.count() * 1e6,
+            elapsed.count(), elapsed.count() * 1e9 / nbFills,
+            totalLength / elapsed.count() / (1 << 20));
+        fflush(stdout);
+    }
+
+    return 0;
+}
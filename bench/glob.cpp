@@ -0,0 +1,86 @@
+/*
+ * Glob microbenchmark
+ *
+ * Fills a temporary directory with empty files and measures how long
+ * parseGlob takes to expand patterns matching all, some or none of them,
+ * which is what worker does for every argument before the first job can
+ * start.
+ *
+ * Usage: bench_glob [nbEntries]
+ */
+
+#include "api.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace std;
+using namespace worker;
+
+typedef chrono::steady_clock clock_type;
+
+struct Case {
+    const char *name;
+    const char *pattern;
+};
+
+int main(int argc, char **argv) {
+    uint nbEntries = argc > 1 ? atoi(argv[1]) : 100000;
+
+    char directory[] = "/tmp/bench_glob.XXXXXX";
+    if (mkdtemp(directory) == NULL)
+        Fatal("Unable to create a temporary directory: %s", strerror(errno));
+
+    vector<string> files;
+    files.reserve(nbEntries);
+
+    clock_type::time_point start = clock_type::now();
+    for (uint i = 0; i < nbEntries; i++) {
+        char name[64];
+        snprintf(name, sizeof(name), "/file%07u.%s", i, (i % 10 == 0) ? "txt" : "dat");
+        files.push_back(string(directory) + name);
+
+        int fd = open(files.back().c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+        if (fd < 0)
+            Fatal("Unable to create \"%s\": %s", files.back().c_str(), strerror(errno));
+        close(fd);
+    }
+    chrono::duration<double> created = clock_type::now() - start;
+
+    printf("glob_setup entries=%u seconds=%.6f\n", nbEntries, created.count());
+    fflush(stdout);
+
+    const Case cases[] = {
+        { "all",     "/*" },
+        { "suffix",  "/*.txt" },
+        { "brace",   "/file{00,01}*.{txt,dat}" },
+        { "none",    "/*.none" },
+    };
+
+    for (uint c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+        const string pattern = string(directory) + cases[c].pattern;
+
+        start = clock_type::now();
+        vector<string> matches = parseGlob(pattern);
+        chrono::duration<double> elapsed = clock_type::now() - start;
+
+        printf("glob case=%s entries=%u matches=%u seconds=%.6f ns_per_entry=%.1f\n",
+            cases[c].name, nbEntries, uint(matches.size()), elapsed.count(),
+            elapsed.count() * 1e9 / max(nbEntries, 1u));
+        fflush(stdout);
+    }
+
+    for (vector<string>::const_iterator f = files.begin(), e = files.end(); f != e; f++)
+        unlink(f->c_str());
+    rmdir(directory);
+
+    return 0;
+}
@@ -0,0 +1,49 @@
+#!/bin/sh
+#
+# Runs every benchmark, and worker itself end to end, printing one line of
+# key=value pairs per measurement so the results of different versions can
+# be compared with diff or a few lines of awk.
+#
+# Usage: bench/run.sh [jobs]
+#
+
+cd "$(dirname "$0")/.." || exit 1
+
+JOBS=${1:-2000}
+WORKER=bin/worker
+
+now() {
+    date +%s.%N
+}
+
+# prints the seconds elapsed since $1
+since() {
+    echo "$1 $(now)" | awk '{ printf "%.6f", $2 - $1 }'
+}
+
+echo "bench version=$(git describe --always --dirty 2>/dev/null || echo unknown) cores=$(nproc) date=$(date -u +%Y-%m-%dT%H:%M:%SZ)"
+
+for bench in bin/bench_*; do
+    "$bench" || exit 1
+done
+
+# the rate at which worker runs /bin/true, everything included
+for n in 1 4 16 64; do
+    start=$(now)
+    seq 1 "$JOBS" | "$WORKER" -n "$n" --input - 'true {}' || exit 1
+    seconds=$(since "$start")
+    echo "$n $JOBS $seconds" | awk '{ printf "worker_spawn nthreads=%u jobs=%u seconds=%s jobs_per_sec=%.1f\n", $1, $2, $3, $2 / $3 }'
+done
+
+# the output throughput of jobs writing many short lines
+for mode in lines grouped passthrough ordered; do
+    case $mode in
+        ordered) flags="-k" ;;
+        *)       flags="--output-mode $mode" ;;
+    esac
+
+    start=$(now)
+    bytes=$(seq 1 $((JOBS / 10)) | "$WORKER" -o -n 4 $flags --input - 'yes {} | head -n 10000' | wc -c)
+    seconds=$(since "$start")
+    echo "$mode $((JOBS / 10)) $bytes $seconds" | awk '{ printf "worker_output mode=%s jobs=%u bytes=%u seconds=%s mb_per_sec=%.1f\n", $1, $2, $3, $4, $3 / $4 / 1048576 }'
+done
@@ -0,0 +1,87 @@
+/*
+ * Spawn latency microbenchmark
+ *
+ * Spawns /bin/true repeatedly using every spawn method System supports and
+ * reports the number of spawns per second. The parent process can be made
+ * artificially large (and its pages dirtied) to show the cost of copying
+ * page tables when forking a big worker process.
+ *
+ * Usage: bench_spawn [nbSpawns [ballastMB]]
+ */
+
+#include "api.hpp"
+#include "system.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+
+using namespace std;
+using namespace worker;
+
+typedef chrono::steady_clock clock_type;
+
+static double runSpawns(System::SpawnMethod method, uint nbSpawns) {
+    System::setSpawnMethod(method);
+
+    int devnull = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    if (devnull < 0)
+        Fatal("Unable to open /dev/null");
+
+    char arg0[] = "true";
+    char * args[] = { arg0, NULL };
+
+    clock_type::time_point start = clock_type::now();
+
+    for (uint i = 0; i < nbSpawns; i++) {
+        pid_t pid = System::spawn("/bin/true", args, devnull);
+        if (pid < 0)
+            Fatal("Failed to spawn /bin/true");
+
+        int status;
+        waitpid(pid, &status, 0);
+    }
+
+    chrono::duration<double> elapsed = clock_type::now() - start;
+    close(devnull);
+
+    return elapsed.count();
+}
+
+int main(int argc, char **argv) {
+    uint nbSpawns = argc > 1 ? atoi(argv[1]) : 2000;
+    uint ballastMB = argc > 2 ? atoi(argv[2]) : 512;
+
+    const System::SpawnMethod methods[] = {
+        System::SPAWN_FORK, System::SPAWN_VFORK, System::SPAWN_POSIX
+    };
+
+    vector<char> ballast;
+    const uint ballasts[] = { 0, ballastMB };
+
+    for (uint b = 0; b < 2; b++) {
+        if (b > 0 && ballastMB == 0)
+            break;
+
+        // dirty every page so fork() has to copy real page tables
+        ballast.resize(size_t(ballasts[b]) << 20);
+        memset(ballast.data(), 1, ballast.size());
+
+        for (uint m = 0; m < sizeof(methods) / sizeof(methods[0]); m++) {
+            double seconds = runSpawns(methods[m], nbSpawns);
+
+            printf("spawn method=%s ballast_mb=%u spawns=%u seconds=%.6f spawns_per_sec=%.1f\n",
+                System::getSpawnMethodName(methods[m]), ballasts[b],
+                nbSpawns, seconds, nbSpawns / seconds);
+            fflush(stdout);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,64 @@
+/*
+ * ThreadPool dispatch microbenchmark
+ *
+ * Schedules no-op jobs on ThreadPools of different sizes and reports the
+ * time spent per job, which is the overhead the scheduler adds to every
+ * job worker runs.
+ *
+ * Usage: bench_threadpool [nbJobs [queueSize]]
+ */
+
+#include "api.hpp"
+#include "job.hpp"
+#include "threadpool.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+using namespace std;
+using namespace worker;
+
+typedef chrono::steady_clock clock_type;
+
+int main(int argc, char **argv) {
+    uint nbJobs = argc > 1 ? atoi(argv[1]) : 1000000;
+    uint queueSize = argc > 2 ? atoi(argv[2]) : 1024;
+
+    const uint slots[] = { 1, 8, 64, 256 };
+
+    Job job;
+    job.sequence = 0;
+    job.mode = EXEC_ARGV;
+    job.command = "true";
+    job.cost = 0;
+
+    for (uint s = 0; s < sizeof(slots) / sizeof(slots[0]); s++) {
+        atomic<uint> nbExecuted(0);
+
+        clock_type::time_point start = clock_type::now();
+        {
+            ThreadPool pool(slots[s], queueSize, [&nbExecuted](const Job &) {
+                nbExecuted.fetch_add(1, memory_order_relaxed);
+            });
+
+            for (uint i = 0; i < nbJobs; i++) {
+                Job copy(job);
+                pool.schedule(copy);
+            }
+
+            pool.join();
+        }
+        chrono::duration<double> elapsed = clock_type::now() - start;
+
+        if (nbExecuted.load() != nbJobs)
+            Fatal("Executed %u jobs instead of %u", nbExecuted.load(), nbJobs);
+
+        printf("threadpool slots=%u jobs=%u seconds=%.6f ns_per_job=%.1f\n",
+            slots[s], nbJobs, elapsed.count(), elapsed.count() * 1e9 / nbJobs);
+        fflush(stdout);
+    }
+
+    return 0;
+}
@@ -1,22 +1,63 @@
 #include "api.hpp"
 #include "system.hpp"
 #include "threadpool.hpp"
+#include "eventloop.hpp"
 #include "command.hpp"
 #include "version.hpp"
 #include "options.hpp"
+#include "source.hpp"
+#include "output.hpp"
+#include "batch.hpp"
+#include "coprocess.hpp"
+#include "affinity.hpp"
+#include "cache.hpp"
+#include "journal.hpp"
+#include "supervisor.hpp"
+#include "history.hpp"
+#include "stats.hpp"
 
 #include <string>
-#include <list>
 #include <vector>
 #include <cstdio>
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <functional>
 
 using namespace std;
 using namespace worker;
 
 typedef vector<string> arg_vec_t;
-typedef arg_vec_t::const_iterator arg_vec_citer_t;
-typedef list<string> arg_list_t;
-typedef arg_list_t::const_iterator arg_list_citer_t;
+
+// number of jobs skipped because they succeeded before the run was resumed
+static uint nbResumed = 0;
+
+// schedules job, unless its result is cached or it succeeded before
+static void submit(Executor &executor, const Command &command, Job &job, const arg_vec_t &arguments, bool showOutput) {
+    Journal *journal = System::getJournal();
+    ResultCache *cache = System::getResultCache();
+    RuntimeHistory *history = System::getRuntimeHistory();
+
+    // jobs are only rendered right before they run
+    if (journal != NULL || cache != NULL || history != NULL)
+        job.key = command.getKey(arguments);
+
+    if (journal != NULL && journal->isCompleted(job)) {
+        nbResumed++;
+
+        // the output of the earlier run is lost, but later jobs mustn't
+        // wait for it with --keep-order
+        static OutputBuffer noOutput;
+        if (showOutput)
+            System::writeOutput(job, noOutput);
+        return;
+    }
+
+    if (history != NULL)
+        job.cost = history->estimate(job, arguments);
+
+    executor.schedule(job);
+}
 
 int main(int argc, char **argv) {
     Options &options = parseOptions(argc, argv);
@@ -32,7 +73,7 @@ int main(int argc, char **argv) {
     quiet = options.quiet;
     verbose = options.verbose;
     
-    if (options.arguments.empty()) {
+    if (options.arguments.empty() && options.input.empty() && options.argFile.empty()) {
         Options::usage();
         return -2;
     }
@@ -45,68 +86,228 @@ int main(int argc, char **argv) {
     
     Debug("Found %u cores, using maximally %u threads.", System::getNbCores(), options.nthreads);
     
-    Command command(options.command);
+    Command *cacheOutput = NULL;
+    ResultCache *cache = NULL;
+    if (!options.cache.empty()) {
+        if (!options.cacheOutput.empty()) {
+            cacheOutput = new Command(options.cacheOutput);
+            if (cacheOutput->getExecutionMode() != EXEC_ARGV)
+                Fatal("--cache-output can only list files, without pipes, redirections or shell syntax");
+        }
+
+        cache = new ResultCache(options.cache, options.cacheContents, options.showOutput, cacheOutput);
+        System::setResultCache(cache);
+
+        // the output has to be collected to be cached
+        if (options.outputMode == System::OUTPUT_LINES || options.outputMode == System::OUTPUT_PASSTHROUGH) {
+            Debug("Using grouped output to be able to cache it");
+            options.outputMode = System::OUTPUT_GROUPED;
+        }
+    }
+
+    Journal *journal = NULL;
+    if (!options.journal.empty()) {
+        journal = new Journal(options.journal, options.resume);
+        System::setJournal(journal);
+    }
+
+    Supervisor *supervisor = NULL;
+    if (options.timeout > 0 || options.speculate > 0) {
+        supervisor = new Supervisor(options.timeout, options.speculate);
+        System::setSupervisor(supervisor);
+
+        // only the output of the copy that finishes first may be shown
+        if (options.speculate > 0 && (options.outputMode == System::OUTPUT_LINES || options.outputMode == System::OUTPUT_PASSTHROUGH)) {
+            Debug("Using grouped output to be able to discard the output of copies");
+            options.outputMode = System::OUTPUT_GROUPED;
+        }
+    }
+
+    RunStatistics *statistics = NULL;
+    if (options.summary || !options.stats.empty()) {
+        statistics = new RunStatistics(options.nthreads, options.stats);
+        System::setStatistics(statistics);
+    }
+
+    RuntimeHistory *history = NULL;
+    if (!options.history.empty() || options.longestFirst) {
+        history = new RuntimeHistory(options.history);
+        System::setRuntimeHistory(history);
+    }
+
+    System::setSpawnMethod(options.spawnMethod);
+    System::setOutputMode(options.outputMode);
+    
+    OrderedOutput orderedOutput(options.orderMemory);
+    System::setOrderedOutput(&orderedOutput);
+
+    AdmissionControl *admission = NULL;
+    if (options.pressureLimits.isEnabled()) {
+        admission = new AdmissionControl(options.pressureLimits);
+        System::setAdmissionControl(admission);
+    }
+    
+    SlotAffinity *affinity = NULL;
+    if (!options.affinity.empty()) {
+#if defined(WORKER_IS_LINUX)
+        SlotAffinity::Unit unit;
+        SlotAffinity::Policy policy;
+
+        if (!SlotAffinity::parseUnit(options.affinity, unit))
+            Fatal("Invalid affinity \"%s\", use cpu, core or node", options.affinity.c_str());
+        if (!SlotAffinity::parsePolicy(options.affinityPolicy, policy))
+            Fatal("Invalid affinity policy \"%s\", use compact or scatter", options.affinityPolicy.c_str());
+
+        // lives as long as the executor
+        affinity = new SlotAffinity(unit, policy, options.nthreads);
+        System::setSlotAffinity(affinity);
+#else
+        Fatal("--affinity is only supported on Linux");
+#endif
+    }
+
+    Command command(options.command, options.useShell);
     
     const uint nbPlaceholders = command.getNbPlaceholders();
     Debug("Parsed command with %u placeholders", nbPlaceholders);
 
-    if (nbPlaceholders == 1) {
-        arg_list_t jobArguments;
-        
-        for (Options::argiter_t i = options.arguments.begin(), e = options.arguments.end(); i != e; i++) {
-            vector<string> tmpArgs = parseGlob(*i);
-            jobArguments.insert(jobArguments.end(), tmpArgs.begin(), tmpArgs.end());
+    if (cacheOutput != NULL && cacheOutput->getNbPlaceholders() > nbPlaceholders) {
+        Fatal("--cache-output uses %u placeholders, but the command only has %u",
+            cacheOutput->getNbPlaceholders(), nbPlaceholders);
+    }
+
+    if (cache != NULL && cacheOutput == NULL && !command.writesFiles()) {
+        // a job whose output files are deleted would still be skipped
+        Warn("Not using --cache: the files written by the command aren't known, declare them using --cache-output");
+        System::setResultCache(NULL);
+        delete cache;
+        cache = NULL;
+    }
+
+    ArgumentGenerator::sources_t sources;
+    StreamSource *stream = NULL;
+
+    if (!options.input.empty() || !options.argFile.empty()) {
+        if (nbPlaceholders != 1) {
+            Fatal("Arguments read using %s can only be used for a single placeholder, "
+                "but the command has %u placeholders", options.input.empty() ? "--arg-file" : "--input", nbPlaceholders);
         }
-        
-        uint nbJobs = jobArguments.size();
-        ThreadPool threadPool(min(options.nthreads, nbJobs), !options.showOutput);
-        
-        for (arg_list_citer_t i = jobArguments.begin(), e = jobArguments.end(); i != e; i++) {
-            arg_vec_t currArg;
-            currArg.push_back(*i);
-        
-            threadPool.schedule(command.fillArguments(currArg));
+    }
+
+    if (!options.argFile.empty()) {
+        sources.push_back(new MappedSource(options.argFile, options.delimiter));
+    } else if (!options.input.empty()) {
+        int fd = 0;
+        if (options.input != "-" && (fd = open(options.input.c_str(), O_RDONLY | O_CLOEXEC)) < 0) {
+            Fatal("Unable to open \"%s\": %s", options.input.c_str(), strerror(errno));
         }
-        
-        threadPool.join();
-    } else { // nbPlaceholders != 1
+
+        Debug("Reading arguments from %s", (fd == 0) ? "stdin" : options.input.c_str());
+        stream = new StreamSource(fd, options.delimiter);
+        sources.push_back(stream);
+    } else if (nbPlaceholders == 1) {
+        // all arguments are values for the single placeholder
+        sources.push_back(new GlobSource(options.arguments));
+    } else {
         if (nbPlaceholders != options.arguments.size()) {
             Fatal("Invalid number of arguments given, "
                 "expected %d placeholder arguments but got %d", nbPlaceholders, options.arguments.size());
         }
 
-        arg_vec_t *jobArguments = new arg_vec_t[nbPlaceholders];
-        
-        uint idx = 0;
-        for (Options::argiter_t i = options.arguments.begin(), e = options.arguments.end(); i != e; i++, idx++) {
-            jobArguments[idx] = parseGlob(*i);
+        for (Options::argiter_t i = options.arguments.begin(), e = options.arguments.end(); i != e; i++) {
+            sources.push_back(new GlobSource(*i));
+        }
+    }
+
+    ArgumentGenerator *generator;
+    if (options.product) {
+        generator = new ProductGenerator(sources, options.productOrder);
+    } else {
+        generator = new ZipGenerator(sources);
+    }
+
+    Executor *executor;
+    if (options.persistent) {
+        if (options.eventLoop)
+            Fatal("--persistent and --coprocess can't be combined with --event-loop");
+
+        Coprocess::setProgram(options.coprocess);
+        executor = new ThreadPool(options.nthreads, options.queueSize,
+                bind(Coprocess::executeJob, placeholders::_1, !options.showOutput), options.longestFirst);
+    } else if (options.eventLoop) {
+#if defined(WORKER_IS_LINUX)
+        if (!EventLoop::isSupported())
+            Fatal("--event-loop requires pidfd support (Linux 5.3 or higher)");
+
+        executor = new EventLoop(options.nthreads, !options.showOutput, options.queueSize, options.longestFirst);
+#else
+        Fatal("--event-loop is only supported on Linux");
+#endif
+    } else {
+        executor = new ThreadPool(options.nthreads, !options.showOutput, options.queueSize, options.longestFirst);
+    }
+
+    // the jobs waiting for the rest of a slow --input to be sorted could
+    // wait indefinitely
+    if (stream != NULL && options.longestFirst)
+        stream->setWaitHandler(bind(&Executor::release, executor));
+
+    // jobs are generated while the first ones are already running, the
+    // generator blocks while the queue is full
+    uint64_t sequence = 0;
+    if (options.batch) {
+        BatchGenerator batches(*generator, command, options.maxArguments, options.nthreads);
+
+        Command::batch_t batch;
+        arg_vec_t batchArguments;
+        while (batches.next(batch)) {
+            batchArguments.clear();
+            for (Command::batch_t::const_iterator a = batch.begin(), e = batch.end(); a != e; a++)
+                batchArguments.insert(batchArguments.end(), a->begin(), a->end());
+
+            Job job = command.createPendingJob(batch, sequence++);
+            submit(*executor, command, job, batchArguments, options.showOutput);
         }
-        
-        if (nbPlaceholders > 0) {
-            uint nbJobs = jobArguments[0].size();
-            for (uint i = 1; i < nbPlaceholders; i++) {
-                if (jobArguments[i].size() != nbJobs) {
-                    Fatal("Placeholder %u matches %u items while placeholder 0 matches %u items!", i, jobArguments[i].size(), nbJobs);
-                }
-            }
+    } else {
+        arg_vec_t jobArguments;
+        while (generator->next(jobArguments)) {
+            Job job = command.createPendingJob(jobArguments, sequence++);
+            submit(*executor, command, job, jobArguments, options.showOutput);
         }
-        
-        uint nbJobs = jobArguments[0].size();
-        Debug("Using %u jobs", nbJobs);
-        
-        ThreadPool threadPool(min(options.nthreads, nbJobs), !options.showOutput);
-        
-        for (uint i = 0; i < nbJobs; i++) {
-            arg_vec_t thisArgs;
-            
-            for (uint j = 0; j < nbPlaceholders; j++)
-                thisArgs.push_back(jobArguments[j][i]);
-            
-            threadPool.schedule(command.fillArguments(thisArgs));
+    }
+
+    Debug("Generated %u jobs", generator->getNbGenerated());
+    const bool failed = generator->hasFailed();
+
+    executor->join();
+    delete executor;
+    delete generator;
+    delete admission;
+#if defined(WORKER_IS_LINUX)
+    delete affinity;
+#endif
+    delete supervisor;
+    delete history;
+
+    if (statistics != NULL) {
+        if (options.summary) {
+            FlushLog();
+            statistics->printSummary();
         }
-        
-        delete[] jobArguments;
-        
-        threadPool.join();
-    } // if (nbPlaceholders == 1)
+        delete statistics;
+    }
+
+    if (cache != NULL) {
+        Info("Result cache: %u hits, %u misses", cache->getNbHits(), cache->getNbMisses());
+        delete cache;
+    }
+    delete cacheOutput;
+
+    if (journal != NULL) {
+        if (options.resume)
+            Info("Resumed: skipped %u jobs that succeeded before", nbResumed);
+        delete journal;
+    }
+
+    return failed ? 1 : 0;
 }
@@ -0,0 +1,15 @@
+#!/bin/sh
+
+. ../env.sh
+
+# prints a.o b.o, c.o d.o and e.o using 3 invocations
+run -n 1 -N 2 -o 'echo {0/%.c/.o}' a.c b.c c.c d.c e.c
+
+# prints [one two three] using a single invocation of /bin/sh
+run -n 1 -X -o 'echo "[{}]"; true' one two three
+
+# values are quoted for /bin/sh with or without a batch: prints "[a  b]",
+# "[$HOME]" and "[it's]" twice
+for batch in '' '-N 1'; do
+    run -n 1 $batch -o 'echo "[{}]"; true' 'a  b' '$HOME' "it's"
+done
@@ -0,0 +1,32 @@
+#!/bin/sh
+
+. ../env.sh
+
+rm -f results.cache
+
+# runs both jobs, the second time their output is replayed from the cache
+run -o --cache results.cache --cache-output '{0}.out' 'echo {0} | tee {0}.out' one two
+run -o --cache results.cache --cache-output '{0}.out' 'echo {0} | tee {0}.out' one two
+
+rm -f results.cache
+
+# a job runs again once the file it wrote is gone: prints "one"
+run --cache results.cache 'echo {} > out.txt' one
+rm -f out.txt
+run --cache results.cache 'echo {} > out.txt' one
+cat out.txt
+
+# the same goes for the files declared using --cache-output, whatever the
+# way the command is executed: prints "in" twice
+echo in > in.txt
+for shell in '' --shell; do
+    run --cache results.cache --cache-output '{0/%.txt/.bak}' $shell 'cp {} {0/%.txt/.bak}' in.txt
+    rm -f in.bak
+    run --cache results.cache --cache-output '{0/%.txt/.bak}' $shell 'cp {} {0/%.txt/.bak}' in.txt
+    cat in.bak
+done
+
+# commands whose output files aren't known aren't cached: prints a warning
+run -o --cache results.cache 'true {}' one 2>&1 | grep -c 'Not using --cache'
+
+rm -f results.cache out.txt in.txt in.bak one.out two.out
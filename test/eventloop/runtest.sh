@@ -0,0 +1,10 @@
+#!/bin/sh
+
+. ../env.sh
+
+# runs all jobs from a single thread: prints "1", "2" and "3"
+run -n 2 -o --event-loop 'echo {}' 1 2 3 | sort
+
+# a job that can't be started still finishes, without output to wait for
+# in quiet mode: prints two warnings that the program can't be executed
+run -n 2 --event-loop 'nonexistent-program {}' 1 2 2>&1 | grep -c 'Failed to execute'
@@ -0,0 +1,30 @@
+#!/bin/sh
+
+. ../env.sh
+
+rm -rf tree
+mkdir -p tree/a/b tree/.hidden
+touch tree/1.c tree/a/2.c tree/a/b/3.c tree/a/b/4.h tree/.hidden/5.c
+
+# ** matches any number of directories, hidden ones excepted: prints
+# "tree/1.c tree/a/2.c tree/a/b/3.c"
+run -o 'echo {}' 'tree/**/*.c' | sort | tr '\n' ' '; echo
+
+# the matches come in walk order, so patterns walking the same tree
+# pair up: prints "3 pairs"
+run -o 'echo {} {}' 'tree/**/*.c' 'tree/**/*.c' | awk '$1 == $2 { n++ } END { print n " pairs" }'
+
+# a pattern matching nothing is passed as is: prints "tree/*.txt"
+run -o 'echo {}' 'tree/*.txt'
+
+# a final ** also matches zero directories, like with bash's globstar:
+# prints "tree/a/ tree/a/2.c tree/a/b tree/a/b/3.c tree/a/b/4.h" and
+# "tree/a/ tree/a/b/"
+run -o 'echo {}' 'tree/a/**' | sort | tr '\n' ' '; echo
+run -o 'echo {}' 'tree/a/**/' | sort | tr '\n' ' '; echo
+
+# the job that has both arguments runs before the error: prints
+# "tree/a/b/3.c tree/a/2.c" and "1"
+run -o 'echo {} {}' 'tree/a/b/*' 'tree/a/*.c' 2>/dev/null; echo $?
+
+rm -rf tree
@@ -0,0 +1,10 @@
+#!/bin/sh
+
+. ../env.sh
+
+printf 'first\nsecond line\n\nthird' | run -o --input - 'echo "<{}>"'
+printf 'first\0second line\0' | run -o -0 --input - 'echo "<{}>"'
+
+printf 'first\nsecond line\n\nthird' > arguments.txt
+run -o --arg-file arguments.txt 'echo "<{}>"'
+rm -f arguments.txt
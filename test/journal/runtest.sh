@@ -0,0 +1,19 @@
+#!/bin/sh
+
+. ../env.sh
+
+rm -f jobs.journal
+
+# the second job fails, so only it is run again when resuming: prints
+# "one two" and then "two"
+run -o -k --journal jobs.journal 'echo {}; [ {0} = one ]' one two
+run -o -k --journal jobs.journal --resume 'echo {}; [ {0} = one ]' one two
+
+rm -f jobs.journal
+
+# jobs are recognised by their arguments, not by the slot they ran in:
+# prints "one two" and then nothing
+run -o -k -n 2 --journal jobs.journal 'echo {} {%} > /dev/null; echo {0}' one two
+run -o -k -n 2 --journal jobs.journal --resume 'echo {} {%} > /dev/null; echo {0}' one two
+
+rm -f jobs.journal
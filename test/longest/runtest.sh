@@ -0,0 +1,27 @@
+#!/bin/sh
+
+. ../env.sh
+
+rm -rf sizes
+mkdir sizes
+printf 'aaaaa' > sizes/a
+printf 'aaaaaaaaaa' > sizes/b
+printf 'a' > sizes/c
+
+# without a history the biggest input goes first: prints "sizes/b",
+# "sizes/a" and "sizes/c"
+run -n 1 -o --longest-first 'echo {}' 'sizes/*'
+
+rm -rf sizes
+rm -f jobs.history
+
+# the second run starts the job that took longest in the first run: prints
+# "0.1 0.3 0.2" and then "0.3 0.2 0.1"
+run -n 1 -o --history jobs.history 'sleep {}; echo {0}' 0.1 0.3 0.2 | tr '\n' ' '; echo
+run -n 1 -o --history jobs.history --longest-first 'sleep {}; echo {0}' 0.1 0.3 0.2 | tr '\n' ' '; echo
+
+rm -f jobs.history
+
+# the jobs read from a slow --input start while worker waits for the next
+# argument instead of after all of them: prints "1" before "start 2"
+{ (echo 1; sleep 1; echo start 2 >&3; echo 2) | run -o --longest-first --input - 'echo {}'; } 3>&1
@@ -0,0 +1,5 @@
+#!/bin/sh
+
+. ../env.sh
+
+run 'sort < {} | tr a-z A-Z > {0/%.txt/.out} && cat {0/%.txt/.out}' '*.txt'
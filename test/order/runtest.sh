@@ -0,0 +1,6 @@
+#!/bin/sh
+
+. ../env.sh
+
+# prints 3, 1 and 2 although 3 finishes last
+run -n 3 --keep-order -o 'sleep 0.{} && echo {0}' 3 1 2
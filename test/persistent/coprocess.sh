@@ -0,0 +1,10 @@
+#!/bin/bash
+#
+# A coprocess for --coprocess: runs every job in a subshell and reports its
+# status on fd 3.
+#
+
+while IFS= read -r -d '' job; do
+    (eval "$job") </dev/null 3>&-
+    echo $? >&3
+done
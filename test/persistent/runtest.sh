@@ -0,0 +1,15 @@
+#!/bin/sh
+
+. ../env.sh
+
+# runs all jobs in a single /bin/sh, prints the test directory three times
+# because the cd of a job doesn't affect the next one
+run -n 1 --persistent -o 'echo {} $PWD && cd /' 1 2 3
+
+# jobs are separated by NUL characters, so an argument spanning two lines is
+# still a single job: prints "[one", "two]" and "[three]"
+printf 'one\ntwo\0three\0' | run -n 1 -o -0 --input - --coprocess ./coprocess.sh "printf '[%s]\n' '{}'"
+
+# a job executed without /bin/sh runs the words worker split, quoted for the
+# coprocess: prints "[a  b]", "[$HOME]" and "[it's]"
+run -n 1 --persistent -o '/usr/bin/printf "[%s]\n" {} | cat' 'a  b' '$HOME' "it's"
@@ -0,0 +1,11 @@
+#!/bin/sh
+
+. ../env.sh
+
+# prints every combination of the inputs and the configs, all configs for
+# one input before the next input
+run -n 1 -p -o 'echo {} {}' 'inputs/*' 'configs/*'
+
+# prints the same combinations, all inputs for one config before the next
+# config
+run -n 1 --product-order 1 -o 'echo {} {}' 'inputs/*' 'configs/*'
@@ -0,0 +1,9 @@
+#!/bin/sh
+
+. ../env.sh
+
+# prints a 0, b 0 and c 0: every job knows the slot it runs in
+run -n 1 -o 'echo {} $WORKER_SLOT' a b c
+
+# the same, with the slot pinned to a single cpu
+run -n 1 --affinity cpu -o 'echo {} $WORKER_SLOT' a b c
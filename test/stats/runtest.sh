@@ -0,0 +1,12 @@
+#!/bin/sh
+
+. ../env.sh
+
+rm -f jobs.csv
+
+# prints "one" and "two" and a summary of both jobs, then the sequence,
+# status and output size of every job: "0,0,4" and "1,256,4"
+run -n 1 -o --summary --stats jobs.csv 'echo {}; [ {0} = one ]' one two
+tail -n +2 jobs.csv | cut -d, -f1,3,14
+
+rm -f jobs.csv
@@ -0,0 +1,35 @@
+#!/bin/sh
+
+. ../env.sh
+
+# the second job is killed after half a second: prints "0.1" and a
+# warning that "sleep 30; echo 30" timed out
+run -o --timeout 0.5 'sleep {}; echo {0}' 0.1 30
+
+rm -rf slow.mark
+
+# the first execution of the fourth job hangs, a copy of it is started once
+# the others are done and finishes first: prints "1" up to "6" once, in
+# about a second
+run -o -n 2 --speculate 3 'if [ {} = 4 ] && mkdir slow.mark 2>/dev/null; then sleep 30; fi; sleep 0.2; echo {0}' 1 2 3 4 5 6
+
+rm -rf slow.mark
+
+# the threads waiting for a straggler are woken up when the last job times
+# out instead of finishing: exits after about a second, printing a warning
+# that "sleep 10" timed out
+run -n 2 --timeout 1 --speculate 2 'sleep {}' 0 10 2>&1 | grep -c 'timed out'
+
+rm -f killed.mark
+
+# the jobs run in their own process groups, the signal worker (the child of
+# the subshell running run) gets is sent to them before it exits: prints
+# "143" and nothing else, the job never gets to create killed.mark
+run --timeout 30 'sleep {} && touch killed.mark' 1 &
+sleep 0.3
+pkill -TERM -P $!
+wait $!; echo $?
+sleep 1.2
+ls killed.mark 2>/dev/null
+
+rm -f killed.mark
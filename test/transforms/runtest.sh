@@ -0,0 +1,10 @@
+#!/bin/sh
+
+. ../env.sh
+
+# prints "c.tar.gz a/b a/b/c.tar c.tar b/c.tar.gz a/b/c.tar.bz2"
+run -o 'echo {0/} {0//} {0.} {0/.} {0#a/} {0:s/gz$/bz2/}' a/b/c.tar.gz
+
+# the sequence number of the job and its slot, with a single thread: prints
+# "0 0 a", "1 0 b" and "2 0 c"
+run -o -k -n 1 'echo {#} {%} {}' a b c
@@ -0,0 +1,261 @@
+#include "affinity.hpp"
+
+#if defined(WORKER_IS_LINUX)
+
+#include "api.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <errno.h>
+#include <dirent.h>
+#include <map>
+
+using namespace std;
+
+namespace worker {
+
+    namespace impl {
+
+        struct Cpu {
+            int id;
+            int core;
+            int package;
+            int node;
+        };
+
+        // a group of CPUs a slot can be pinned to
+        struct AffinityUnit {
+            int node, package, core, first;
+            cpu_set_t cpus;
+
+            // for scattering: the index of the hardware thread within its
+            // core and of the core within its node
+            int thread, coreRank;
+
+            // sorted by location
+            inline bool operator<(const AffinityUnit &o) const {
+                if (node != o.node) return node < o.node;
+                if (package != o.package) return package < o.package;
+                if (core != o.core) return core < o.core;
+                return first < o.first;
+            }
+        };
+
+        // first one unit on every core of every node, then another one...
+        inline bool scatterOrder(const AffinityUnit &a, const AffinityUnit &b) {
+            if (a.thread != b.thread) return a.thread < b.thread;
+            if (a.coreRank != b.coreRank) return a.coreRank < b.coreRank;
+            return a < b;
+        }
+
+    }
+
+    using impl::Cpu;
+    using impl::AffinityUnit;
+
+    static int readTopology(int cpu, const char *name, int defaultValue) {
+        char path[128];
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/%s", cpu, name);
+
+        FILE *f = fopen(path, "re");
+        if (f == NULL)
+            return defaultValue;
+
+        int value;
+        if (fscanf(f, "%d", &value) != 1)
+            value = defaultValue;
+
+        fclose(f);
+        return value;
+    }
+
+    // maps every CPU to its NUMA node, using the cpulists in sysfs
+    static map<int, int> readNodes() {
+        map<int, int> result;
+
+        DIR *dir = opendir("/sys/devices/system/node");
+        if (dir == NULL)
+            return result;
+
+        for (struct dirent *entry; (entry = readdir(dir)) != NULL; ) {
+            int node;
+            if (sscanf(entry->d_name, "node%d", &node) != 1)
+                continue;
+
+            char path[128];
+            snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+
+            FILE *f = fopen(path, "re");
+            if (f == NULL)
+                continue;
+
+            // e.g. 0-7,16-23
+            int first, last;
+            while (fscanf(f, "%d", &first) == 1) {
+                last = first;
+                int c = fgetc(f);
+                if (c == '-') {
+                    if (fscanf(f, "%d", &last) != 1)
+                        break;
+                    c = fgetc(f);
+                }
+
+                for (int cpu = first; cpu <= last; cpu++)
+                    result[cpu] = node;
+
+                if (c != ',')
+                    break;
+            }
+
+            fclose(f);
+        }
+
+        closedir(dir);
+        return result;
+    }
+
+    static string formatCpus(const cpu_set_t &set) {
+        string result;
+
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (!CPU_ISSET(cpu, &set))
+                continue;
+
+            if (!result.empty())
+                result += ',';
+            result += itoa(cpu);
+        }
+
+        return result;
+    }
+
+    SlotAffinity::SlotAffinity(Unit unit, Policy policy, uint nbSlots) {
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+            Fatal("sched_getaffinity() failed: %s", strerror(errno));
+
+        const map<int, int> nodes = readNodes();
+
+        vector<Cpu> cpus;
+        for (int id = 0; id < CPU_SETSIZE; id++) {
+            if (!CPU_ISSET(id, &allowed))
+                continue;
+
+            Cpu cpu;
+            cpu.id = id;
+            cpu.core = readTopology(id, "core_id", id);
+            cpu.package = readTopology(id, "physical_package_id", 0);
+
+            // without NUMA information, every socket is a node
+            map<int, int>::const_iterator node = nodes.find(id);
+            cpu.node = (node == nodes.end()) ? cpu.package : node->second;
+
+            cpus.push_back(cpu);
+        }
+
+        // group the CPUs into units
+        vector<AffinityUnit> units;
+        for (vector<Cpu>::const_iterator cpu = cpus.begin(), e = cpus.end(); cpu != e; cpu++) {
+            AffinityUnit key;
+            key.node = cpu->node;
+            key.package = (unit == UNIT_NODE) ? 0 : cpu->package;
+            key.core = (unit == UNIT_NODE) ? 0 : cpu->core;
+            key.first = cpu->id;
+
+            vector<AffinityUnit>::iterator existing = units.begin();
+            if (unit != UNIT_CPU) {
+                while (existing != units.end() && (existing->node != key.node
+                        || existing->package != key.package || existing->core != key.core))
+                    existing++;
+            } else {
+                existing = units.end();
+            }
+
+            if (existing == units.end()) {
+                CPU_ZERO(&key.cpus);
+                units.push_back(key);
+                existing = units.end() - 1;
+            }
+
+            CPU_SET(cpu->id, &existing->cpus);
+        }
+
+        sort(units.begin(), units.end());
+
+        if (policy == POLICY_SCATTER) {
+            for (size_t i = 0; i < units.size(); i++) {
+                units[i].thread = 0;
+                units[i].coreRank = 0;
+                if (i == 0)
+                    continue;
+
+                const AffinityUnit &previous = units[i - 1];
+                if (units[i].node != previous.node)
+                    continue;
+
+                if (units[i].package == previous.package && units[i].core == previous.core) {
+                    units[i].thread = previous.thread + 1;
+                    units[i].coreRank = previous.coreRank;
+                } else {
+                    units[i].coreRank = previous.coreRank + 1;
+                }
+            }
+
+            sort(units.begin(), units.end(), impl::scatterOrder);
+        }
+
+        const size_t nbUnits = units.size();
+        if (nbUnits == 0)
+            Fatal("Unable to determine the CPUs to pin jobs to");
+
+        slots.resize(nbSlots);
+        for (uint slot = 0; slot < nbSlots; slot++) {
+            // compact puts consecutive slots on the same unit when there are
+            // more slots than units, scatter starts over
+            size_t i = (policy == POLICY_COMPACT && nbSlots > nbUnits)
+                    ? size_t(slot) * nbUnits / nbSlots : slot % nbUnits;
+
+            slots[slot] = units[i].cpus;
+            Debug("Slot %u runs on CPU %s (node %d)", slot, formatCpus(slots[slot]).c_str(), units[i].node);
+        }
+    }
+
+    void SlotAffinity::pin(uint slot) const {
+        if (sched_setaffinity(0, sizeof(cpu_set_t), &slots[slot % slots.size()]) != 0)
+            Warn("Failed to pin slot %u: %s", slot, strerror(errno));
+    }
+
+    void SlotAffinity::unpin() const {
+        sched_setaffinity(0, sizeof(allowed), &allowed);
+    }
+
+    bool SlotAffinity::parseUnit(const string &name, Unit &unit) {
+        if (name == "cpu") {
+            unit = UNIT_CPU;
+        } else if (name == "core") {
+            unit = UNIT_CORE;
+        } else if (name == "node") {
+            unit = UNIT_NODE;
+        } else {
+            return false;
+        }
+
+        return true;
+    }
+
+    bool SlotAffinity::parsePolicy(const string &name, Policy &policy) {
+        if (name == "compact") {
+            policy = POLICY_COMPACT;
+        } else if (name == "scatter") {
+            policy = POLICY_SCATTER;
+        } else {
+            return false;
+        }
+
+        return true;
+    }
+
+}
+
+#endif // defined(WORKER_IS_LINUX)
@@ -0,0 +1,53 @@
+#ifndef __WORKER_AFFINITY_
+#define __WORKER_AFFINITY_
+
+#include "api.hpp"
+
+#if defined(WORKER_IS_LINUX)
+
+#include <string>
+#include <vector>
+#include <sched.h>
+
+namespace worker {
+
+    /*
+     * Pins the jobs of every slot to a fixed set of CPUs, based on the
+     * topology in /sys/devices/system. A slot is pinned to a unit:
+     *  - UNIT_CPU:  a single logical CPU
+     *  - UNIT_CORE: all hardware threads of a physical core
+     *  - UNIT_NODE: all CPUs of a NUMA node
+     *
+     * With POLICY_COMPACT consecutive slots get neighbouring units, filling
+     * up one node before the next. With POLICY_SCATTER consecutive slots
+     * are spread over the nodes (or sockets without NUMA information).
+     */
+    class SlotAffinity {
+    public:
+        typedef enum { UNIT_CPU, UNIT_CORE, UNIT_NODE } Unit;
+        typedef enum { POLICY_COMPACT, POLICY_SCATTER } Policy;
+
+        SlotAffinity(Unit unit, Policy policy, uint nbSlots);
+
+        // pins the calling thread, and with it all processes it starts
+        // from now on, to the CPUs of slot
+        void pin(uint slot) const;
+
+        // allows the calling thread to run on all CPUs again
+        void unpin() const;
+
+        static bool parseUnit(const std::string &name, Unit &unit);
+        static bool parsePolicy(const std::string &name, Policy &policy);
+
+    private:
+        // the CPUs we were allowed to run on when started
+        cpu_set_t allowed;
+
+        std::vector<cpu_set_t> slots;
+    };
+
+}
+
+#endif // defined(WORKER_IS_LINUX)
+
+#endif // !defined(__WORKER_AFFINITY_)
@@ -1,13 +1,20 @@
 #include "api.hpp"
+#include "log.hpp"
+#include "walker.hpp"
 #include <stdarg.h>
 #include <cstdlib>
 #include <limits>
 #include <stdexcept>
 #include <iostream>
+#include <sstream>
 #include <cmath>
-#include <glob.h>
 #include <mutex>
 #include <thread>
+#include <cstdio>
+#include <cerrno>
+#include <climits>
+#include <unistd.h>
+#include <sys/uio.h>
 
 using namespace std;
 
@@ -47,64 +54,100 @@ namespace worker {
         return retval;
     }
 
-    std::vector<std::string> parseGlob(const std::string &str) {
-        Debug("Parsing glob \"%s\"", str.c_str());
-        glob_t matches;
-
-        std::vector<std::string> result;
-
-        int ret = glob(str.c_str(), GLOB_BRACE|GLOB_NOSORT|GLOB_TILDE, NULL, &matches);
-        if (ret != 0) {
-            if (ret == GLOB_NOMATCH) {
-                Debug("found no matches... returning original string as match");
-
-                result.push_back(str);
-                return result;
+    void shellQuote(const string &str, string &out) {
+        out += '\'';
+        for (size_t offset = 0; ; ) {
+            size_t idx = str.find('\'', offset);
+            if (idx == string::npos) {
+                out.append(str, offset, string::npos);
+                break;
             }
 
-            throw invalid_argument("invalid placeholder");
+            out.append(str, offset, idx - offset);
+            out += "'\\''";
+            offset = idx + 1;
         }
+        out += '\'';
+    }
 
-        Debug("matched %u files", matches.gl_pathc);
+    std::vector<std::string> parseGlob(const std::string &str) {
+        Debug("Parsing glob \"%s\"", str.c_str());
+        GlobWalker walker(str);
 
-        result.reserve(matches.gl_pathc);
+        std::vector<std::string> result;
+        std::string match;
 
-        for (size_t i = 0; i < matches.gl_pathc; i++) {
-            result.push_back(matches.gl_pathv[i]);
+        while (walker.next(match)) {
+            result.push_back(std::string());
+            result.back().swap(match);
         }
 
-        globfree(&matches);
+        Debug("matched %u files", uint(result.size()));
         return result;
     }
 
     bool quiet = false;
     bool verbose = false;
 
-    mutex _processMutex;
+    using impl::Log;
 
-    void Process(const char *format, va_list args, const char *message, bool shouldAbort = false) {
-        unique_lock<mutex> lock(_processMutex);
+    // the "[thread id]" every message starts with, formatted once per thread
+    static thread_local char threadTag[48];
+    static thread_local size_t threadTagLength = 0;
 
-#if defined(WORKER_IS_WINDOWS)
-        char errorBuf[2048];
-        vsnprintf_s(errorBuf, sizeof(errorBuf), _TRUNCATE, format, args);
-#else
-        char *errorBuf;
-        if (vasprintf(&errorBuf, format, args) == -1) {
-            cerr << "vasprintf() unable to allocate memory!" << endl;
-            abort();
+    // appends what every message starts with: the time with --verbose and
+    // the thread id
+    static void appendPrefix(Log &log, string &out) {
+        if (verbose) {
+            uint64_t us = chrono::duration_cast<chrono::microseconds>(log.getUptime()).count();
+            char timestamp[32];
+            out.append(timestamp, snprintf(timestamp, sizeof(timestamp), "[%4llu.%06llu] ",
+                (unsigned long long)(us / 1000000), (unsigned long long)(us % 1000000)));
         }
-#endif
 
-        cerr << "[" << this_thread::get_id() << "]   \t";
-        cerr << "[" << message << "]" << " \t" << errorBuf << endl;
-        fflush(stderr);
+        if (threadTagLength == 0) {
+            ostringstream tag;
+            tag << "[" << this_thread::get_id() << "]   \t";
+            threadTagLength = tag.str().copy(threadTag, sizeof(threadTag));
+        }
 
-#if !defined(PBRT_IS_WINDOWS)
-        free(errorBuf);
-#endif
+        out.append(threadTag, threadTagLength);
+    }
+
+    void Process(const char *format, va_list args, const char *message, bool shouldAbort = false) {
+        Log &log = Log::get();
+
+        string line;
+        line.reserve(256);
+
+        appendPrefix(log, line);
+        line += '[';
+        line += message;
+        line += "] \t";
+
+        va_list argsCopy;
+        va_copy(argsCopy, args);
+
+        char buffer[512];
+        int length = vsnprintf(buffer, sizeof(buffer), format, args);
+        if (length < 0) {
+            line += format;
+        } else if (size_t(length) < sizeof(buffer)) {
+            line.append(buffer, length);
+        } else {
+            size_t offset = line.size();
+            line.resize(offset + length + 1);
+            vsnprintf(&line[offset], length + 1, format, argsCopy);
+            line.resize(offset + length);
+        }
+
+        va_end(argsCopy);
+
+        line += '\n';
+        log.append(line);
 
         if (shouldAbort) {
+            log.flush();
 #if defined(WORKER_IS_WINDOWS)
         __debugbreak();
 #else
@@ -154,16 +197,63 @@ namespace worker {
         va_end(args);
     }
 
+    void FlushLog() {
+        Log::get().flush();
+    }
+
     mutex _outputMutex;
 
     void Output(const char *output) {
         unique_lock<mutex> lock(_outputMutex);
-        unique_lock<mutex> lock2(_processMutex);
 
-        if (verbose)
-            cerr << "[" << this_thread::get_id() << "]   \t[PROCESS]\t";
+        if (verbose) {
+            // the prefix has to come after the messages logged before
+            Log &log = Log::get();
+
+            string prefix;
+            appendPrefix(log, prefix);
+            prefix += "[PROCESS]\t";
+
+            log.append(prefix);
+            log.flush();
+        }
         cout << output << endl;
         fflush(stdout);
     }
 
+
+    void Output(const struct iovec *iov, size_t count) {
+        unique_lock<mutex> lock(_outputMutex);
+
+        // the iostreams might still have buffered output
+        cout.flush();
+        fflush(stdout);
+
+        vector<iovec> remaining(iov, iov + count);
+        size_t offset = 0;
+
+        while (offset < remaining.size()) {
+            int nbBuffers = static_cast<int>(min(remaining.size() - offset, size_t(IOV_MAX)));
+            ssize_t written = writev(1, &remaining[offset], nbBuffers);
+
+            if (written < 0) {
+                if (errno == EINTR)
+                    continue;
+                return;
+            }
+
+            // skip what has been written, a partial write continues halfway
+            // through a buffer
+            while (offset < remaining.size() && size_t(written) >= remaining[offset].iov_len) {
+                written -= remaining[offset].iov_len;
+                offset++;
+            }
+
+            if (written > 0) {
+                remaining[offset].iov_base = static_cast<char *>(remaining[offset].iov_base) + written;
+                remaining[offset].iov_len -= written;
+            }
+        }
+    }
+
 }
@@ -19,6 +19,8 @@ typedef int32_t sint;
 #include <vector>
 #include <exception>
 
+struct iovec;
+
 namespace worker {
 
     namespace exception {
@@ -38,6 +40,9 @@ namespace worker {
 
     std::string itoa(sint i);
 
+    // appends str to out in single quotes, so /bin/sh sees it as one word
+    void shellQuote(const std::string &str, std::string &out);
+
     std::vector<std::string> parseGlob(const std::string &str);
 
     extern bool quiet;
@@ -49,8 +54,15 @@ namespace worker {
     void Info(const char *format, ...);
     void Debug(const char *format, ...);
 
+    // the messages above are written asynchronously, waits until the ones
+    // logged so far have been written
+    void FlushLog();
+
     void Output(const char *str);
 
+    // writes raw output to stdout, without interleaving it with other output
+    void Output(const struct iovec *iov, size_t count);
+
     #define Assert(assertion) \
         ((assertion) ? (void)0 : \
             Fatal("Assertion \"%s\" failed in %s, line %d", \
@@ -0,0 +1,82 @@
+#include "batch.hpp"
+#include "system.hpp"
+#include "api.hpp"
+
+using namespace std;
+
+namespace worker {
+
+    BatchGenerator::BatchGenerator(ArgumentGenerator &generator, const Command &command, uint maxArguments, uint nbSlots)
+        : generator(generator), command(command), maxArguments(maxArguments),
+          nbSlots(max(nbSlots, 1u)), started(false), pendingLength(0)
+    {
+        // /bin/sh gets the entire command as a single argument
+        maxLength = (command.getExecutionMode() == EXEC_SHELL)
+                ? System::getMaxArgumentLength() : System::getMaxArgumentsLength();
+
+        // the command itself
+        size_t commandLength = command.fillArguments(Command::arguments_t(command.getNbPlaceholders())).length();
+        maxLength = (maxLength > commandLength + 4096) ? maxLength - commandLength - 4096 : 4096;
+
+        Debug("Batches contain %s%u jobs with at most %u bytes of arguments",
+                maxArguments ? "" : "up to ", maxArguments, maxLength);
+    }
+
+    bool BatchGenerator::fetch() {
+        Command::arguments_t arguments;
+        if (!generator.next(arguments))
+            return false;
+
+        size_t length = command.getBatchLength(arguments);
+        pending.push_back(make_pair(arguments, length));
+        pendingLength += length;
+        return true;
+    }
+
+    void BatchGenerator::readAhead() {
+        if (maxArguments != 0)
+            return;
+
+        // don't keep too much in memory when the limit is large
+        const size_t readAheadLength = min(nbSlots * maxLength, size_t(64) << 20);
+
+        while (pendingLength < readAheadLength) {
+            if (!fetch()) {
+                // everything fits in fewer batches than there are slots
+                maxArguments = uint((pending.size() + nbSlots - 1) / nbSlots);
+                Debug("Spreading %u jobs over %u batches", pending.size(), nbSlots);
+                return;
+            }
+        }
+    }
+
+    bool BatchGenerator::next(batch_t &batch) {
+        batch.clear();
+
+        if (!started) {
+            started = true;
+            readAhead();
+        }
+
+        size_t length = 0;
+        while (maxArguments == 0 || batch.size() < maxArguments) {
+            if (pending.empty() && !fetch())
+                break;
+
+            // a job that doesn't fit on its own still gets a batch
+            const size_t nextLength = pending.front().second;
+            if (!batch.empty() && length + nextLength > maxLength)
+                break;
+
+            batch.push_back(Command::arguments_t());
+            batch.back().swap(pending.front().first);
+            pending.pop_front();
+
+            length += nextLength;
+            pendingLength -= nextLength;
+        }
+
+        return !batch.empty();
+    }
+
+}
@@ -0,0 +1,58 @@
+#ifndef __WORKER_BATCH_
+#define __WORKER_BATCH_
+
+#include <deque>
+#include <utility>
+
+#include "api.hpp"
+#include "command.hpp"
+#include "source.hpp"
+
+namespace worker {
+
+    /*
+     * Groups the arguments of consecutive jobs into batches that are
+     * executed by a single invocation of the command, like xargs does.
+     *
+     * A batch holds at most maxArguments jobs, or as many as fit in the
+     * arguments of a single process if maxArguments is 0. In the latter
+     * case, if all arguments fit in fewer batches than there are slots,
+     * they are spread evenly so every slot gets a batch.
+     */
+    struct BatchGenerator {
+        typedef Command::batch_t batch_t;
+
+        BatchGenerator(ArgumentGenerator &generator, const Command &command, uint maxArguments, uint nbSlots);
+
+        // returns false when all batches have been generated
+        bool next(batch_t &batch);
+
+        inline size_t getMaxLength() const {
+            return maxLength;
+        }
+
+    private:
+        // no copying!
+        BatchGenerator(const BatchGenerator &o);
+
+        // reads the arguments of the next job into pending
+        bool fetch();
+        void readAhead();
+
+        ArgumentGenerator &generator;
+        const Command &command;
+
+        uint maxArguments;
+        const uint nbSlots;
+        size_t maxLength;
+
+        bool started;
+
+        // arguments that have been read but not batched yet, with their length
+        std::deque<std::pair<Command::arguments_t, size_t> > pending;
+        size_t pendingLength;
+    };
+
+}
+
+#endif // !defined(__WORKER_BATCH_)
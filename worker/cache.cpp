@@ -0,0 +1,403 @@
+#include "cache.hpp"
+#include "api.hpp"
+#include "hash.hpp"
+#include "system.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+using namespace std;
+
+namespace worker {
+
+    static const char MAGIC[8] = { 'W', 'R', 'K', 'C', 'A', 'C', 'H', '1' };
+
+    static const uint32_t FLAG_HAS_OUTPUT = 1;
+
+    namespace impl {
+
+        // a result in the cache file, followed by nbFiles FileEntries of
+        // filesLength bytes in total and outputLength bytes of output
+        struct CacheRecord {
+            char key[16];
+            uint32_t flags;
+            uint32_t nbFiles;
+            uint64_t filesLength;
+            uint64_t outputLength;
+        };
+
+        // a file written by the job, followed by its path
+        struct CacheFileEntry {
+            int64_t size;
+            int64_t mtime;
+            uint32_t pathLength;
+            uint32_t reserved;
+        };
+
+    }
+
+    using impl::CacheRecord;
+    using impl::CacheFileEntry;
+
+    static int64_t getMtime(const struct stat &st) {
+    #if defined(WORKER_IS_OSX)
+        return int64_t(st.st_mtimespec.tv_sec) * 1000000000 + st.st_mtimespec.tv_nsec;
+    #else
+        return int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+    #endif
+    }
+
+    static bool readAt(int fd, void *target, size_t length, uint64_t offset) {
+        char *data = static_cast<char *>(target);
+
+        while (length > 0) {
+            ssize_t nbRead = pread(fd, data, length, offset);
+            if (nbRead < 0 && errno == EINTR)
+                continue;
+            if (nbRead <= 0)
+                return false;
+
+            data += nbRead;
+            length -= nbRead;
+            offset += nbRead;
+        }
+
+        return true;
+    }
+
+    static bool writeAt(int fd, const void *source, size_t length, uint64_t offset) {
+        const char *data = static_cast<const char *>(source);
+
+        while (length > 0) {
+            ssize_t written = pwrite(fd, data, length, offset);
+            if (written < 0 && errno == EINTR)
+                continue;
+            if (written <= 0)
+                return false;
+
+            data += written;
+            length -= written;
+            offset += written;
+        }
+
+        return true;
+    }
+
+    ResultCache::ResultCache(const string &path, bool hashContents, bool showOutput, const Command *outputs)
+        : path(path), hashContents(hashContents), showOutput(showOutput), outputs(outputs), fd(-1), fileSize(0), nbHits(0), nbMisses(0)
+    {
+        if ((fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666)) < 0)
+            Fatal("Unable to open cache \"%s\": %s", path.c_str(), strerror(errno));
+
+        load();
+    }
+
+    ResultCache::~ResultCache() {
+        if (fd >= 0)
+            close(fd);
+    }
+
+    void ResultCache::load() {
+        struct stat st;
+        if (fstat(fd, &st) != 0)
+            Fatal("Unable to stat cache \"%s\": %s", path.c_str(), strerror(errno));
+
+        fileSize = st.st_size;
+
+        if (fileSize == 0) {
+            if (!writeAt(fd, MAGIC, sizeof(MAGIC), 0))
+                Fatal("Unable to write cache \"%s\": %s", path.c_str(), strerror(errno));
+            fileSize = sizeof(MAGIC);
+            return;
+        }
+
+        char magic[sizeof(MAGIC)];
+        if (!readAt(fd, magic, sizeof(magic), 0) || memcmp(magic, MAGIC, sizeof(MAGIC)) != 0)
+            Fatal("\"%s\" is not a result cache", path.c_str());
+
+        // only the headers are read, the rest is skipped within the buffer
+        // of the stream if possible
+        FILE *f = fdopen(dup(fd), "rb");
+        if (f == NULL)
+            Fatal("Unable to read cache \"%s\": %s", path.c_str(), strerror(errno));
+        fseeko(f, sizeof(MAGIC), SEEK_SET);
+
+        uint64_t offset = sizeof(MAGIC);
+        CacheRecord record;
+
+        while (offset < fileSize) {
+            if (fread(&record, sizeof(record), 1, f) != 1)
+                break;
+
+            const uint64_t end = offset + sizeof(record) + record.filesLength + record.outputLength;
+            if (end > fileSize || end < offset)
+                break;
+
+            index[string(record.key, sizeof(record.key))] = offset;
+            offset = end;
+
+            if (fseeko(f, offset, SEEK_SET) != 0)
+                break;
+        }
+
+        fclose(f);
+
+        if (offset != fileSize) {
+            // a result that was being written when we were killed
+            Warn("Ignoring %llu bytes at the end of cache \"%s\"", (unsigned long long)(fileSize - offset), path.c_str());
+            if (ftruncate(fd, offset) != 0)
+                Fatal("Unable to truncate cache \"%s\": %s", path.c_str(), strerror(errno));
+            fileSize = offset;
+        }
+
+        Debug("Loaded %u cached results from \"%s\"", uint(index.size()), path.c_str());
+    }
+
+    string ResultCache::getKey(const Job &job, const arguments_t &arguments) const {
+        Hasher hasher;
+        hasher.addValue(job.key);
+
+        for (arguments_t::const_iterator argument = arguments.begin(), e = arguments.end(); argument != e; argument++) {
+            struct stat st;
+            if (stat(argument->c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+                continue;
+
+            hasher.add(*argument);
+            hasher.addValue(int64_t(st.st_size));
+
+            if (!hashContents) {
+                hasher.addValue(getMtime(st));
+                continue;
+            }
+
+            int file = open(argument->c_str(), O_RDONLY | O_CLOEXEC);
+            if (file < 0) {
+                hasher.addValue(getMtime(st));
+                continue;
+            }
+
+            char buffer[64 * 1024];
+            ssize_t nbRead;
+            while ((nbRead = read(file, buffer, sizeof(buffer))) > 0 || (nbRead < 0 && errno == EINTR)) {
+                if (nbRead > 0)
+                    hasher.add(buffer, nbRead);
+            }
+
+            close(file);
+        }
+
+        return hasher.getKey();
+    }
+
+    void ResultCache::addOutputs(Job &job, arguments_t::const_iterator values) const {
+        // the template may use fewer placeholders than the command
+        const Job files = outputs->createJob(arguments_t(values, values + outputs->getNbPlaceholders()), job.sequence);
+
+        const Job::stage_t &stage = files.script.pipelines[0][0];
+        job.outputs.insert(job.outputs.end(), stage.words.begin(), stage.words.end());
+    }
+
+    bool ResultCache::replay(Job &job) {
+        arguments_t arguments;
+        for (const char *value = job.arguments.data(), *end = value + job.arguments.size(); value < end; ) {
+            const char *terminator = static_cast<const char *>(memchr(value, '\0', end - value));
+            arguments.push_back(string(value, terminator));
+            value = terminator + 1;
+        }
+
+        job.cacheKey = getKey(job, arguments);
+
+        // reused for all jobs replayed by this thread
+        static thread_local OutputBuffer cachedOutput;
+        if (lookup(job, showOutput ? &cachedOutput : NULL)) {
+            if (showOutput)
+                System::writeOutput(job, cachedOutput);
+            return true;
+        }
+
+        if (outputs != NULL) {
+            // once for every job in the batch
+            const size_t nbPlaceholders = job.pending->getNbPlaceholders();
+            size_t i = 0;
+            do {
+                addOutputs(job, arguments.begin() + i);
+                i += nbPlaceholders;
+            } while (i < arguments.size());
+        }
+
+        return false;
+    }
+
+    // the files the job writes to using > and >>, and those it declared
+    static void getOutputFiles(const Job &job, vector<string> &files) {
+        typedef vector<Job::pipeline_t>::const_iterator pipeline_citer_t;
+        typedef Job::pipeline_t::const_iterator stage_citer_t;
+        typedef vector<Job::stage_t::redirection_t>::const_iterator redirection_citer_t;
+
+        for (pipeline_citer_t p = job.script.pipelines.begin(), pe = job.script.pipelines.end(); p != pe; p++) {
+            for (stage_citer_t s = p->begin(), se = p->end(); s != se; s++) {
+                for (redirection_citer_t r = s->redirections.begin(), re = s->redirections.end(); r != re; r++) {
+                    if (r->type != REDIRECT_IN)
+                        files.push_back(r->target);
+                }
+            }
+        }
+
+        files.insert(files.end(), job.outputs.begin(), job.outputs.end());
+    }
+
+    bool ResultCache::lookup(const Job &job, OutputBuffer *output) {
+        if (job.cacheKey.empty())
+            return false;
+
+        uint64_t offset;
+        {
+            lock_t lock(mutex);
+
+            unordered_map<string, uint64_t>::const_iterator entry = index.find(job.cacheKey);
+            if (entry == index.end()) {
+                nbMisses++;
+                return false;
+            }
+
+            offset = entry->second;
+        }
+
+        CacheRecord record;
+        if (!readAt(fd, &record, sizeof(record), offset)) {
+            nbMisses++;
+            return false;
+        }
+
+        // nothing tells whether the job has to run again
+        if (record.nbFiles == 0) {
+            nbMisses++;
+            return false;
+        }
+
+        // the output wasn't collected last time
+        if (output != NULL && !(record.flags & FLAG_HAS_OUTPUT)) {
+            Debug("Cached result of job %llu has no output", (unsigned long long)job.sequence);
+            nbMisses++;
+            return false;
+        }
+
+        vector<char> files(record.filesLength);
+        if (!files.empty() && !readAt(fd, &files[0], files.size(), offset + sizeof(record))) {
+            nbMisses++;
+            return false;
+        }
+
+        for (size_t position = 0, i = 0; i < record.nbFiles; i++) {
+            CacheFileEntry file;
+            memcpy(&file, &files[position], sizeof(file));
+            string filePath(&files[position + sizeof(file)], file.pathLength);
+            position += sizeof(file) + file.pathLength;
+
+            struct stat st;
+            if (stat(filePath.c_str(), &st) != 0 || int64_t(st.st_size) != file.size || getMtime(st) != file.mtime) {
+                Debug("Output \"%s\" of job %llu has changed", filePath.c_str(), (unsigned long long)job.sequence);
+                nbMisses++;
+                return false;
+            }
+        }
+
+        if (output != NULL) {
+            uint64_t outputOffset = offset + sizeof(record) + record.filesLength;
+            uint64_t remaining = record.outputLength;
+
+            while (remaining > 0) {
+                size_t available;
+                char *target = output->reserve(available);
+                size_t length = size_t(min(uint64_t(available), remaining));
+
+                if (!readAt(fd, target, length, outputOffset)) {
+                    output->clear();
+                    nbMisses++;
+                    return false;
+                }
+
+                output->commit(length);
+                outputOffset += length;
+                remaining -= length;
+            }
+        }
+
+        Debug("Skipping job %llu, its result is cached", (unsigned long long)job.sequence);
+        nbHits++;
+        return true;
+    }
+
+    void ResultCache::store(const Job &job, const OutputBuffer *output) {
+        if (job.cacheKey.empty())
+            return;
+
+        vector<string> outputFiles;
+        getOutputFiles(job, outputFiles);
+
+        // such a job would be skipped whatever happened to the files it
+        // wrote, so it always runs
+        if (outputFiles.empty()) {
+            Debug("Not caching \"%s\", the files it writes aren't known", job.command.c_str());
+            return;
+        }
+
+        string data(sizeof(CacheRecord), '\0');
+        uint32_t nbFiles = 0;
+
+        for (vector<string>::const_iterator f = outputFiles.begin(), e = outputFiles.end(); f != e; f++) {
+            struct stat st;
+            if (stat(f->c_str(), &st) != 0) {
+                Debug("Not caching \"%s\", it didn't write \"%s\"", job.command.c_str(), f->c_str());
+                return;
+            }
+
+            CacheFileEntry file;
+            file.size = st.st_size;
+            file.mtime = getMtime(st);
+            file.pathLength = f->length();
+            file.reserved = 0;
+
+            data.append(reinterpret_cast<const char *>(&file), sizeof(file));
+            data += *f;
+            nbFiles++;
+        }
+
+        CacheRecord record;
+        memcpy(record.key, job.cacheKey.data(), sizeof(record.key));
+        record.flags = (output != NULL) ? FLAG_HAS_OUTPUT : 0;
+        record.nbFiles = nbFiles;
+        record.filesLength = data.length() - sizeof(record);
+        record.outputLength = (output != NULL) ? output->size() : 0;
+        memcpy(&data[0], &record, sizeof(record));
+
+        vector<iovec> buffers;
+        if (output != NULL)
+            output->getBuffers(buffers);
+
+        lock_t lock(mutex);
+
+        uint64_t offset = fileSize;
+        bool written = writeAt(fd, data.data(), data.length(), offset);
+        uint64_t position = offset + data.length();
+
+        for (vector<iovec>::const_iterator b = buffers.begin(), e = buffers.end(); written && b != e; b++) {
+            written = writeAt(fd, b->iov_base, b->iov_len, position);
+            position += b->iov_len;
+        }
+
+        if (!written) {
+            Error("Unable to write to cache \"%s\": %s", path.c_str(), strerror(errno));
+            return;
+        }
+
+        fileSize = position;
+        index[job.cacheKey] = offset;
+    }
+
+}
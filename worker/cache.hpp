@@ -0,0 +1,99 @@
+#ifndef __WORKER_CACHE_
+#define __WORKER_CACHE_
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "api.hpp"
+#include "job.hpp"
+#include "output.hpp"
+#include "command.hpp"
+
+namespace worker {
+
+    /*
+     * Remembers the jobs that succeeded, so they can be skipped when they
+     * are run again with the same inputs.
+     *
+     * The key of a job is a hash of Job::key and of the size and mtime (or
+     * with hashContents the contents) of the arguments that name files.
+     * The files a job writes are those of its > and >> redirections, and
+     * those declared by rendering the outputs template with its arguments.
+     * A job is only skipped if it wrote at least one known file and they
+     * still have the size and mtime they had when it finished, its output
+     * is replayed.
+     *
+     * Jobs are looked up by the thread about to run them, so hashing the
+     * inputs doesn't hold up generating the jobs.
+     *
+     * All results are appended to a single file, only the offset of every
+     * result is kept in memory.
+     */
+    class ResultCache {
+    public:
+        typedef std::vector<std::string> arguments_t;
+
+        // the output of skipped jobs is only replayed with showOutput.
+        // outputs is a list of files with the placeholders of the command,
+        // or NULL, it must outlive the cache.
+        ResultCache(const std::string &path, bool hashContents, bool showOutput, const Command *outputs);
+        ~ResultCache();
+
+        // sets job.cacheKey, returns true and replays the output of the job
+        // if its result is cached, otherwise adds the files declared by the
+        // outputs template to job.outputs. Called right before the job would
+        // run, while its arguments are still packed in Job::arguments.
+        bool replay(Job &job);
+
+        // returns true if job.cacheKey is cached and its outputs are still
+        // valid, if output isn't NULL the cached output is appended to it
+        bool lookup(const Job &job, OutputBuffer *output);
+
+        // the job finished successfully, output is NULL if its output
+        // wasn't collected
+        void store(const Job &job, const OutputBuffer *output);
+
+        inline uint getNbHits() const {
+            return nbHits;
+        }
+
+        inline uint getNbMisses() const {
+            return nbMisses;
+        }
+
+    private:
+        // no copying!
+        ResultCache(const ResultCache &o);
+
+        typedef std::mutex                  mutex_t;
+        typedef std::unique_lock<mutex_t>   lock_t;
+
+        void load();
+
+        // arguments holds the values of every job in the batch
+        std::string getKey(const Job &job, const arguments_t &arguments) const;
+        void addOutputs(Job &job, arguments_t::const_iterator values) const;
+
+        const std::string path;
+        const bool hashContents;
+        const bool showOutput;
+        const Command *outputs;
+
+        int fd;
+        uint64_t fileSize;
+
+        mutex_t mutex;
+
+        // key -> offset of the latest result
+        std::unordered_map<std::string, uint64_t> index;
+
+        std::atomic<uint> nbHits;
+        std::atomic<uint> nbMisses;
+    };
+
+}
+
+#endif // !defined(__WORKER_CACHE_)
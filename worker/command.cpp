@@ -1,35 +1,38 @@
 #include "command.hpp"
 #include "api.hpp"
+#include "system.hpp"
+#include "hash.hpp"
 #include <cstring>
 #include <cstdlib>
 #include <sstream>
-
+#include <algorithm>
 #include <boost/regex.hpp>
 
 /*
- * {
- *  (
- *    ([0-9]+)
- *    (
- *      /([%/]?)([^/]+)/(.+)
- *    )?
- *  )?
- * }
+ * Placeholders have the following syntax:
+ *
+ *   {}                   next argument
+ *   {N}                  argument N
+ *   {N/old/new}          replace the first occurrence of old with new
+ *   {N//old/new}         replace all occurrences of old with new
+ *   {N/%old/new}         replace old with new at the end of the argument
+ *   {N#prefix}           remove prefix from the start of the argument
+ *   {N:s/regex/new/}     replace the first match of regex with new, which
+ *                        may refer to groups with \1 to \9 and the whole
+ *                        match with &, a trailing g replaces all matches
+ *   {N/}                 the basename of the argument
+ *   {N//}                the directory of the argument, . if it has none
+ *   {N.}                 the argument without its extension
+ *   {N/.}                the basename of the argument without its extension
+ *   {#}                  the sequence number of the job
+ *   {%}                  the slot running the job, as in WORKER_SLOT
+ *
+ * where old can't contain a / and new can't contain a / or a }. A / in the
+ * regex or new text of {N:s/...} is written \/. The N is optional for the
+ * path transforms like in {}, but not for the replacements, and a { right
+ * after a $ is never one of the transforms so ${#var} keeps its meaning.
+ * Regular expressions are compiled once, when the command is parsed.
  */
-#define PLACEHOLDER_REGEX         "" \
-    "[{]" \
-        "(" \
-            "([0-9]+)" \
-            "(" \
-                "/([%/]?)([^/]*)/([^/}]*)" \
-            ")?" \
-        ")?" \
-    "[}]"
-#define REG_IDX_GROUP_NUMBER      2
-#define REG_IDX_GROUP_REPLACE     3
-#define REG_IDX_GROUP_REP_TYP     4
-#define REG_IDX_GROUP_REP_OLD     5
-#define REG_IDX_GROUP_REP_NEW     6
 
 
 
@@ -72,70 +75,378 @@ namespace worker {
             str[s.length()] = '\0';
         }
 
+        invalid_regex::invalid_regex(const string &regex, const char *reason) {
+            string s = "invalid regular expression \"" + regex + "\": " + reason;
+
+            str = new char[s.length() + 1];
+            memcpy(str, s.c_str(), s.length());
+            str[s.length()] = '\0';
+        }
+
     }
 
     namespace impl {
 
+        struct CompiledRegex {
+            boost::regex regex;
+
+            explicit CompiledRegex(const string &expression)
+                : regex(expression)
+            {}
+        };
+
+        // where the basename of path starts and ends, ignoring trailing
+        // slashes like basename(1)
+        static void findBasename(const string &path, size_t &start, size_t &end) {
+            end = path.find_last_not_of('/');
+            if (end == string::npos) {
+                // "/" is its own basename
+                start = 0;
+                end = path.empty() ? 0 : 1;
+                return;
+            }
+
+            end++;
+            size_t slash = path.rfind('/', end - 1);
+            start = (slash == string::npos) ? 0 : slash + 1;
+        }
+
+        // where the extension of the basename between start and end
+        // starts, end if it has none: a dot starting the name isn't one
+        static size_t findExtension(const string &path, size_t start, size_t end) {
+            if (end <= start + 1)
+                return end;
+
+            size_t dot = path.rfind('.', end - 1);
+            return (dot == string::npos || dot <= start) ? end : dot;
+        }
+
+        Replacement::Replacement()
+            : super_t(REPLACE_NONE, string(), string(), shared_ptr<const CompiledRegex>())
+        {}
+
         Replacement::Replacement(char typeIdentifier, const std::string &from, const std::string &to)
             : super_t((typeIdentifier == '%') ? REPLACE_END :
                     ((typeIdentifier == '/') ? REPLACE_ALL : REPLACE_FIRST),
-                    from, to)
+                    from, to, shared_ptr<const CompiledRegex>())
         {}
 
-        string &Replacement::apply(string &str) const {
-            switch(getType()) {
+        Replacement::Replacement(ReplacementType type, const std::string &from, const std::string &to)
+            : super_t(type, from, to, shared_ptr<const CompiledRegex>())
+        {
+            if (type != REPLACE_REGEX && type != REPLACE_REGEX_ALL)
+                return;
+
+            try {
+                std::get<3>(*this) = make_shared<const CompiledRegex>(from);
+            } catch (const boost::regex_error &e) {
+                throw exception::invalid_regex(from, e.what());
+            }
+        }
+
+        // counts what Replacement::apply() would append instead of appending
+        // it, along with the single quotes shellQuote() would have to escape
+        struct LengthCounter {
+            typedef char value_type;
+
+            size_t length;
+            size_t quotes;
+
+            LengthCounter() : length(0), quotes(0) {}
+
+            void push_back(char c) {
+                length++;
+                if (c == '\'') quotes++;
+            }
+
+            LengthCounter &append(const string &str, size_t pos, size_t n) {
+                n = min(n, str.length() - pos);
+                length += n;
+                quotes += count(str.begin() + pos, str.begin() + pos + n, '\'');
+                return *this;
+            }
+
+            LengthCounter &operator+=(const string &str) {
+                return append(str, 0, string::npos);
+            }
+
+            LengthCounter &operator+=(char c) {
+                push_back(c);
+                return *this;
+            }
+        };
+
+        // the body of Replacement::apply(), also used to measure its result
+        template <typename Output>
+        static void replace(const Replacement &replacement, const string &str, const JobValues &values, Output &out) {
+            const string &original = replacement.getOriginal();
+            const size_t len = original.length();
+
+            switch(replacement.getType()) {
+            case VALUE_SEQUENCE:
+                out += to_string(values.sequence);
+                return;
+            case VALUE_SLOT:
+                out += itoa(values.slot);
+                return;
+            case REPLACE_PREFIX:
+                if (str.compare(0, len, original) != 0) break;
+
+                out.append(str, len, string::npos);
+                return;
+            case REPLACE_REGEX:
+            case REPLACE_REGEX_ALL: {
+                boost::match_flag_type flags = boost::format_sed;
+                if (replacement.getType() == REPLACE_REGEX)
+                    flags |= boost::format_first_only;
+
+                boost::regex_replace(back_inserter(out), str.begin(), str.end(),
+                        std::get<3>(replacement)->regex, replacement.getReplacement(), flags);
+                return;
+            }
+            case TRANSFORM_BASENAME:
+            case TRANSFORM_BASENAME_NO_EXTENSION: {
+                size_t start, end;
+                findBasename(str, start, end);
+                if (replacement.getType() == TRANSFORM_BASENAME_NO_EXTENSION)
+                    end = findExtension(str, start, end);
+
+                out.append(str, start, end - start);
+                return;
+            }
+            case TRANSFORM_DIRNAME: {
+                size_t start, end;
+                findBasename(str, start, end);
+
+                // the slashes between the directory and the basename
+                size_t dirEnd = str.find_last_not_of('/', (start == 0) ? 0 : start - 1);
+                if (start == 0)
+                    out += (!str.empty() && str[0] == '/') ? '/' : '.';
+                else if (dirEnd == string::npos)
+                    out += '/';
+                else
+                    out.append(str, 0, dirEnd + 1);
+                return;
+            }
+            case TRANSFORM_NO_EXTENSION: {
+                size_t start, end;
+                findBasename(str, start, end);
+                size_t extension = findExtension(str, start, end);
+                if (extension == end) break;
+
+                out.append(str, 0, extension);
+                return;
+            }
             case REPLACE_FIRST: {
-                size_t idx = str.find(getOriginal());
-                if (idx == string::npos) return str;
-                size_t len = getOriginal().length();
+                size_t idx = str.find(original);
+                if (idx == string::npos) break;
 
-                str.replace(idx, len, getReplacement());
-                return str;
+                out.append(str, 0, idx);
+                out += replacement.getReplacement();
+                out.append(str, idx + len, string::npos);
+                return;
             }
             case REPLACE_ALL: {
+                // an empty string would match everywhere without advancing
+                if (len == 0) break;
+
                 size_t offset = 0;
-                string copy = str;
                 while (true) {
-                    size_t idx = copy.find(getOriginal());
-                    if (idx == string::npos) return str;
-                    size_t len = getOriginal().length();
-
-                    str.replace(offset + idx, len, getReplacement());
+                    size_t idx = str.find(original, offset);
+                    if (idx == string::npos) break;
 
-                    offset += idx + len;
-                    copy = str.c_str() + offset;
+                    out.append(str, offset, idx - offset);
+                    out += replacement.getReplacement();
+                    offset = idx + len;
                 }
+
+                out.append(str, offset, string::npos);
+                return;
             }
             case REPLACE_END: {
-                size_t offset = str.length() - getOriginal().length();
+                if (str.length() < len) break;
 
-                if (strcmp(str.c_str() + offset, getOriginal().c_str()) != 0) {
-                    return str;
-                }
+                size_t offset = str.length() - len;
+                if (str.compare(offset, len, original) != 0) break;
 
-                str.replace(offset, getOriginal().length(), getReplacement());
-                return str;
+                out.append(str, 0, offset);
+                out += replacement.getReplacement();
+                return;
             }
             default:
-                return str;
+                break;
             }
+
+            out += str;
+        }
+
+        void Replacement::apply(const string &str, const JobValues &values, string &out) const {
+            replace(*this, str, values, out);
+        }
+
+        size_t Replacement::getLength(const string &str, const JobValues &values, bool quoted) const {
+            LengthCounter counter;
+            replace(*this, str, values, counter);
+            return quoted ? counter.length + 2 + 3 * counter.quotes : counter.length;
         }
 
-        Placeholder::Placeholder(size_t offset, uint idx, size_t length, Replacement *replacement)
+        Placeholder::Placeholder(size_t offset, uint idx, size_t length, const Replacement &replacement)
             : super_t(offset, idx, length, replacement)
         {}
-    }
 
-    typedef boost::regex regex_t;
-    typedef boost::cmatch regmatch_t;
+        size_t Placeholder::getRenderedLength(const vector<string> &arguments, const JobValues &values, bool quoted) const {
+            const Replacement &replacement = std::get<3>(*this);
+            if (replacement.isValue())
+                return replacement.getLength(string(), values, quoted);
+            if (replacement.getType() != REPLACE_NONE)
+                return replacement.getLength(arguments[getIndex()], values, quoted);
+
+            const string &argument = arguments[getIndex()];
+            if (!quoted)
+                return argument.length();
+            return argument.length() + 2 + 3 * count(argument.begin(), argument.end(), '\'');
+        }
+
+        // appends the text of {N:s/regex/new/} starting at str[i] up to the
+        // next unescaped / to out, unescaping \/, and moves i past the /
+        static bool parseDelimited(const string &str, size_t &i, string &out) {
+            const size_t length = str.length();
+
+            for (; i < length; i++) {
+                if (str[i] == '/') {
+                    i++;
+                    return true;
+                }
+
+                if (str[i] == '\\' && i + 1 < length) {
+                    if (str[i + 1] != '/')
+                        out += '\\';
+                    i++;
+                }
+                out += str[i];
+            }
+
+            return false;
+        }
+
+        /*
+         * Parses the placeholder starting at the { in str[start] and returns
+         * its length, or 0 if it isn't a placeholder. A % or / right after
+         * the first / is the type of the replacement, unless the rest of
+         * the placeholder only makes sense with it being part of old.
+         */
+        size_t parsePlaceholder(const string &str, size_t start, bool &hasIndex, uint &index, Replacement &replacement) {
+            const size_t length = str.length();
+            size_t i = start + 1;
+
+            size_t digits = i;
+            while (i < length && str[i] >= '0' && str[i] <= '9')
+                i++;
 
-    static regex_t placeholderRegex(PLACEHOLDER_REGEX);
+            hasIndex = (i != digits);
+            if (hasIndex) {
+                int _pIdx = atoi(str.c_str() + digits);
+                if (_pIdx < 0) {
+                    throw exception::negative_index(_pIdx);
+                }
+                index = uint(_pIdx);
+            }
+
+            if (i < length && str[i] == '}')
+                return i + 1 - start;
+
+            // checked before the replacements, which {N//} would otherwise be
+            if (start == 0 || str[start - 1] != '$') {
+                static const struct {
+                    const char *suffix;
+                    ReplacementType type;
+                } transforms[] = {
+                    { "/}", TRANSFORM_BASENAME },
+                    { "//}", TRANSFORM_DIRNAME },
+                    { ".}", TRANSFORM_NO_EXTENSION },
+                    { "/.}", TRANSFORM_BASENAME_NO_EXTENSION },
+                    { "#}", VALUE_SEQUENCE },
+                    { "%}", VALUE_SLOT },
+                };
+
+                for (size_t t = 0; t < sizeof(transforms) / sizeof(transforms[0]); t++) {
+                    const size_t suffixLength = strlen(transforms[t].suffix);
+                    if (str.compare(i, suffixLength, transforms[t].suffix) != 0)
+                        continue;
+
+                    replacement = Replacement(transforms[t].type);
+                    // the values of the job don't take an index
+                    if (hasIndex && replacement.isValue())
+                        return 0;
+
+                    return i + suffixLength - start;
+                }
+
+                if (hasIndex && i < length && str[i] == '#') {
+                    size_t end = str.find('}', i + 1);
+                    if (end == string::npos)
+                        return 0;
+
+                    replacement = Replacement(REPLACE_PREFIX, str.substr(i + 1, end - i - 1));
+                    return end + 1 - start;
+                }
+
+                if (hasIndex && str.compare(i, 3, ":s/") == 0) {
+                    size_t j = i + 3;
+                    string regex, with;
+                    if (!parseDelimited(str, j, regex) || !parseDelimited(str, j, with))
+                        return 0;
+
+                    bool global = (j < length && str[j] == 'g');
+                    if (global)
+                        j++;
+                    if (j >= length || str[j] != '}')
+                        return 0;
+
+                    replacement = Replacement(global ? REPLACE_REGEX_ALL : REPLACE_REGEX, regex, with);
+                    Debug("Command has regular expression %s->%s", regex.c_str(), with.c_str());
+                    return j + 1 - start;
+                }
+            }
+
+            if (!hasIndex || i >= length || str[i] != '/')
+                return 0;
+            i++;
+
+            const bool typed = (i < length && (str[i] == '%' || str[i] == '/'));
+            for (int attempt = typed ? 0 : 1; attempt < 2; attempt++) {
+                size_t j = (attempt == 0) ? i + 1 : i;
+
+                size_t oldStart = j;
+                while (j < length && str[j] != '/')
+                    j++;
+                if (j >= length) continue;
+                size_t oldEnd = j++;
+
+                size_t newStart = j;
+                while (j < length && str[j] != '/' && str[j] != '}')
+                    j++;
+                if (j >= length || str[j] != '}') continue;
+
+                char typeIdentifier = (attempt == 0) ? str[i] : '\0';
+                replacement = Replacement(typeIdentifier,
+                        str.substr(oldStart, oldEnd - oldStart),
+                        str.substr(newStart, j - newStart));
+
+                Debug("Command has replacement %s->%s", replacement.getOriginal().c_str(), replacement.getReplacement().c_str());
+                return j + 1 - start;
+            }
+
+            return 0;
+        }
+    }
 
     uint getNbPlaceholders(const Command::indices_t &indices) {
         int result = -1;
 
         for (Command::indices_t::const_iterator current = indices.begin(), end = indices.end(); current != end; current++) {
-            result = max(result, static_cast<int>(current->getIndex()));
+            if (!current->isValue())
+                result = max(result, static_cast<int>(current->getIndex()));
         }
 
         return uint(result + 1);
@@ -145,118 +456,715 @@ namespace worker {
         Command::indices_t result;
 
         uint currentRef = 0;
-        size_t stringOffset = 0;
-        const char * const strStart = str.c_str();
-        const char * strCurrent = strStart;
 
-        regmatch_t match;
+        Debug("Locating placeholders in string \"%s\"", str.c_str());
+
+        for (size_t offset = str.find('{'); offset != string::npos; offset = str.find('{', offset)) {
+            bool hasIndex;
+            uint placeholderIdx;
+            Command::replacement_t replacement;
 
-        Debug("Locating placeholders in string \"%s\"", strStart);
+            size_t length = impl::parsePlaceholder(str, offset, hasIndex, placeholderIdx, replacement);
+            if (length == 0) {
+                offset++;
+                continue;
+            }
 
-        while (true) {
-            if (!boost::regex_search(strCurrent, match, placeholderRegex)) {
-                if (!result.empty())
-                    return result;
+            if (replacement.isValue())
+                placeholderIdx = 0;
+            else if (!hasIndex)
+                placeholderIdx = currentRef++;
 
-                Debug("No placeholders given, adding one");
+            Debug("Placeholder %.*s references placeholder %u", length, str.c_str() + offset, placeholderIdx);
 
-                uint placeholderIdx = 0;
-                size_t length = 2;
-                size_t offset = str.length() + 2;
-                str += " \"{}\"";
+            result.push_back(Command::placeholder_t(offset, placeholderIdx, length, replacement));
+            offset += length;
+        }
 
-                result.push_back(Command::placeholder_t(offset, placeholderIdx, length, NULL));
-                return result;
+        // {#} and {%} alone don't use the arguments
+        bool hasArgument = false;
+        for (Command::indices_t::const_iterator current = result.begin(), end = result.end(); current != end; current++)
+            hasArgument = hasArgument || !current->isValue();
+
+        if (!hasArgument) {
+            Debug("No placeholders given, adding one");
+
+            size_t offset = str.length() + 2;
+            str += " \"{}\"";
+
+            result.push_back(Command::placeholder_t(offset, 0, 2, Command::replacement_t()));
+        }
+
+        return result;
+    }
+
+    namespace impl {
+
+        /*
+         * Splits a command into words, pipelines and redirections the way
+         * /bin/sh would, as long as the command only uses |, &&, <, > and
+         * >>, quoting and escaping. Placeholders are kept as separate parts
+         * of a word so their values never get split into multiple words.
+         *
+         * Anything that would require a real shell (variables, globs,
+         * subshells, other operators, builtins, ...) makes the parser give
+         * up, the command is then executed using /bin/sh.
+         */
+        struct ScriptParser {
+            typedef Command::script_t script_t;
+            typedef script_t::stage_t stage_t;
+            typedef script_t::pipeline_t pipeline_t;
+
+            const string &str;
+            const Command::indices_t &indices;
+
+            script_t &script;
+            pipeline_t pipeline;
+            stage_t stage;
+
+            Word word;
+            bool inWord;
+            bool wordHasAssignment;
+            bool wordIsNumber;
+
+            bool redirecting;
+            RedirectionType redirectionType;
+
+            ScriptParser(const string &str, const Command::indices_t &indices, script_t &script)
+                : str(str), indices(indices), script(script), inWord(false),
+                  wordHasAssignment(false), wordIsNumber(true), redirecting(false),
+                  redirectionType(REDIRECT_OUT)
+            {}
+
+            void addLiteral(char c) {
+                if (word.empty() || word.back().isPlaceholder) {
+                    WordPart part;
+                    part.isPlaceholder = false;
+                    part.placeholder = 0;
+                    word.push_back(part);
+                }
+
+                word.back().text += c;
+                inWord = true;
             }
 
-            size_t offset = match.position();
-            size_t length = match.length();
+            void addPlaceholder(size_t idx) {
+                WordPart part;
+                part.isPlaceholder = true;
+                part.placeholder = idx;
+                word.push_back(part);
 
-            uint placeholderIdx;
-            Command::replacement_t *replacementPtr = NULL;
-            if (length == 2)
-                placeholderIdx = currentRef++;
-            else {
-                size_t idxOffset = match.position(REG_IDX_GROUP_NUMBER);
-                size_t idxLength = match.length(REG_IDX_GROUP_NUMBER);
+                inWord = true;
+                wordIsNumber = false;
+            }
 
-                char idx[idxLength + 1];
-                memcpy(idx, strCurrent + idxOffset, idxLength);
-                idx[idxLength] = '\0';
+            bool endWord() {
+                if (!inWord)
+                    return true;
 
-                int _pIdx = atoi(idx);
-                if (_pIdx < 0) {
-                    throw exception::negative_index(_pIdx);
+                if (redirecting) {
+                    Redirection<Word> redirection;
+                    redirection.type = redirectionType;
+                    redirection.target = word;
+                    stage.redirections.push_back(redirection);
+                    redirecting = false;
+                } else {
+                    // FOO=bar cmd sets a variable
+                    if (stage.words.empty() && wordHasAssignment)
+                        return false;
+
+                    stage.words.push_back(word);
+                }
+
+                word.clear();
+                inWord = false;
+                wordHasAssignment = false;
+                wordIsNumber = true;
+                return true;
+            }
+
+            bool endStage() {
+                if (!endWord() || redirecting || stage.words.empty())
+                    return false;
+
+                pipeline.push_back(stage);
+                stage = stage_t();
+                return true;
+            }
+
+            bool endPipeline() {
+                if (!endStage())
+                    return false;
+
+                script.pipelines.push_back(pipeline);
+                pipeline.clear();
+                return true;
+            }
+
+            bool startRedirection(RedirectionType type) {
+                // 2>file redirects a specific file descriptor
+                if (inWord && wordIsNumber)
+                    return false;
+
+                if (!endWord() || redirecting)
+                    return false;
+
+                redirecting = true;
+                redirectionType = type;
+                return true;
+            }
+
+            static bool isShellCommand(const Word &word) {
+                static const char * const shellWords[] = {
+                    // reserved words
+                    "!", "{", "}", "case", "do", "done", "elif", "else", "esac",
+                    "fi", "for", "if", "in", "then", "until", "while",
+                    // builtins that don't exist as a program or that change
+                    // the state of the shell
+                    ".", ":", "alias", "bg", "break", "cd", "command", "continue",
+                    "eval", "exec", "exit", "export", "fg", "getopts", "hash",
+                    "jobs", "local", "read", "readonly", "return", "set", "shift",
+                    "source", "times", "trap", "type", "ulimit", "umask",
+                    "unalias", "unset", "wait",
+                    // builtins that behave differently from the program of
+                    // the same name, e.g. the escapes echo interprets
+                    "[", "echo", "kill", "printf", "pwd", "test",
+                    NULL
+                };
+
+                if (word.size() != 1 || word[0].isPlaceholder)
+                    return false;
+
+                for (const char * const *w = shellWords; *w != NULL; w++) {
+                    if (word[0].text == *w)
+                        return true;
                 }
-                placeholderIdx = uint(_pIdx);
 
-                if (length != idxLength + 2) {
-                    // replacement is a match!
-                    size_t oldOffset = match.position(REG_IDX_GROUP_REP_OLD);
-                    size_t oldLength = match.length(REG_IDX_GROUP_REP_OLD);
+                return false;
+            }
+
+            bool parse() {
+                typedef enum { QUOTE_NONE, QUOTE_SINGLE, QUOTE_DOUBLE } quote_t;
+                quote_t quote = QUOTE_NONE;
 
-                    size_t newOffset = match.position(REG_IDX_GROUP_REP_NEW);
-                    size_t newLength = match.length(REG_IDX_GROUP_REP_NEW);
+                Command::indices_t::const_iterator placeholder = indices.begin();
+                const size_t length = str.length();
 
-                    char typeIdentifier = '\0';
-                    if (match.length(REG_IDX_GROUP_REP_TYP))
-                        typeIdentifier = *(strCurrent + match.position(REG_IDX_GROUP_REP_TYP));
+                for (size_t i = 0; i < length; ) {
+                    if (placeholder != indices.end() && placeholder->getOffset() == i) {
+                        addPlaceholder(placeholder - indices.begin());
+                        i += placeholder->getLength();
+                        placeholder++;
+                        continue;
+                    }
 
-                    char oldPart[oldLength + 1];
-                    char newPart[newLength + 1];
+                    const char c = str[i];
+                    const char next = (i + 1 < length) ? str[i + 1] : '\0';
 
-                    memcpy(oldPart, strCurrent + oldOffset, oldLength);
-                    oldPart[oldLength] = '\0';
+                    if (quote == QUOTE_SINGLE) {
+                        if (c == '\'')
+                            quote = QUOTE_NONE;
+                        else
+                            addLiteral(c);
 
-                    memcpy(newPart, strCurrent + newOffset, newLength);
-                    newPart[newLength] = '\0';
+                        i++;
+                        continue;
+                    }
 
-                    Debug("Command has replacement %s->%s", oldPart, newPart);
-                    replacementPtr = new Command::replacement_t(typeIdentifier, oldPart, newPart);
+                    if (quote == QUOTE_DOUBLE) {
+                        switch (c) {
+                        case '"':
+                            quote = QUOTE_NONE;
+                            break;
+                        case '$': case '`':
+                            return false;
+                        case '\\':
+                            if (next == '\n' || next == '\0') {
+                                return false;
+                            } else if (next == '$' || next == '`' || next == '"' || next == '\\') {
+                                addLiteral(next);
+                                i++;
+                            } else {
+                                addLiteral(c);
+                            }
+                            break;
+                        default:
+                            addLiteral(c);
+                        }
+
+                        i++;
+                        continue;
+                    }
+
+                    switch (c) {
+                    case ' ': case '\t':
+                        if (!endWord())
+                            return false;
+                        break;
+                    case '\'':
+                        quote = QUOTE_SINGLE;
+                        inWord = true;
+                        wordIsNumber = false;
+                        break;
+                    case '"':
+                        quote = QUOTE_DOUBLE;
+                        inWord = true;
+                        wordIsNumber = false;
+                        break;
+                    case '\\':
+                        if (next == '\n' || next == '\0')
+                            return false;
+                        addLiteral(next);
+                        wordIsNumber = false;
+                        i++;
+                        break;
+                    case '|':
+                        if (next == '|' || next == '&' || !endStage())
+                            return false;
+                        break;
+                    case '&':
+                        if (next != '&' || !endPipeline())
+                            return false;
+                        i++;
+                        break;
+                    case '>':
+                        if (next == '&' || next == '|')
+                            return false;
+                        if (!startRedirection(next == '>' ? REDIRECT_APPEND : REDIRECT_OUT))
+                            return false;
+                        if (next == '>')
+                            i++;
+                        break;
+                    case '<':
+                        if (next == '<' || next == '>' || next == '&')
+                            return false;
+                        if (!startRedirection(REDIRECT_IN))
+                            return false;
+                        break;
+                    case '#': case '~':
+                        if (!inWord)
+                            return false;
+                        addLiteral(c);
+                        wordIsNumber = false;
+                        break;
+                    case '=':
+                        addLiteral(c);
+                        wordHasAssignment = true;
+                        wordIsNumber = false;
+                        break;
+                    case ';': case '(': case ')': case '$': case '`':
+                    case '*': case '?': case '[': case '{': case '}':
+                    case '\n': case '\r':
+                        return false;
+                    default:
+                        addLiteral(c);
+                        if (c < '0' || c > '9')
+                            wordIsNumber = false;
+                    }
+
+                    i++;
+                }
+
+                if (quote != QUOTE_NONE || !endPipeline())
+                    return false;
+
+                typedef std::vector<pipeline_t>::const_iterator pipeline_citer_t;
+                typedef pipeline_t::const_iterator stage_citer_t;
+                for (pipeline_citer_t p = script.pipelines.begin(), pe = script.pipelines.end(); p != pe; p++) {
+                    for (stage_citer_t s = p->begin(), se = p->end(); s != se; s++) {
+                        if (isShellCommand(s->words.front()))
+                            return false;
+                    }
                 }
+
+                return true;
             }
+        };
 
-            Debug("Placeholder %.*s references placeholder %u", length, strCurrent + offset, placeholderIdx);
+    }
 
-            result.push_back(Command::placeholder_t(stringOffset + offset, placeholderIdx, length, replacementPtr));
+    ExecutionMode parseScript(const string &str, const Command::indices_t &indices, Command::script_t &script) {
+        impl::ScriptParser parser(str, indices, script);
 
-            stringOffset += offset + length;
-            strCurrent += offset + length;
+        if (!parser.parse()) {
+            script.pipelines.clear();
+            return EXEC_SHELL;
         }
+
+        if (script.pipelines.size() == 1 && script.pipelines[0].size() == 1
+                && script.pipelines[0][0].redirections.empty())
+            return EXEC_ARGV;
+
+        return EXEC_NATIVE;
+    }
+
+    // the quote every placeholder is in, for /bin/sh
+    vector<char> getQuotes(const string &str, const Command::indices_t &indices) {
+        vector<char> result;
+        result.reserve(indices.size());
+
+        char quote = '\0';
+        Command::indices_t::const_iterator placeholder = indices.begin();
+
+        for (size_t i = 0, length = str.length(); i < length && placeholder != indices.end(); ) {
+            if (placeholder->getOffset() <= i) {
+                result.push_back(quote);
+                i = placeholder->getOffset() + placeholder->getLength();
+                placeholder++;
+                continue;
+            }
+
+            const char c = str[i++];
+            if (quote == '\'') {
+                if (c == '\'')
+                    quote = '\0';
+            } else if (c == '\\') {
+                i++;
+            } else if (c == '"' || (c == '\'' && quote == '\0')) {
+                quote = (quote == c) ? '\0' : c;
+            }
+        }
+
+        result.resize(indices.size(), quote);
+        return result;
     }
 
-    Command::Command(const string &c)
+    Command::Command(const string &c, bool forceShell)
         : command(c), indices(getPlaceholders(const_cast<string &>(command)))
     {
         Debug("Created command for string \"%s\" with %u placeholder references", command.c_str(), indices.size());
         nbPlaceholders = ::worker::getNbPlaceholders(indices);
+
+        literalLength = command.length();
+        for (indices_t::const_iterator current = indices.begin(), end = indices.end(); current != end; current++)
+            literalLength -= current->getLength();
+
+        quotes = getQuotes(command, indices);
+
+        slotted = false;
+        for (indices_t::const_iterator current = indices.begin(), end = indices.end(); current != end; current++)
+            slotted = slotted || (current->isValue() && current->getReplacement()->getType() == impl::VALUE_SLOT);
+
+        mode = forceShell ? EXEC_SHELL : parseScript(command, indices, script);
+        Debug("Command will be executed %s", (mode == EXEC_ARGV) ? "directly"
+                : ((mode == EXEC_NATIVE) ? "using the built-in shell" : "using /bin/sh"));
     }
 
     string Command::fillArguments(const arguments_t &arguments) const {
+        string result;
+        fillArguments(arguments, result);
+        return result;
+    }
+
+    void Command::fillArguments(const arguments_t &arguments, string &out) const {
+        impl::JobValues values = { 0, System::getSlot() };
+        fillArguments(arguments, values, out);
+    }
+
+    void Command::fillArguments(const arguments_t &arguments, const impl::JobValues &values, string &out) const {
+        if (arguments.size() != nbPlaceholders)
+            throw exception::invalid_argument_count(nbPlaceholders, arguments.size());
+
+        // every value but {#} and {%} is quoted for /bin/sh, the same way
+        // as in a batch
+        size_t length = literalLength;
+        for (size_t i = 0, nb = indices.size(); i < nb; i++) {
+            const placeholder_t &placeholder = indices[i];
+            length += placeholder.getRenderedLength(arguments, values, !placeholder.isValue());
+            if (!placeholder.isValue() && quotes[i] != '\0')
+                length += 2;
+        }
+
+        out.clear();
+        out.reserve(length);
+        string value;
+
+        size_t offset = 0;
+        for (size_t i = 0, nb = indices.size(); i < nb; i++) {
+            const placeholder_t &placeholder = indices[i];
+            out.append(command, offset, placeholder.getOffset() - offset);
+            offset = placeholder.getOffset() + placeholder.getLength();
+
+            if (placeholder.isValue()) {
+                placeholder.render(arguments, values, out);
+                continue;
+            }
+
+            if (quotes[i] != '\0')
+                out += quotes[i];
+
+            if (placeholder.getReplacement() == NULL) {
+                shellQuote(arguments[placeholder.getIndex()], out);
+            } else {
+                value.clear();
+                placeholder.render(arguments, values, value);
+                shellQuote(value, out);
+            }
+
+            if (quotes[i] != '\0')
+                out += quotes[i];
+        }
+        out.append(command, offset, string::npos);
+
+        Debug("After filling in arguments \"%s\" becomes \"%s\".", command.c_str(), out.c_str());
+    }
+
+    void Command::renderWords(const impl::Word &word, const arguments_t *batch, size_t size,
+            const impl::JobValues &values, vector<string> &words) const {
+        words.push_back(string());
+
+        for (impl::Word::const_iterator part = word.begin(), end = word.end(); part != end; part++) {
+            if (!part->isPlaceholder) {
+                words.back() += part->text;
+                continue;
+            }
+
+            // {#} and {%} have a single value for the whole batch
+            const placeholder_t &placeholder = indices[part->placeholder];
+            if (placeholder.isValue()) {
+                placeholder.render(batch[0], values, words.back());
+                continue;
+            }
+
+            for (size_t i = 0; i < size; i++) {
+                if (i > 0)
+                    words.push_back(string());
+
+                placeholder.render(batch[i], values, words.back());
+            }
+        }
+    }
+
+    void Command::renderScript(const arguments_t *batch, size_t size, const impl::JobValues &values, Job &job) const {
+        typedef std::vector<script_t::pipeline_t>::const_iterator pipeline_citer_t;
+        typedef script_t::pipeline_t::const_iterator stage_citer_t;
+        typedef std::vector<impl::Word>::const_iterator word_citer_t;
+        typedef std::vector<script_t::stage_t::redirection_t>::const_iterator redirection_citer_t;
+
+        job.script.pipelines.reserve(script.pipelines.size());
+        for (pipeline_citer_t p = script.pipelines.begin(), pe = script.pipelines.end(); p != pe; p++) {
+            job.script.pipelines.push_back(Job::pipeline_t());
+            Job::pipeline_t &pipeline = job.script.pipelines.back();
+            pipeline.reserve(p->size());
+
+            for (stage_citer_t s = p->begin(), se = p->end(); s != se; s++) {
+                pipeline.push_back(Job::stage_t());
+                Job::stage_t &stage = pipeline.back();
+
+                stage.words.reserve(s->words.size());
+                for (word_citer_t w = s->words.begin(), we = s->words.end(); w != we; w++)
+                    renderWords(*w, batch, size, values, stage.words);
+
+                for (redirection_citer_t r = s->redirections.begin(), re = s->redirections.end(); r != re; r++) {
+                    vector<string> target;
+                    renderWords(r->target, batch, size, values, target);
+
+                    // like /bin/sh, only the first word is the target and
+                    // the others are extra arguments
+                    Job::stage_t::redirection_t redirection;
+                    redirection.type = r->type;
+                    redirection.target = target[0];
+                    stage.redirections.push_back(redirection);
+                    stage.words.insert(stage.words.end(), target.begin() + 1, target.end());
+                }
+            }
+        }
+    }
+
+    Job Command::createJob(const arguments_t &arguments, uint64_t sequence) const {
+        Job job;
+        job.sequence = sequence;
+        job.mode = mode;
+        job.cost = 0;
+
+        impl::JobValues values = { sequence, System::getSlot() };
+        fillArguments(arguments, values, job.command);
+
+        if (mode != EXEC_SHELL)
+            renderScript(&arguments, 1, values, job);
+
+        return job;
+    }
+
+    void Command::fillArguments(const batch_t &batch, string &out) const {
+        impl::JobValues values = { 0, System::getSlot() };
+        fillArguments(batch, values, out);
+    }
+
+    void Command::fillArguments(const batch_t &batch, const impl::JobValues &values, string &out) const {
+        for (batch_t::const_iterator arguments = batch.begin(), end = batch.end(); arguments != end; arguments++) {
+            if (arguments->size() != nbPlaceholders)
+                throw exception::invalid_argument_count(nbPlaceholders, arguments->size());
+        }
+
+        out.clear();
+        string value;
+
+        size_t offset = 0;
+        for (size_t i = 0, nb = indices.size(); i < nb; i++) {
+            const placeholder_t &placeholder = indices[i];
+            out.append(command, offset, placeholder.getOffset() - offset);
+            offset = placeholder.getOffset() + placeholder.getLength();
+
+            // a number, which doesn't need quoting either
+            if (placeholder.isValue()) {
+                placeholder.render(batch[0], values, out);
+                continue;
+            }
+
+            // close the quotes around the placeholder so the values can be
+            // separate words, and open them again afterwards
+            if (quotes[i] != '\0')
+                out += quotes[i];
+
+            for (batch_t::const_iterator arguments = batch.begin(), end = batch.end(); arguments != end; arguments++) {
+                if (arguments != batch.begin())
+                    out += ' ';
+
+                value.clear();
+                placeholder.render(*arguments, values, value);
+                shellQuote(value, out);
+            }
+
+            if (quotes[i] != '\0')
+                out += quotes[i];
+        }
+        out.append(command, offset, string::npos);
+    }
+
+    Job Command::createJob(const batch_t &batch, uint64_t sequence) const {
+        Job job;
+        job.sequence = sequence;
+        job.mode = mode;
+        job.cost = 0;
+
+        impl::JobValues values = { sequence, System::getSlot() };
+        fillArguments(batch, values, job.command);
+
+        if (mode != EXEC_SHELL)
+            renderScript(batch.data(), batch.size(), values, job);
+
+        return job;
+    }
+
+    static void packArguments(const Command::arguments_t &arguments, string &out) {
+        for (Command::arguments_t::const_iterator a = arguments.begin(), e = arguments.end(); a != e; a++) {
+            out += *a;
+            out += '\0';
+        }
+    }
+
+    Job Command::createPendingJob(const arguments_t &arguments, uint64_t sequence) const {
         if (arguments.size() != nbPlaceholders)
             throw exception::invalid_argument_count(nbPlaceholders, arguments.size());
 
-        string command = this->command;
+        Job job;
+        job.sequence = sequence;
+        job.pending = this;
+        packArguments(arguments, job.arguments);
+
+        return job;
+    }
+
+    Job Command::createPendingJob(const batch_t &batch, uint64_t sequence) const {
+        Job job;
+        job.sequence = sequence;
+        job.pending = this;
+        job.batched = true;
+
+        for (batch_t::const_iterator arguments = batch.begin(), end = batch.end(); arguments != end; arguments++) {
+            if (arguments->size() != nbPlaceholders)
+                throw exception::invalid_argument_count(nbPlaceholders, arguments->size());
+
+            packArguments(*arguments, job.arguments);
+        }
+
+        return job;
+    }
+
+    void Command::render(Job &job) {
+        if (job.pending == NULL)
+            return;
+
+        const Command &command = *job.pending;
+
+        // a batch always has at least one job, even without placeholders
+        batch_t batch(1);
+        for (const char *value = job.arguments.data(), *end = value + job.arguments.size(); value < end; ) {
+            if (batch.back().size() == command.nbPlaceholders)
+                batch.push_back(arguments_t());
+
+            const char *terminator = static_cast<const char *>(memchr(value, '\0', end - value));
+            batch.back().push_back(string(value, terminator));
+            value = terminator + 1;
+        }
+
+        Job rendered = job.batched ? command.createJob(batch, job.sequence) : command.createJob(batch[0], job.sequence);
+
+        job.mode = rendered.mode;
+        job.command.swap(rendered.command);
+        job.script.pipelines.swap(rendered.script.pipelines);
+
+        if (command.slotted && System::getSlot() < 0)
+            return;
+
+        job.pending = NULL;
+        string().swap(job.arguments);
+    }
+
+    size_t Command::getBatchLength(const arguments_t &arguments) const {
+        // only used by {#} and {%}, which are skipped
+        static const impl::JobValues values = { 0, -1 };
 
-        for (indices_t::const_reverse_iterator current = indices.rbegin(), end = indices.rend(); current != end; current++) {
-            size_t strIdx = current->getOffset();
-            size_t strLen = current->getLength();
+        size_t length = 0;
+        string value;
 
-            uint placeholderId = current->getIndex();
+        for (indices_t::const_iterator current = indices.begin(), end = indices.end(); current != end; current++) {
+            // part of the length of the command, once per batch
+            if (current->isValue())
+                continue;
 
-            const replacement_t *replacement = current->getReplacement();
-            string argument = arguments[placeholderId];
+            value.clear();
+            current->render(arguments, values, value);
 
-            if (replacement != NULL) {
-                replacement->apply(argument);
+            if (mode == EXEC_SHELL) {
+                // quotes and a space, every ' becomes '\''
+                length += value.length() + 3 + 3 * size_t(count(value.begin(), value.end(), '\''));
+            } else {
+                // a separate argument with its pointer in argv
+                length += value.length() + 1 + sizeof(char *);
             }
+        }
 
-            Debug("running command.replace(%u, %u, \"%s\")", strIdx, strLen, argument.c_str());
-            command.replace(strIdx, strLen, argument);
+        return length;
+    }
+
+    bool Command::writesFiles() const {
+        typedef std::vector<script_t::pipeline_t>::const_iterator pipeline_citer_t;
+        typedef script_t::pipeline_t::const_iterator stage_citer_t;
+        typedef std::vector<script_t::stage_t::redirection_t>::const_iterator redirection_citer_t;
+
+        if (mode == EXEC_SHELL)
+            return false;
+
+        for (pipeline_citer_t p = script.pipelines.begin(), pe = script.pipelines.end(); p != pe; p++) {
+            for (stage_citer_t s = p->begin(), se = p->end(); s != se; s++) {
+                for (redirection_citer_t r = s->redirections.begin(), re = s->redirections.end(); r != re; r++) {
+                    if (r->type != REDIRECT_IN)
+                        return true;
+                }
+            }
         }
 
-        Debug("After filling in arguments \"%s\" becomes \"%s\".", this->command.c_str(), command.c_str());
+        return false;
+    }
+
+    uint64_t Command::getKey(const arguments_t &arguments) const {
+        Hasher hasher;
+        hasher.add(command);
+        for (arguments_t::const_iterator argument = arguments.begin(), end = arguments.end(); argument != end; argument++)
+            hasher.add(*argument);
 
-        return command;
+        return hasher.get64();
     }
 }
@@ -2,10 +2,12 @@
 #define __WORKER_COMMAND_
 
 #include "api.hpp"
+#include "job.hpp"
 #include <string>
 #include <exception>
 #include <vector>
 #include <tuple>
+#include <memory>
 
 namespace worker {
 
@@ -24,18 +26,42 @@ namespace worker {
             invalid_placeholder(int index);
         };
 
+        struct invalid_regex : public exception {
+            invalid_regex(const std::string &regex, const char *reason);
+        };
+
     }
 
     namespace impl {
 
-        typedef enum { REPLACE_FIRST, REPLACE_ALL, REPLACE_END } ReplacementType;
+        typedef enum {
+            REPLACE_NONE, REPLACE_FIRST, REPLACE_ALL, REPLACE_END,
+            REPLACE_PREFIX, REPLACE_REGEX, REPLACE_REGEX_ALL,
+            TRANSFORM_BASENAME, TRANSFORM_DIRNAME, TRANSFORM_NO_EXTENSION, TRANSFORM_BASENAME_NO_EXTENSION,
+            // not applied to an argument, but replaced by a value of the job
+            VALUE_SEQUENCE, VALUE_SLOT
+        } ReplacementType;
+
+        // the values of the job a placeholder can refer to besides its
+        // arguments
+        struct JobValues {
+            uint64_t sequence;
+            int slot;
+        };
+
+        // a regular expression, compiled once by the command
+        struct CompiledRegex;
 
-        struct Replacement : public std::tuple<ReplacementType, std::string, std::string> {
+        struct Replacement : public std::tuple<ReplacementType, std::string, std::string, std::shared_ptr<const CompiledRegex> > {
         private:
-            typedef std::tuple<ReplacementType, std::string, std::string> super_t;
+            typedef std::tuple<ReplacementType, std::string, std::string, std::shared_ptr<const CompiledRegex> > super_t;
 
         public:
+            Replacement();
             Replacement(char typeIdentifier, const std::string &from, const std::string &to);
+            // compiles from if type is REPLACE_REGEX or REPLACE_REGEX_ALL
+            explicit Replacement(ReplacementType type, const std::string &from = std::string(),
+                    const std::string &to = std::string());
 
             inline ReplacementType getType() const {
                 return std::get<0>(*this);
@@ -49,15 +75,24 @@ namespace worker {
                 return std::get<2>(*this);
             }
 
-            std::string &apply(std::string &str) const;
+            inline bool isValue() const {
+                return getType() == VALUE_SEQUENCE || getType() == VALUE_SLOT;
+            }
+
+            // appends str with the replacement applied to out, or the value
+            // of the job if this is a value
+            void apply(const std::string &str, const JobValues &values, std::string &out) const;
+            // the length of what apply() appends, quoted by shellQuote()
+            // if quoted, without building it
+            size_t getLength(const std::string &str, const JobValues &values, bool quoted) const;
         };
 
-        struct Placeholder : public std::tuple<size_t, uint, size_t, Replacement*> {
+        struct Placeholder : public std::tuple<size_t, uint, size_t, Replacement> {
         private:
-            typedef std::tuple<size_t, uint, size_t, Replacement*> super_t;
+            typedef std::tuple<size_t, uint, size_t, Replacement> super_t;
 
         public:
-            Placeholder(size_t offset, uint idx, size_t length, Replacement *replacement);
+            Placeholder(size_t offset, uint idx, size_t length, const Replacement &replacement);
 
             inline size_t getOffset() const {
                 return std::get<0>(*this);
@@ -72,9 +107,39 @@ namespace worker {
             }
 
             inline const Replacement *getReplacement() const {
-                return std::get<3>(*this);
+                return (std::get<3>(*this).getType() == REPLACE_NONE) ? NULL : &std::get<3>(*this);
             }
+
+            // whether this is {#} or {%}, which don't refer to an argument
+            inline bool isValue() const {
+                return std::get<3>(*this).isValue();
+            }
+
+            // appends the value of this placeholder to out
+            inline void render(const std::vector<std::string> &arguments, const JobValues &values, std::string &out) const {
+                const Replacement *replacement = getReplacement();
+                if (replacement == NULL)
+                    out += arguments[getIndex()];
+                else if (replacement->isValue())
+                    replacement->apply(std::string(), values, out);
+                else
+                    replacement->apply(arguments[getIndex()], values, out);
+            }
+
+            // the length of what render() appends, quoted by shellQuote()
+            // if quoted
+            size_t getRenderedLength(const std::vector<std::string> &arguments, const JobValues &values, bool quoted) const;
         };
+
+        // part of a word in the command: either literal text or a reference
+        // to a placeholder (by its position in Command::indices_t)
+        struct WordPart {
+            bool isPlaceholder;
+            std::string text;
+            size_t placeholder;
+        };
+
+        typedef std::vector<WordPart> Word;
     }
 
     class Command {
@@ -83,19 +148,83 @@ namespace worker {
         typedef impl::Placeholder placeholder_t;
         typedef std::vector<placeholder_t> indices_t;
         typedef std::vector<std::string> arguments_t;
+        // the arguments of several jobs, executed by a single invocation
+        typedef std::vector<arguments_t> batch_t;
+        typedef impl::Script<impl::Word> script_t;
 
     private:
         const std::string command;
         const indices_t indices;
         uint nbPlaceholders;
 
+        ExecutionMode mode;
+        script_t script;
+
+        // length of the command without its placeholders
+        size_t literalLength;
+        // whether a placeholder is {%}
+        bool slotted;
+
+        // the quote ('\0', '\'' or '"') every placeholder is in when the
+        // command is passed to /bin/sh
+        std::vector<char> quotes;
+
+        // renders word for every arguments_t in batch, a placeholder that
+        // gets multiple values ends the current word after every value but
+        // the last one, the way an unquoted "$@" would
+        void renderWords(const impl::Word &word, const arguments_t *batch, size_t size,
+                const impl::JobValues &values, std::vector<std::string> &words) const;
+        void renderScript(const arguments_t *batch, size_t size, const impl::JobValues &values, Job &job) const;
+
+        void fillArguments(const arguments_t &arguments, const impl::JobValues &values, std::string &out) const;
+        void fillArguments(const batch_t &batch, const impl::JobValues &values, std::string &out) const;
+
     public:
-        Command(const std::string &command);
+        Command(const std::string &command, bool forceShell = false);
 
         inline uint getNbPlaceholders() const {
             return nbPlaceholders;
         }
+
+        inline ExecutionMode getExecutionMode() const {
+            return mode;
+        }
+
+        // {#} is 0 and {%} the slot of the calling thread, the other values
+        // are quoted for /bin/sh
         std::string fillArguments(const arguments_t &arguments) const;
+        // same as above, but reuses the memory already allocated by out
+        void fillArguments(const arguments_t &arguments, std::string &out) const;
+        Job createJob(const arguments_t &arguments, uint64_t sequence) const;
+
+        // same as above, but every placeholder expands to the values of
+        // all arguments in the batch, quoted for /bin/sh if need be
+        void fillArguments(const batch_t &batch, std::string &out) const;
+        Job createJob(const batch_t &batch, uint64_t sequence) const;
+
+        // same as createJob(), but the job only holds a copy of the
+        // arguments, packed into a single string, until render() is called
+        // on it right before it runs
+        Job createPendingJob(const arguments_t &arguments, uint64_t sequence) const;
+        Job createPendingJob(const batch_t &batch, uint64_t sequence) const;
+
+        // renders a job created by createPendingJob(), does nothing if the
+        // job has been rendered already. A job whose command uses {%} stays
+        // pending when rendered outside of a slot, and is rendered again
+        // once it runs.
+        static void render(Job &job);
+
+        // the number of bytes the arguments add to the arguments of a batch
+        // when it is executed
+        size_t getBatchLength(const arguments_t &arguments) const;
+
+        // whether the command writes to files using > or >>, always false
+        // for commands executed using /bin/sh
+        bool writesFiles() const;
+
+        // a hash of the template and the arguments, which identifies a job
+        // across runs without rendering it, so it doesn't depend on {%}
+        uint64_t getKey(const arguments_t &arguments) const;
     };
 
 }
@@ -0,0 +1,319 @@
+#include "coprocess.hpp"
+#include "system.hpp"
+#include "api.hpp"
+#include "stats.hpp"
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+using namespace std;
+
+namespace worker {
+
+    static const size_t READ_SIZE = 64 * 1024;
+
+    string Coprocess::program;
+
+    void Coprocess::setProgram(const string &program) {
+        Coprocess::program = program;
+    }
+
+    Coprocess::Coprocess(bool quiet)
+        : quiet(quiet), pid(-1), input(-1), output(-1), status(-1)
+    {}
+
+    Coprocess::~Coprocess() {
+        stop();
+    }
+
+    bool Coprocess::start() {
+        // a socket rather than a pipe, so writing to a coprocess that died
+        // can be done without raising SIGPIPE
+        int jobFds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, jobFds) != 0) {
+            Error("Failed to create socket for coprocess: %s", strerror(errno));
+            return false;
+        }
+
+        int statusFds[2];
+        if (!System::createPipe(statusFds)) {
+            Fatal("Failed to create pipe, aborting...");
+        }
+
+        int outputFd;
+        if (quiet) {
+            outputFd = System::getNullFd();
+        } else if (System::getOutputMode() == System::OUTPUT_PASSTHROUGH) {
+            outputFd = 1;
+        } else {
+            int outputFds[2];
+            if (!System::createPipe(outputFds)) {
+                Fatal("Failed to create pipe, aborting...");
+            }
+
+            output = outputFds[0];
+            outputFd = outputFds[1];
+            fcntl(output, F_SETFL, fcntl(output, F_GETFL) | O_NONBLOCK);
+        }
+
+        vector<SpawnAction> actions;
+        actions.push_back(SpawnAction(SpawnAction::ACTION_DUP2, 0, jobFds[1]));
+        actions.push_back(SpawnAction(SpawnAction::ACTION_DUP2, 1, outputFd));
+        actions.push_back(SpawnAction(SpawnAction::ACTION_DUP2, 2, outputFd));
+        actions.push_back(SpawnAction(SpawnAction::ACTION_DUP2, 3, statusFds[1]));
+
+        vector<char *> argv;
+        argv.push_back(const_cast<char *>("/bin/sh"));
+        if (!program.empty()) {
+            argv.push_back(const_cast<char *>("-c"));
+            argv.push_back(const_cast<char *>(program.c_str()));
+        }
+        argv.push_back(NULL);
+
+        pid = System::spawn(argv[0], &argv[0], actions);
+
+        close(jobFds[1]);
+        close(statusFds[1]);
+        if (output >= 0)
+            close(outputFd);
+
+        input = jobFds[0];
+        status = statusFds[0];
+
+        if (pid < 0) {
+            Error("Failed to start coprocess: %s", strerror(errno));
+            stop();
+            return false;
+        }
+
+        Debug("Started coprocess with pid %d", pid);
+        return true;
+    }
+
+    void Coprocess::stop() {
+        // closing stdin tells the coprocess to exit
+        if (input >= 0)
+            close(input);
+        if (status >= 0)
+            close(status);
+        if (output >= 0)
+            close(output);
+        input = status = output = -1;
+
+        if (pid >= 0) {
+            int result;
+            waitpid(pid, &result, 0);
+            Debug("Coprocess %d exited with status %d", pid, result);
+        }
+        pid = -1;
+
+        statusLine.clear();
+        outputLine.clear();
+    }
+
+    bool Coprocess::send(const string &frame) {
+        size_t offset = 0;
+
+        while (offset < frame.length()) {
+            ssize_t written = ::send(input, frame.data() + offset, frame.length() - offset, MSG_NOSIGNAL);
+            if (written < 0) {
+                if (errno == EINTR)
+                    continue;
+                return false;
+            }
+
+            offset += written;
+        }
+
+        return true;
+    }
+
+    uint64_t Coprocess::readOutput(OutputBuffer *buffer) {
+        uint64_t nbBytes = 0;
+        if (output < 0)
+            return nbBytes;
+
+        while (true) {
+            ssize_t nbRead;
+
+            if (buffer != NULL) {
+                size_t available;
+                char *target = buffer->reserve(available);
+
+                if ((nbRead = read(output, target, available)) > 0)
+                    buffer->commit(nbRead);
+            } else {
+                char chunk[READ_SIZE];
+
+                if ((nbRead = read(output, chunk, sizeof(chunk))) > 0) {
+                    // write every line as soon as it is complete
+                    const char *start = chunk, *end = chunk + nbRead;
+                    for (const char *nl; (nl = static_cast<const char *>(memchr(start, '\n', end - start))) != NULL; start = nl + 1) {
+                        outputLine.append(start, nl - start);
+                        Output(outputLine.c_str());
+                        outputLine.clear();
+                    }
+                    outputLine.append(start, end - start);
+                }
+            }
+
+            if (nbRead > 0)
+                nbBytes += nbRead;
+            if (nbRead == 0 || (nbRead < 0 && errno != EINTR))
+                return nbBytes;
+        }
+    }
+
+    // appends the script of a job executed without /bin/sh to out, every
+    // word quoted so the shell doesn't interpret it again
+    static void quoteScript(const Job::script_t &script, string &out) {
+        typedef vector<Job::pipeline_t>::const_iterator pipeline_citer_t;
+        typedef Job::pipeline_t::const_iterator stage_citer_t;
+        typedef vector<string>::const_iterator word_citer_t;
+        typedef vector<Job::stage_t::redirection_t>::const_iterator redirection_citer_t;
+
+        for (pipeline_citer_t p = script.pipelines.begin(), pe = script.pipelines.end(); p != pe; p++) {
+            if (p != script.pipelines.begin())
+                out += " && ";
+
+            for (stage_citer_t s = p->begin(), se = p->end(); s != se; s++) {
+                if (s != p->begin())
+                    out += " | ";
+
+                for (word_citer_t w = s->words.begin(), we = s->words.end(); w != we; w++) {
+                    if (w != s->words.begin())
+                        out += ' ';
+                    shellQuote(*w, out);
+                }
+
+                for (redirection_citer_t r = s->redirections.begin(), re = s->redirections.end(); r != re; r++) {
+                    out += (r->type == REDIRECT_IN) ? " < " : ((r->type == REDIRECT_OUT) ? " > " : " >> ");
+                    shellQuote(r->target, out);
+                }
+            }
+        }
+    }
+
+    void Coprocess::flushLine() {
+        if (!outputLine.empty()) {
+            Output(outputLine.c_str());
+            outputLine.clear();
+        }
+    }
+
+    int Coprocess::exec(const Job &job) {
+        Debug("Executing %s in coprocess", job.command.c_str());
+
+        // the processes of the job aren't ours, only the time and the
+        // output are known
+        JobUsage usage;
+        usage.slot = System::getSlot();
+        const chrono::steady_clock::time_point begin = chrono::steady_clock::now();
+
+        System::startJob(job);
+
+        if (pid < 0 && !start()) {
+            System::finishJob(job, 127 << 8, NULL, usage);
+            return 127 << 8;
+        }
+
+        string frame;
+        if (program.empty() && job.mode != EXEC_SHELL) {
+            // the words were already split by worker, eval would split
+            // them again
+            frame = "(";
+            quoteScript(job.script, frame);
+            frame += ") </dev/null 3>&-; echo $? >&3\n";
+        } else if (program.empty()) {
+            // eval keeps syntax errors from killing the shell, the subshell
+            // keeps the job from changing its state
+            frame = "(eval ";
+            shellQuote(job.command, frame);
+            frame += ") </dev/null 3>&-; echo $? >&3\n";
+        } else {
+            // a command can't contain a NUL, but it can contain newlines
+            frame = job.command;
+            frame += '\0';
+        }
+
+        // reused for all jobs executed by this thread
+        static thread_local OutputBuffer groupedOutput;
+        OutputBuffer *buffer = (System::isOutputBuffered() && !quiet) ? &groupedOutput : NULL;
+
+        int result = -1;
+        if (send(frame)) {
+            char chunk[64];
+
+            while (result < 0) {
+                struct pollfd fds[2];
+                fds[0].fd = status;
+                fds[0].events = POLLIN;
+                fds[1].fd = output;
+                fds[1].events = POLLIN;
+
+                if (poll(fds, (output >= 0) ? 2 : 1, -1) < 0) {
+                    if (errno == EINTR)
+                        continue;
+                    Fatal("poll() failed: %s", strerror(errno));
+                }
+
+                if (output >= 0 && fds[1].revents)
+                    usage.outputBytes += readOutput(buffer);
+
+                if (!fds[0].revents)
+                    continue;
+
+                ssize_t nbRead = read(status, chunk, sizeof(chunk));
+                if (nbRead < 0 && errno == EINTR)
+                    continue;
+                if (nbRead <= 0)
+                    break;
+
+                statusLine.append(chunk, nbRead);
+                size_t nl = statusLine.find('\n');
+                if (nl != string::npos) {
+                    result = atoi(statusLine.c_str()) << 8;
+                    statusLine.erase(0, nl + 1);
+                }
+            }
+        }
+
+        // everything the job wrote is in the pipe by now
+        usage.outputBytes += readOutput(buffer);
+        if (buffer == NULL)
+            flushLine();
+
+        if (result < 0) {
+            Warn("Coprocess %d died while executing \"%s\", restarting it", pid, job.command.c_str());
+            stop();
+            result = 1 << 8;
+        }
+
+        usage.wallTime = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+        System::finishJob(job, result, buffer, usage);
+
+        if (result == 0) {
+            Debug("Process exited with success status");
+        } else {
+            Warn("Process exited with non-zero exit status: %d", result);
+        }
+
+        return result;
+    }
+
+    void Coprocess::executeJob(const Job &job, bool quiet) {
+        // started by the first job of every thread and stopped when the
+        // thread exits
+        static thread_local Coprocess coprocess(quiet);
+
+        coprocess.exec(job);
+    }
+
+}
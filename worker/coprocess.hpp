@@ -0,0 +1,73 @@
+#ifndef __WORKER_COPROCESS_
+#define __WORKER_COPROCESS_
+
+#include <string>
+#include <vector>
+#include <sys/types.h>
+
+#include "api.hpp"
+#include "job.hpp"
+#include "output.hpp"
+
+namespace worker {
+
+    /*
+     * A long-lived process that executes the jobs of a single thread, so
+     * jobs don't have to pay for starting a new /bin/sh every time.
+     *
+     * Jobs are written to the stdin of the coprocess, which reports the
+     * exit status of every job as a decimal number followed by a newline
+     * on file descriptor 3. Its stdout and stderr are the output of the
+     * job being executed, all of it must be written before the status.
+     *
+     * By default the coprocess is /bin/sh, which runs every job in a
+     * subshell. A custom program gets the command of every job followed by
+     * a NUL character instead, as commands can contain newlines, and has
+     * to exit once its stdin is closed. In bash, such a program can read
+     * the jobs with: while IFS= read -r -d '' job; do ...; done
+     */
+    class Coprocess {
+    public:
+        Coprocess(bool quiet);
+        ~Coprocess();
+
+        // executes job, returns its status like waitpid() would
+        int exec(const Job &job);
+
+        // executes job using the coprocess of the calling thread
+        static void executeJob(const Job &job, bool quiet);
+
+        // the program to use instead of /bin/sh, executed using /bin/sh -c
+        static void setProgram(const std::string &program);
+
+    private:
+        // no copying!
+        Coprocess(const Coprocess &o);
+
+        bool start();
+        void stop();
+
+        bool send(const std::string &frame);
+
+        // reads the output that is available without blocking, returns the
+        // number of bytes read
+        uint64_t readOutput(OutputBuffer *buffer);
+        void flushLine();
+
+        static std::string program;
+
+        const bool quiet;
+
+        pid_t pid;
+        int input;
+        int output;
+        int status;
+
+        // a partial status or output line
+        std::string statusLine;
+        std::string outputLine;
+    };
+
+}
+
+#endif // !defined(__WORKER_COPROCESS_)
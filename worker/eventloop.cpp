@@ -0,0 +1,526 @@
+#include "eventloop.hpp"
+
+#if defined(WORKER_IS_LINUX)
+
+#include "api.hpp"
+#include "affinity.hpp"
+#include "supervisor.hpp"
+#include "stats.hpp"
+#include "command.hpp"
+#include "cache.hpp"
+
+#include <chrono>
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+
+using namespace std;
+
+namespace worker {
+
+    namespace impl {
+
+        // what an epoll event refers to
+        struct EventSource {
+            RunningJob *job;
+            bool isOutput;
+            size_t stage;
+        };
+
+        struct RunningJob {
+            // the slot the job runs in, from 0 to size - 1
+            uint slot;
+
+            Job job;
+
+            // the pipelines to run, either job.script.pipelines or the shell
+            const vector<Job::pipeline_t> *pipelines;
+            vector<Job::pipeline_t> shellPipelines;
+            size_t pipeline;
+
+            System::RunningPipeline running;
+            size_t nbAlive;
+
+            int outputFd;
+            string partialLine;
+            // only used if System::isOutputBuffered(), reused for every job
+            // that runs in this slot
+            OutputBuffer buffer;
+
+            vector<int> pidfds;
+            // [0] is the output pipe, [i + 1] the pidfd of stage i
+            vector<EventSource> sources;
+
+            // NULL if there is no Supervisor
+            Supervisor::attempt_t *attempt;
+
+            chrono::steady_clock::time_point start;
+            JobUsage usage;
+        };
+
+    }
+
+    using impl::RunningJob;
+    using impl::EventSource;
+
+    static const size_t EVENT_BATCH_SIZE = 64;
+    static const size_t READ_BUFFER_SIZE = 64 * 1024;
+
+    static int pidfdOpen(pid_t pid) {
+        return syscall(SYS_pidfd_open, pid, 0);
+    }
+
+    bool EventLoop::isSupported() {
+        int fd = pidfdOpen(getpid());
+        if (fd < 0)
+            return false;
+
+        close(fd);
+        return true;
+    }
+
+    EventLoop::EventLoop(uint size, bool quiet, uint capacity, bool prioritized)
+            : quiet(quiet), size(max(size, 1u)), queue(max(capacity, 1u), prioritized),
+            joining(false), waitingForJobs(false), nbParkedProducers(0), joined(false),
+            admission(System::getAdmissionControl()), supervisor(System::getSupervisor()) {
+        Debug("Creating event loop running %u jobs and a queue of %u jobs", this->size, uint(queue.capacity()));
+
+        if ((epollFd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+            Fatal("Failed to create epoll instance: %s", strerror(errno));
+
+        if ((wakeFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0)
+            Fatal("Failed to create eventfd: %s", strerror(errno));
+
+        epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = NULL;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &event);
+
+        thread = std::thread(&EventLoop::run, this);
+    }
+
+    EventLoop::~EventLoop() {
+        if (!joined)
+            join();
+
+        close(wakeFd);
+        close(epollFd);
+    }
+
+    void EventLoop::wake() {
+        uint64_t one = 1;
+        if (write(wakeFd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+            Error("Failed to wake up the event loop: %s", strerror(errno));
+    }
+
+    void EventLoop::schedule(Job &job) {
+        Debug("Scheduling job %llu", (unsigned long long)job.sequence);
+
+        if (!queue.tryPush(job)) {
+            Debug("Queue is full, waiting");
+
+            lock_t lock(parkMutex);
+            nbParkedProducers.fetch_add(1);
+
+            while (!queue.tryPush(job))
+                spaceAvailable.wait(lock);
+
+            nbParkedProducers.fetch_sub(1);
+        }
+
+        // pairs with the fence in run(): either the loop sees our job, or
+        // we see the loop is waiting
+        atomic_thread_fence(memory_order_seq_cst);
+        if (waitingForJobs.exchange(false))
+            wake();
+    }
+
+    void EventLoop::wakeProducer() {
+        atomic_thread_fence(memory_order_seq_cst);
+
+        if (nbParkedProducers.load(memory_order_relaxed) > 0) {
+            lock_t lock(parkMutex);
+            spaceAvailable.notify_all();
+        }
+    }
+
+    void EventLoop::release() {
+        if (!queue.release())
+            return;
+
+        Debug("Releasing the jobs held back by the queue");
+        wake();
+    }
+
+    void EventLoop::join() {
+        Debug("EventLoop::join() called");
+
+        if (joined)
+            return;
+
+        // before joining is set, or the loop could see it while the
+        // queue still holds back the last jobs
+        queue.release();
+        joining.store(true);
+        wake();
+
+        thread.join();
+        joined = true;
+
+        Debug("Event loop joined");
+    }
+
+    void EventLoop::startPipeline(RunningJob &job, vector<RunningJob *> &freeSlots) {
+        const Job::pipeline_t &pipeline = (*job.pipelines)[job.pipeline];
+
+        // the processes inherit the slot and the affinity of this thread
+        const SlotAffinity *affinity = System::getSlotAffinity();
+        System::setSlot(int(job.slot));
+        if (affinity != NULL)
+            affinity->pin(job.slot);
+
+        if (quiet || System::getOutputMode() == System::OUTPUT_PASSTHROUGH) {
+            // nothing to read, the processes write to their final destination
+            System::startPipeline(pipeline, quiet ? System::getNullFd() : 1, job.running);
+            if (job.attempt != NULL)
+                supervisor->setGroup(job.attempt, job.running.group);
+            job.outputFd = -1;
+        } else {
+            int output_fd[2];
+            if (!System::createPipe(output_fd)) {
+                Fatal("Failed to create pipe, aborting...");
+            }
+
+            System::startPipeline(pipeline, output_fd[1], job.running);
+            if (job.attempt != NULL)
+                supervisor->setGroup(job.attempt, job.running.group);
+
+            // close writing end
+            close(output_fd[1]);
+
+            fcntl(output_fd[0], F_SETFL, fcntl(output_fd[0], F_GETFL) | O_NONBLOCK);
+            job.outputFd = output_fd[0];
+        }
+
+        job.usage.spawnTime += job.running.spawnTime;
+
+        if (affinity != NULL)
+            affinity->unpin();
+
+        const size_t nbStages = pipeline.size();
+
+        // resize first, epoll keeps pointers to the sources
+        job.sources.resize(nbStages + 1);
+        job.pidfds.assign(nbStages, -1);
+        job.nbAlive = 0;
+
+        epoll_event event;
+        event.events = EPOLLIN;
+
+        if (job.outputFd >= 0) {
+            job.sources[0].job = &job;
+            job.sources[0].isOutput = true;
+            job.sources[0].stage = 0;
+            event.data.ptr = &job.sources[0];
+            epoll_ctl(epollFd, EPOLL_CTL_ADD, job.outputFd, &event);
+        }
+
+        for (size_t i = 0; i < nbStages; i++) {
+            if (job.running.pids[i] < 0)
+                continue;
+
+            int pidfd = pidfdOpen(job.running.pids[i]);
+            if (pidfd < 0)
+                Fatal("pidfd_open() failed: %s", strerror(errno));
+
+            job.pidfds[i] = pidfd;
+            job.nbAlive++;
+
+            job.sources[i + 1].job = &job;
+            job.sources[i + 1].isOutput = false;
+            job.sources[i + 1].stage = i;
+            event.data.ptr = &job.sources[i + 1];
+            epoll_ctl(epollFd, EPOLL_CTL_ADD, pidfd, &event);
+        }
+
+        // no stage could be started and there is no output to read, so no
+        // event will ever finish the pipeline
+        if (job.outputFd < 0 && job.nbAlive == 0)
+            finishPipeline(job, freeSlots);
+    }
+
+    void EventLoop::startJob(Job &job, vector<RunningJob *> &freeSlots) {
+        RunningJob &slot = *freeSlots.back();
+        freeSlots.pop_back();
+
+        // for {%}, the loop runs the jobs of every slot
+        System::setSlot(int(slot.slot));
+        Command::render(job);
+        Debug("running command \"%s\"", job.command.c_str());
+
+        slot.job = std::move(job);
+        slot.pipeline = 0;
+        slot.partialLine.clear();
+
+        if (slot.job.mode == EXEC_SHELL) {
+            slot.shellPipelines.assign(1, System::getShellPipeline(slot.job.command));
+            slot.pipelines = &slot.shellPipelines;
+        } else {
+            slot.pipelines = &slot.job.script.pipelines;
+        }
+
+        slot.start = chrono::steady_clock::now();
+        slot.usage = JobUsage();
+        slot.usage.slot = int(slot.slot);
+
+        slot.attempt = (supervisor != NULL) ? supervisor->begin(slot.job) : NULL;
+        System::startJob(slot.job);
+        startPipeline(slot, freeSlots);
+    }
+
+    void EventLoop::readOutput(RunningJob &job) {
+        char localBuffer[READ_BUFFER_SIZE];
+
+        const bool grouped = System::isOutputBuffered();
+
+        size_t available = sizeof(localBuffer);
+        char *buffer = grouped ? job.buffer.reserve(available) : localBuffer;
+
+        // read once per event, so one chatty job can't starve the others
+        ssize_t nbRead = read(job.outputFd, buffer, available);
+
+        if (nbRead < 0 && (errno == EAGAIN || errno == EINTR))
+            return;
+
+        if (nbRead > 0)
+            job.usage.outputBytes += nbRead;
+
+        if (nbRead > 0 && grouped) {
+            job.buffer.commit(nbRead);
+            return;
+        }
+
+        if (nbRead > 0) {
+            const char *start = buffer;
+            const char *end = buffer + nbRead;
+
+            while (start < end) {
+                const char *newline = static_cast<const char *>(memchr(start, '\n', end - start));
+                if (newline == NULL) {
+                    job.partialLine.append(start, end - start);
+                    break;
+                }
+
+                job.partialLine.append(start, newline - start);
+                Output(job.partialLine.c_str());
+                job.partialLine.clear();
+
+                start = newline + 1;
+            }
+
+            return;
+        }
+
+        if (nbRead < 0) {
+            Error("Error occured when trying to read process output");
+        } else {
+            Debug("Process output closed.");
+        }
+
+        if (!job.partialLine.empty()) {
+            Output(job.partialLine.c_str());
+            job.partialLine.clear();
+        }
+
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, job.outputFd, NULL);
+        close(job.outputFd);
+        job.outputFd = -1;
+    }
+
+    void EventLoop::exited(RunningJob &job, size_t stage) {
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, job.pidfds[stage], NULL);
+        close(job.pidfds[stage]);
+        job.pidfds[stage] = -1;
+
+        job.nbAlive--;
+    }
+
+    void EventLoop::reap(RunningJob &job) {
+        // the group can't be signalled anymore once it's reaped
+        if (job.attempt != NULL)
+            supervisor->clearGroup(job.attempt);
+
+        for (size_t i = 0, e = job.running.pids.size(); i < e; i++) {
+            struct rusage rusage;
+            if (job.running.pids[i] >= 0 && wait4(job.running.pids[i], &job.running.statuses[i], 0, &rusage) >= 0)
+                job.usage.add(rusage);
+        }
+    }
+
+    void EventLoop::finishPipeline(RunningJob &job, vector<RunningJob *> &freeSlots) {
+        reap(job);
+
+        int result = job.running.statuses.back();
+        job.pipeline++;
+
+        // &&
+        if (result == 0 && job.pipeline < job.pipelines->size()) {
+            startPipeline(job, freeSlots);
+            return;
+        }
+
+        if (job.attempt != NULL && !supervisor->end(job.attempt)) {
+            Debug("Discarding the result of \"%s\", another copy finished first", job.job.command.c_str());
+            job.buffer.clear();
+        } else {
+            job.usage.wallTime = chrono::duration<double>(chrono::steady_clock::now() - job.start).count();
+            System::finishJob(job.job, result, (!quiet && System::isOutputBuffered()) ? &job.buffer : NULL, job.usage);
+
+            if (result != 0)
+                Warn("command \"%s\" exited with code %d", job.job.command.c_str(), result);
+            else
+                Debug("Command \"%s\" executed successfully", job.job.command.c_str());
+        }
+
+        if (admission != NULL)
+            admission->release();
+
+        freeSlots.push_back(&job);
+    }
+
+    bool EventLoop::tryAdmit() {
+        return admission == NULL || admission->tryAdmit();
+    }
+
+    bool EventLoop::popJob(Job &job) {
+        ResultCache *cache = System::getResultCache();
+
+        // cached results are replayed without taking a slot
+        while (queue.tryPop(job)) {
+            if (cache == NULL || !cache->replay(job))
+                return true;
+
+            // the producer may be waiting for the space
+            wakeProducer();
+        }
+
+        // the job was admitted by tryAdmit() but there is none
+        if (admission != NULL)
+            admission->release();
+        return false;
+    }
+
+    bool EventLoop::popStraggler(Job &job, chrono::steady_clock::time_point &retry) {
+        if (supervisor->findStraggler(job, retry))
+            return true;
+
+        if (admission != NULL)
+            admission->release();
+        return false;
+    }
+
+    void EventLoop::run() {
+        Debug("Event loop started.");
+
+        vector<RunningJob *> slots(size);
+        for (uint i = 0; i < size; i++) {
+            slots[i] = new RunningJob;
+            slots[i]->slot = i;
+        }
+        vector<RunningJob *> freeSlots(slots.rbegin(), slots.rend());
+
+        epoll_event events[EVENT_BATCH_SIZE];
+        Job job;
+
+        const bool speculating = (supervisor != NULL && supervisor->isSpeculating());
+
+        while (true) {
+            bool started = false;
+            bool throttled = false;
+            chrono::steady_clock::time_point retry = chrono::steady_clock::time_point::max();
+            while (!freeSlots.empty() && !(throttled = !tryAdmit()) && popJob(job)) {
+                startJob(job, freeSlots);
+                started = true;
+            }
+
+            if (started)
+                wakeProducer();
+
+            if (!freeSlots.empty() && !throttled) {
+                waitingForJobs.store(true);
+                atomic_thread_fence(memory_order_seq_cst);
+
+                bool closed = joining.load();
+
+                if (tryAdmit() && popJob(job)) {
+                    waitingForJobs.store(false);
+                    startJob(job, freeSlots);
+                    wakeProducer();
+                    continue;
+                }
+
+                if (closed && freeSlots.size() == size)
+                    break;
+
+                // nothing left to start, help out the slowest jobs
+                if (closed && speculating && tryAdmit() && popStraggler(job, retry)) {
+                    startJob(job, freeSlots);
+                    continue;
+                }
+            }
+
+            // check the pressure again after a while when throttled
+            int timeout = throttled ? int(chrono::duration_cast<chrono::milliseconds>(AdmissionControl::SAMPLE_INTERVAL).count()) : -1;
+            if (retry != chrono::steady_clock::time_point::max()) {
+                int untilRetry = int(chrono::duration_cast<chrono::milliseconds>(retry - chrono::steady_clock::now()).count()) + 1;
+                timeout = (timeout < 0) ? max(untilRetry, 0) : min(timeout, max(untilRetry, 0));
+            }
+
+            int nbEvents = epoll_wait(epollFd, events, EVENT_BATCH_SIZE, timeout);
+            if (nbEvents < 0) {
+                if (errno == EINTR)
+                    continue;
+                Fatal("epoll_wait() failed: %s", strerror(errno));
+            }
+
+            for (int i = 0; i < nbEvents; i++) {
+                EventSource *source = static_cast<EventSource *>(events[i].data.ptr);
+
+                if (source == NULL) {
+                    uint64_t value;
+                    while (read(wakeFd, &value, sizeof(value)) > 0)
+                        ;
+                    continue;
+                }
+
+                RunningJob &running = *source->job;
+
+                if (source->isOutput)
+                    readOutput(running);
+                else
+                    exited(running, source->stage);
+
+                if (running.outputFd < 0 && running.nbAlive == 0)
+                    finishPipeline(running, freeSlots);
+            }
+        }
+
+        for (uint i = 0; i < size; i++)
+            delete slots[i];
+
+        Debug("Event loop ended");
+    }
+
+}
+
+#endif // defined(WORKER_IS_LINUX)
@@ -0,0 +1,107 @@
+#ifndef __WORKER_EVENTLOOP_
+#define __WORKER_EVENTLOOP_
+
+#include "api.hpp"
+
+#if defined(WORKER_IS_LINUX)
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <chrono>
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "job.hpp"
+#include "queue.hpp"
+#include "system.hpp"
+#include "executor.hpp"
+
+namespace worker {
+
+    namespace impl {
+        struct RunningJob;
+    }
+
+    /*
+     * Runs up to size jobs at the same time using a single thread.
+     *
+     * The output pipes and the pidfds of all running processes are watched
+     * using epoll, new jobs are started as soon as a running job finishes.
+     * This allows running thousands of concurrent jobs without needing a
+     * thread per job.
+     */
+    struct EventLoop : public Executor {
+
+        // schedule() blocks while capacity jobs are waiting in the queue,
+        // the waiting jobs with the highest cost are started first if
+        // prioritized is set
+        EventLoop(uint size, bool quiet, uint capacity, bool prioritized = false);
+        ~EventLoop();
+
+        void schedule(Job &job);
+        void release();
+        void join();
+
+        // whether the kernel supports everything the event loop needs
+        static bool isSupported();
+
+    private:
+        // no copying!
+        EventLoop(const EventLoop &o);
+
+        typedef std::mutex                  mutex_t;
+        typedef std::unique_lock<mutex_t>   lock_t;
+        typedef std::condition_variable     condition_var_t;
+
+        typedef impl::SchedulingQueue<Job, impl::JobCostOrder> queue_t;
+
+        const bool quiet;
+        const uint size;
+
+        queue_t queue;
+
+        int epollFd;
+        // written to wake up the loop when jobs are scheduled or on join()
+        int wakeFd;
+
+        std::atomic<bool> joining;
+        std::atomic<bool> waitingForJobs;
+
+        std::atomic<uint> nbParkedProducers;
+        mutex_t parkMutex;
+        condition_var_t spaceAvailable;
+
+        std::thread thread;
+        bool joined;
+
+        AdmissionControl * const admission;
+        Supervisor * const supervisor;
+
+        void wake();
+        void wakeProducer();
+
+        void run();
+
+        // tryAdmit() must be called before every popJob() and popStraggler()
+        bool tryAdmit();
+        bool popJob(Job &job);
+        // a copy of a slow job to run once the queue is closed and empty,
+        // sets retry to when there might be one
+        bool popStraggler(Job &job, std::chrono::steady_clock::time_point &retry);
+
+        void startJob(Job &job, std::vector<impl::RunningJob *> &freeSlots);
+        void startPipeline(impl::RunningJob &job, std::vector<impl::RunningJob *> &freeSlots);
+        void readOutput(impl::RunningJob &job);
+        void exited(impl::RunningJob &job, size_t stage);
+        void reap(impl::RunningJob &job);
+        void finishPipeline(impl::RunningJob &job, std::vector<impl::RunningJob *> &freeSlots);
+    };
+
+}
+
+#endif // defined(WORKER_IS_LINUX)
+
+#endif // !defined(__WORKER_EVENTLOOP_)
@@ -0,0 +1,28 @@
+#ifndef __WORKER_EXECUTOR_
+#define __WORKER_EXECUTOR_
+
+#include "api.hpp"
+#include "job.hpp"
+
+namespace worker {
+
+    // runs scheduled jobs concurrently
+    struct Executor {
+        virtual ~Executor() {}
+
+        // moves job into the executor, blocks while the executor can't
+        // accept more jobs
+        virtual void schedule(Job &job) = 0;
+
+        // the producer has to wait for the next job, so jobs held back to
+        // be started in order of their cost should start now
+        virtual void release() = 0;
+
+        // waits until all scheduled jobs have finished, no jobs can be
+        // scheduled after calling join()
+        virtual void join() = 0;
+    };
+
+}
+
+#endif // !defined(__WORKER_EXECUTOR_)
@@ -0,0 +1,64 @@
+#ifndef __WORKER_HASH_
+#define __WORKER_HASH_
+
+#include <cstring>
+#include <string>
+
+#include "api.hpp"
+
+namespace worker {
+
+    // 128 bit FNV-1a, used to recognise jobs across runs. Kept in two
+    // halves as there's no portable 128 bit type.
+    struct Hasher {
+        uint64_t low;
+        uint64_t high;
+
+        Hasher() : low(0x62b821756295c58dULL), high(0x6c62272e07bb0142ULL) {}
+
+        void add(const void *data, size_t length) {
+            // the prime is 2^88 + 0x13b
+            static const uint64_t PRIME_LOW = 0x13b;
+
+            const unsigned char *bytes = static_cast<const unsigned char *>(data);
+            for (size_t i = 0; i < length; i++) {
+                low ^= bytes[i];
+
+                // the upper 64 bits of low * PRIME_LOW
+                const uint64_t carry = ((low >> 32) * PRIME_LOW + (((low & 0xffffffffULL) * PRIME_LOW) >> 32)) >> 32;
+
+                high = high * PRIME_LOW + carry + (low << 24);
+                low *= PRIME_LOW;
+            }
+        }
+
+        // prefixed by its length, so fields can't run into each other
+        void add(const std::string &str) {
+            uint64_t length = str.length();
+            add(&length, sizeof(length));
+            add(str.data(), str.length());
+        }
+
+        template <typename T>
+        void addValue(const T &value) {
+            add(&value, sizeof(value));
+        }
+
+        // the full hash, as 16 bytes, the low half first the way a 128 bit
+        // integer is laid out on little-endian machines
+        std::string getKey() const {
+            char key[16];
+            memcpy(key, &low, sizeof(low));
+            memcpy(key + sizeof(low), &high, sizeof(high));
+            return std::string(key, sizeof(key));
+        }
+
+        // the hash folded to 64 bits
+        uint64_t get64() const {
+            return low ^ high;
+        }
+    };
+
+}
+
+#endif // !defined(__WORKER_HASH_)
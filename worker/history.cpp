@@ -0,0 +1,170 @@
+#include "history.hpp"
+#include "api.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <errno.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+namespace worker {
+
+    static const char MAGIC[8] = { 'W', 'R', 'K', 'H', 'I', 'S', 'T', '1' };
+
+    namespace impl {
+
+        struct HistoryRecord {
+            uint64_t key;
+            double seconds;
+            // the size of the input files of the job
+            uint64_t bytes;
+        };
+
+    }
+
+    using impl::HistoryRecord;
+
+    RuntimeHistory::RuntimeHistory(const string &path)
+        : path(path), secondsPerByte(0), meanSeconds(0)
+    {
+        if (!path.empty())
+            load();
+    }
+
+    RuntimeHistory::~RuntimeHistory() {
+        if (!path.empty())
+            save();
+    }
+
+    void RuntimeHistory::load() {
+        FILE *file = fopen(path.c_str(), "rb");
+        if (file == NULL) {
+            if (errno != ENOENT)
+                Warn("Unable to read history \"%s\": %s", path.c_str(), strerror(errno));
+            return;
+        }
+
+        char magic[sizeof(MAGIC)];
+        if (fread(magic, sizeof(magic), 1, file) != 1 || memcmp(magic, MAGIC, sizeof(MAGIC)) != 0) {
+            Warn("Ignoring \"%s\", it is not a history file", path.c_str());
+            fclose(file);
+            return;
+        }
+
+        HistoryRecord record;
+        while (fread(&record, sizeof(record), 1, file) == 1) {
+            Entry &entry = known[record.key];
+            entry.seconds = record.seconds;
+            entry.bytes = record.bytes;
+        }
+        fclose(file);
+
+        double totalSeconds = 0, sizedSeconds = 0, sizedBytes = 0;
+        for (unordered_map<uint64_t, Entry>::const_iterator e = known.begin(), end = known.end(); e != end; e++) {
+            totalSeconds += e->second.seconds;
+            if (e->second.bytes > 0) {
+                sizedSeconds += e->second.seconds;
+                sizedBytes += double(e->second.bytes);
+            }
+        }
+
+        if (!known.empty())
+            meanSeconds = totalSeconds / known.size();
+        if (sizedBytes > 0)
+            secondsPerByte = sizedSeconds / sizedBytes;
+
+        Debug("History \"%s\" contains %u jobs, %g seconds on average", path.c_str(), uint(known.size()), meanSeconds);
+    }
+
+    void RuntimeHistory::save() {
+        // known is rewritten, measurements of this run replace it
+        for (unordered_map<uint64_t, Entry>::const_iterator e = measured.begin(), end = measured.end(); e != end; e++) {
+            unordered_map<uint64_t, Entry>::iterator previous = known.find(e->first);
+
+            // smooth out the noise of single runs
+            if (previous != known.end())
+                previous->second.seconds = (previous->second.seconds + e->second.seconds) / 2;
+            else
+                known[e->first].seconds = e->second.seconds;
+            known[e->first].bytes = e->second.bytes;
+        }
+
+        if (measured.empty())
+            return;
+
+        const string temporary = path + ".tmp";
+        FILE *file = fopen(temporary.c_str(), "wb");
+        if (file == NULL) {
+            Error("Unable to write history \"%s\": %s", temporary.c_str(), strerror(errno));
+            return;
+        }
+
+        bool ok = fwrite(MAGIC, sizeof(MAGIC), 1, file) == 1;
+        for (unordered_map<uint64_t, Entry>::const_iterator e = known.begin(), end = known.end(); ok && e != end; e++) {
+            HistoryRecord record;
+            memset(&record, 0, sizeof(record));
+            record.key = e->first;
+            record.seconds = e->second.seconds;
+            record.bytes = e->second.bytes;
+            ok = fwrite(&record, sizeof(record), 1, file) == 1;
+        }
+
+        if (fclose(file) != 0 || !ok || rename(temporary.c_str(), path.c_str()) != 0) {
+            Error("Unable to write history \"%s\": %s", path.c_str(), strerror(errno));
+            remove(temporary.c_str());
+        }
+    }
+
+    double RuntimeHistory::estimate(const Job &job, const vector<string> &arguments) {
+        uint64_t bytes = 0;
+        struct stat st;
+        for (vector<string>::const_iterator argument = arguments.begin(), end = arguments.end(); argument != end; argument++) {
+            if (stat(argument->c_str(), &st) == 0 && S_ISREG(st.st_mode))
+                bytes += uint64_t(st.st_size);
+        }
+
+        {
+            lock_t lock(mutex);
+            running[job.sequence].bytes = bytes;
+        }
+
+        unordered_map<uint64_t, Entry>::const_iterator entry = known.find(job.key);
+        if (entry != known.end())
+            return entry->second.seconds;
+
+        // without durations, the sizes can at least be compared
+        if (known.empty())
+            return double(bytes);
+
+        if (secondsPerByte > 0 && bytes > 0)
+            return double(bytes) * secondsPerByte;
+
+        return meanSeconds;
+    }
+
+    void RuntimeHistory::start(const Job &job) {
+        lock_t lock(mutex);
+        running[job.sequence].start = clock_t::now();
+    }
+
+    void RuntimeHistory::finish(const Job &job, int status) {
+        const clock_t::time_point now = clock_t::now();
+
+        lock_t lock(mutex);
+
+        unordered_map<uint64_t, RunningEntry>::iterator entry = running.find(job.sequence);
+        if (entry == running.end())
+            return;
+
+        // failures tend to be quick and say nothing about the next run
+        if (status == 0) {
+            Entry &result = measured[job.key];
+            result.seconds = chrono::duration<double>(now - entry->second.start).count();
+            result.bytes = entry->second.bytes;
+        }
+
+        running.erase(entry);
+    }
+
+}
@@ -0,0 +1,81 @@
+#ifndef __WORKER_HISTORY_
+#define __WORKER_HISTORY_
+
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "api.hpp"
+#include "job.hpp"
+
+namespace worker {
+
+    /*
+     * Remembers how long jobs took in earlier runs, to estimate the cost
+     * of new jobs.
+     *
+     * Jobs are identified by Job::key, a hash of the template and the
+     * arguments, so they don't have to be rendered to be estimated. A job
+     * that hasn't run before is estimated from the total size of the files
+     * among its arguments, converted to seconds using the throughput of the
+     * jobs that have.
+     *
+     * The file is read when created and rewritten when destroyed,
+     * estimates only use the durations of earlier runs. Without a file
+     * only the sizes are used.
+     */
+    class RuntimeHistory {
+    public:
+        typedef std::chrono::steady_clock clock_t;
+
+        RuntimeHistory(const std::string &path);
+        ~RuntimeHistory();
+
+        // the expected duration of job in seconds, or the size of its
+        // input files if nothing is known about durations
+        double estimate(const Job &job, const std::vector<std::string> &arguments);
+
+        void start(const Job &job);
+        void finish(const Job &job, int status);
+
+    private:
+        // no copying!
+        RuntimeHistory(const RuntimeHistory &o);
+
+        typedef std::mutex                  mutex_t;
+        typedef std::unique_lock<mutex_t>   lock_t;
+
+        struct Entry {
+            double seconds;
+            uint64_t bytes;
+        };
+
+        struct RunningEntry {
+            clock_t::time_point start;
+            uint64_t bytes;
+        };
+
+        void load();
+        void save();
+
+        const std::string path;
+
+        // read from the file, and the measurements of this run
+        std::unordered_map<uint64_t, Entry> known;
+        std::unordered_map<uint64_t, Entry> measured;
+
+        // derived from known
+        double secondsPerByte;
+        double meanSeconds;
+
+        // jobs that were estimated or started, by sequence
+        std::unordered_map<uint64_t, RunningEntry> running;
+
+        mutex_t mutex;
+    };
+
+}
+
+#endif // !defined(__WORKER_HISTORY_)
@@ -0,0 +1,106 @@
+#ifndef __WORKER_JOB_
+#define __WORKER_JOB_
+
+#include <string>
+#include <vector>
+
+#include "api.hpp"
+
+namespace worker {
+
+    /*
+     * How a job is executed:
+     *  - EXEC_ARGV:   a single program, executed directly
+     *  - EXEC_NATIVE: programs connected with |, &&, <, > and >>, the pipes
+     *                 and redirections are set up by worker itself
+     *  - EXEC_SHELL:  anything else, executed using /bin/sh -c
+     */
+    typedef enum { EXEC_ARGV, EXEC_NATIVE, EXEC_SHELL } ExecutionMode;
+
+    typedef enum { REDIRECT_IN, REDIRECT_OUT, REDIRECT_APPEND } RedirectionType;
+
+    namespace impl {
+
+        template <typename word_t>
+        struct Redirection {
+            RedirectionType type;
+            word_t target;
+        };
+
+        // one program in a pipeline, words[0] is the program to run
+        template <typename word_t>
+        struct Stage {
+            typedef Redirection<word_t> redirection_t;
+
+            std::vector<word_t> words;
+            std::vector<redirection_t> redirections;
+        };
+
+        // pipelines joined by &&
+        template <typename word_t>
+        struct Script {
+            typedef Stage<word_t> stage_t;
+            typedef std::vector<stage_t> pipeline_t;
+
+            std::vector<pipeline_t> pipelines;
+        };
+
+    }
+
+    class Command;
+
+    struct Job {
+        typedef impl::Script<std::string> script_t;
+        typedef script_t::stage_t stage_t;
+        typedef script_t::pipeline_t pipeline_t;
+
+        // the index of the job in the order jobs were generated
+        uint64_t sequence;
+
+        ExecutionMode mode;
+
+        // the command as it would be passed to /bin/sh
+        std::string command;
+
+        // only set if mode != EXEC_SHELL
+        script_t script;
+
+        // the key of the job in the ResultCache, empty if not cached
+        std::string cacheKey;
+
+        // the files the job writes besides those of > and >>, declared
+        // using --cache-output
+        std::vector<std::string> outputs;
+
+        // identifies the job across runs, see Command::getKey(), 0 if not
+        // needed
+        uint64_t key;
+
+        // the expected duration, used to start the longest jobs first
+        double cost;
+
+        // set until the job is rendered by Command::render() just before
+        // it runs, only the sequence and the cost are valid until then
+        const Command *pending;
+        // the values of the placeholders, each followed by a NUL, and those
+        // of the next job in the batch after them if batched is set
+        std::string arguments;
+        bool batched;
+
+        Job() : sequence(0), mode(EXEC_SHELL), key(0), cost(0), pending(NULL), batched(false) {}
+    };
+
+    namespace impl {
+
+        // orders jobs by cost, and by sequence if their cost is equal
+        struct JobCostOrder {
+            inline bool operator()(const Job &a, const Job &b) const {
+                return (a.cost != b.cost) ? (a.cost < b.cost) : (a.sequence > b.sequence);
+            }
+        };
+
+    }
+
+}
+
+#endif // !defined(__WORKER_JOB_)
@@ -0,0 +1,219 @@
+#include "journal.hpp"
+#include "hash.hpp"
+#include "api.hpp"
+
+#include <cstddef>
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+namespace worker {
+
+    static const char MAGIC[8] = { 'W', 'R', 'K', 'J', 'R', 'N', 'L', '1' };
+
+    static const uint32_t RECORD_START = 1;
+    static const uint32_t RECORD_FINISH = 2;
+
+    namespace impl {
+
+        struct JournalRecord {
+            uint32_t type;
+            // RECORD_FINISH: the status as returned by waitpid()
+            int32_t status;
+            uint64_t sequence;
+            // Job::key
+            uint64_t key;
+            // nanoseconds since the epoch
+            int64_t time;
+            // RECORD_FINISH: nanoseconds since the start of the job
+            int64_t duration;
+            // a hash of the fields above, to recognise torn records
+            uint64_t check;
+
+            uint64_t getCheck() const {
+                Hasher hasher;
+                hasher.add(this, offsetof(JournalRecord, check));
+                return hasher.get64();
+            }
+        };
+
+    }
+
+    using impl::JournalRecord;
+
+    const Journal::clock_t::duration Journal::FLUSH_INTERVAL = chrono::milliseconds(100);
+
+    Journal::Journal(const string &path, bool resume)
+        : path(path), fd(-1), stopping(false)
+    {
+        int flags = O_RDWR | O_CREAT | O_CLOEXEC | (resume ? 0 : O_TRUNC);
+        if ((fd = open(path.c_str(), flags, 0666)) < 0)
+            Fatal("Unable to open journal \"%s\": %s", path.c_str(), strerror(errno));
+
+        load();
+
+        flusher = thread([this]() {
+            lock_t lock(mutex);
+
+            while (!stopping) {
+                flushNeeded.wait_for(lock, FLUSH_INTERVAL);
+
+                lock.unlock();
+                flush();
+                lock.lock();
+            }
+        });
+    }
+
+    Journal::~Journal() {
+        {
+            lock_t lock(mutex);
+            stopping = true;
+        }
+        flushNeeded.notify_all();
+        flusher.join();
+
+        flush();
+        close(fd);
+    }
+
+    void Journal::load() {
+        struct stat st;
+        if (fstat(fd, &st) != 0)
+            Fatal("Unable to stat journal \"%s\": %s", path.c_str(), strerror(errno));
+
+        if (st.st_size == 0) {
+            if (write(fd, MAGIC, sizeof(MAGIC)) != ssize_t(sizeof(MAGIC)))
+                Fatal("Unable to write journal \"%s\": %s", path.c_str(), strerror(errno));
+            return;
+        }
+
+        char magic[sizeof(MAGIC)];
+        if (read(fd, magic, sizeof(magic)) != ssize_t(sizeof(magic)) || memcmp(magic, MAGIC, sizeof(MAGIC)) != 0)
+            Fatal("\"%s\" is not a journal", path.c_str());
+
+        off_t valid = sizeof(MAGIC);
+        vector<JournalRecord> records(4096);
+        bool torn = false;
+
+        while (!torn) {
+            ssize_t nbRead = read(fd, &records[0], records.size() * sizeof(JournalRecord));
+            if (nbRead < 0 && errno == EINTR)
+                continue;
+            if (nbRead <= 0)
+                break;
+
+            // a partial record can only be at the end of the file
+            size_t nbRecords = size_t(nbRead) / sizeof(JournalRecord);
+            torn = size_t(nbRead) % sizeof(JournalRecord) != 0;
+
+            for (size_t i = 0; i < nbRecords; i++) {
+                const JournalRecord &record = records[i];
+                if (record.check != record.getCheck()) {
+                    torn = true;
+                    break;
+                }
+
+                if (record.type == RECORD_FINISH) {
+                    if (record.status == 0)
+                        completed[record.sequence] = record.key;
+                    else
+                        completed.erase(record.sequence);
+                }
+
+                valid += sizeof(JournalRecord);
+            }
+        }
+
+        if (valid != st.st_size) {
+            // the records being written when we were killed
+            Warn("Ignoring %lld bytes at the end of journal \"%s\"", (long long)(st.st_size - valid), path.c_str());
+            if (ftruncate(fd, valid) != 0)
+                Fatal("Unable to truncate journal \"%s\": %s", path.c_str(), strerror(errno));
+        }
+
+        lseek(fd, valid, SEEK_SET);
+        Debug("Journal \"%s\" contains %u completed jobs", path.c_str(), uint(completed.size()));
+    }
+
+    bool Journal::isCompleted(const Job &job) const {
+        unordered_map<uint64_t, uint64_t>::const_iterator entry = completed.find(job.sequence);
+        return entry != completed.end() && entry->second == job.key;
+    }
+
+    void Journal::append(uint32_t type, const Job &job, int status, int64_t duration) {
+        JournalRecord record;
+        memset(&record, 0, sizeof(record));
+        record.type = type;
+        record.status = status;
+        record.sequence = job.sequence;
+        record.key = job.key;
+        record.time = chrono::duration_cast<chrono::nanoseconds>(chrono::system_clock::now().time_since_epoch()).count();
+        record.duration = duration;
+        record.check = record.getCheck();
+
+        const char *data = reinterpret_cast<const char *>(&record);
+
+        lock_t lock(mutex);
+        pending.insert(pending.end(), data, data + sizeof(record));
+    }
+
+    void Journal::start(const Job &job) {
+        {
+            lock_t lock(mutex);
+            started[job.sequence] = clock_t::now();
+        }
+
+        append(RECORD_START, job, 0, 0);
+    }
+
+    void Journal::finish(const Job &job, int status) {
+        int64_t duration = 0;
+        {
+            lock_t lock(mutex);
+
+            unordered_map<uint64_t, clock_t::time_point>::iterator start = started.find(job.sequence);
+            if (start != started.end()) {
+                duration = chrono::duration_cast<chrono::nanoseconds>(clock_t::now() - start->second).count();
+                started.erase(start);
+            }
+        }
+
+        append(RECORD_FINISH, job, status, duration);
+    }
+
+    void Journal::flush() {
+        vector<char> records;
+        {
+            lock_t lock(mutex);
+            records.swap(pending);
+        }
+
+        if (records.empty())
+            return;
+
+        size_t offset = 0;
+        while (offset < records.size()) {
+            ssize_t written = write(fd, &records[offset], records.size() - offset);
+            if (written < 0 && errno == EINTR)
+                continue;
+            if (written < 0) {
+                Error("Unable to write journal \"%s\": %s", path.c_str(), strerror(errno));
+                return;
+            }
+
+            offset += written;
+        }
+
+    #if defined(WORKER_IS_OSX)
+        fsync(fd);
+    #else
+        fdatasync(fd);
+    #endif
+    }
+
+}
@@ -0,0 +1,81 @@
+#ifndef __WORKER_JOURNAL_
+#define __WORKER_JOURNAL_
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "api.hpp"
+#include "job.hpp"
+
+namespace worker {
+
+    /*
+     * Records when every job starts and finishes in an append-only file,
+     * so a run that was killed can be resumed.
+     *
+     * Jobs are identified by their sequence number and Job::key, a hash of
+     * the template and the arguments, so changing either invalidates the
+     * old entries. The records are written and synced by a separate thread
+     * at most every FLUSH_INTERVAL, jobs never wait for the disk.
+     */
+    class Journal {
+    public:
+        typedef std::chrono::steady_clock clock_t;
+
+        static const clock_t::duration FLUSH_INTERVAL;
+
+        // with resume, the jobs that succeeded according to the existing
+        // journal are remembered, otherwise the journal is started over
+        Journal(const std::string &path, bool resume);
+
+        // writes and syncs all records
+        ~Journal();
+
+        // whether the job succeeded in the run being resumed
+        bool isCompleted(const Job &job) const;
+
+        void start(const Job &job);
+        void finish(const Job &job, int status);
+
+        inline uint getNbCompleted() const {
+            return uint(completed.size());
+        }
+
+    private:
+        // no copying!
+        Journal(const Journal &o);
+
+        typedef std::mutex                  mutex_t;
+        typedef std::unique_lock<mutex_t>   lock_t;
+
+        void load();
+        void append(uint32_t type, const Job &job, int status, int64_t duration);
+        void flush();
+
+        const std::string path;
+        int fd;
+
+        // sequence -> key of the jobs that succeeded before
+        std::unordered_map<uint64_t, uint64_t> completed;
+
+        mutex_t mutex;
+        std::condition_variable flushNeeded;
+        bool stopping;
+
+        // records that haven't been written yet
+        std::vector<char> pending;
+
+        // when the running jobs started
+        std::unordered_map<uint64_t, clock_t::time_point> started;
+
+        std::thread flusher;
+    };
+
+}
+
+#endif // !defined(__WORKER_JOURNAL_)
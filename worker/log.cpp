@@ -0,0 +1,99 @@
+#include "log.hpp"
+
+#include <cerrno>
+#include <unistd.h>
+
+using namespace std;
+
+namespace worker {
+
+    namespace impl {
+
+        const size_t Log::CAPACITY = 4096;
+        const Log::clock_t::duration Log::IDLE_INTERVAL = chrono::milliseconds(100);
+
+        Log &Log::get() {
+            // started by the first message, stopped and drained at exit
+            static Log log;
+            return log;
+        }
+
+        Log::Log()
+            : start(clock_t::now()), queue(CAPACITY), sleeping(false), stopping(false)
+        {
+            writer = thread([this]() {
+                while (true) {
+                    {
+                        lock_t lock(writeMutex);
+                        drain();
+                    }
+
+                    lock_t lock(mutex);
+                    if (stopping)
+                        break;
+
+                    // pairs with the fence in append(), so either the
+                    // message is seen here or sleeping is seen there
+                    sleeping.store(true, memory_order_relaxed);
+                    atomic_thread_fence(memory_order_seq_cst);
+
+                    if (queue.size() == 0)
+                        messageQueued.wait_for(lock, IDLE_INTERVAL);
+
+                    sleeping.store(false, memory_order_relaxed);
+                }
+            });
+        }
+
+        Log::~Log() {
+            {
+                lock_t lock(mutex);
+                stopping = true;
+            }
+            messageQueued.notify_all();
+            writer.join();
+
+            flush();
+        }
+
+        void Log::append(string &message) {
+            while (!queue.tryPush(message))
+                flush();
+
+            atomic_thread_fence(memory_order_seq_cst);
+            if (sleeping.load(memory_order_relaxed))
+                wake();
+        }
+
+        void Log::wake() {
+            lock_t lock(mutex);
+            messageQueued.notify_one();
+        }
+
+        void Log::flush() {
+            lock_t lock(writeMutex);
+            drain();
+        }
+
+        void Log::drain() {
+            string message;
+            while (queue.tryPop(message))
+                buffer += message;
+
+            size_t offset = 0;
+            while (offset < buffer.size()) {
+                ssize_t written = ::write(2, buffer.data() + offset, buffer.size() - offset);
+                if (written < 0 && errno == EINTR)
+                    continue;
+                if (written < 0)
+                    break;
+
+                offset += written;
+            }
+
+            buffer.clear();
+        }
+
+    }
+
+}
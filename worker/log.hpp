@@ -0,0 +1,82 @@
+#ifndef __WORKER_LOG_
+#define __WORKER_LOG_
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "api.hpp"
+#include "queue.hpp"
+
+namespace worker {
+
+    namespace impl {
+
+        /*
+         * Writes the messages of Fatal, Error, Warn, Info and Debug to
+         * stderr from a background thread, so the slots don't wait for each
+         * other or for the terminal when they log.
+         *
+         * Every thread formats its own messages and passes them through a
+         * lock-free queue, which the writer drains into a single write().
+         * The messages of a thread are written in order. A thread finding
+         * the queue full writes the queued messages itself.
+         */
+        class Log {
+        public:
+            typedef std::chrono::steady_clock clock_t;
+
+            static const size_t CAPACITY;
+            // how long the writer sleeps when it isn't woken up
+            static const clock_t::duration IDLE_INTERVAL;
+
+            static Log &get();
+
+            // queues message to be written as is, taking its contents
+            void append(std::string &message);
+
+            // writes the queued messages before returning
+            void flush();
+
+            // the time since the log was created
+            inline clock_t::duration getUptime() const {
+                return clock_t::now() - start;
+            }
+
+        private:
+            Log();
+            ~Log();
+
+            // no copying!
+            Log(const Log &o);
+
+            typedef std::mutex                  mutex_t;
+            typedef std::unique_lock<mutex_t>   lock_t;
+
+            // must be called with writeMutex locked
+            void drain();
+            void wake();
+
+            const clock_t::time_point start;
+
+            BoundedQueue<std::string> queue;
+            // keeps the messages in order when another thread flushes
+            mutex_t writeMutex;
+            std::string buffer;
+
+            mutex_t mutex;
+            std::condition_variable messageQueued;
+            std::atomic<bool> sleeping;
+            bool stopping;
+
+            std::thread writer;
+        };
+
+    }
+
+}
+
+#endif // !defined(__WORKER_LOG_)
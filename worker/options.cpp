@@ -6,6 +6,7 @@
 #include <boost/program_options.hpp>
 #include <sstream>
 #include <cstdio>
+#include <cstdlib>
 
 using namespace std;
 
@@ -14,6 +15,8 @@ namespace worker {
     namespace po = ::boost::program_options;
 
     static const char * const usage = R"EOS(Usage: %1$s [options] <command> <argument> [argument ...]
+       %1$s [options] --input <file> <command>
+       %1$s [options] --arg-file <file> <command>
 
 %2$s
 Placeholders:
@@ -26,6 +29,41 @@ Placeholders:
     - cat {} > {0//e/o}     # replace all 'e' with 'o'
     - cat {} > {0/%%e/o}     # replace the final character
                             # with 'o' if it is 'e'
+  Common transforms are done by worker itself, without starting a helper:
+    - gzip -c {} > {0/.}.gz         # {0/} basename, {0//} directory, {0.}
+                                    # and {0/.} without the extension
+    - mv {} {0#tmp_}                # remove the prefix 'tmp_'
+    - cc -c {} -o {0:s/\.c$/.o/}    # sed-style regular expression, add
+                                    # a g before the } to replace all
+    - echo {#} {%%}                  # the number of the job and the slot it
+                                    # runs in, the same as $WORKER_SLOT
+  The index can be left out of the path transforms, like with {}.
+
+Arguments:
+  Quoted patterns are expanded by worker itself, the first jobs start while the
+  directories are still being read. Besides *, ?, [...], {a,b} and ~, **
+  matches any number of directories (without following symbolic links):
+    - %1$s 'gzip -9' 'logs/**/*.log'
+  A pattern that matches nothing is passed as is.
+
+Execution:
+  Commands that only consist of programs, quoted arguments, pipes (|), &&
+  and redirections (<, > and >>) are executed without /bin/sh, with every
+  placeholder passed as (part of) a single argument. All other commands,
+  including those using shell builtins like echo, printf, test or cd, are
+  executed using /bin/sh -c, with every placeholder quoted as a single
+  word. Use --shell to always do so.
+  With --persistent, every thread starts /bin/sh once and runs its jobs
+  in subshells of it, which is a lot faster for short jobs.
+
+Batching:
+  With --batch or --max-args, every placeholder expands to the values of
+  multiple arguments, each with its replacement applied. For commands run
+  using /bin/sh the values are quoted, and quotes around the placeholder
+  are closed around them. As many arguments as allowed by ARG_MAX are
+  passed by default:
+    - %1$s -X 'gzip -9' *.log      # gzip -9 a.log b.log ...
+    - %1$s -N 2 'echo {0/%%.c/.o}' *.c    # echo a.o b.o, echo c.o d.o, ...
 
 Notes:
   The default number of threads differs depending on your system, it is the same
@@ -53,6 +91,13 @@ Example usage:
     %1$s xdg-open *.png
   Note that this is equivalent to using 'find', except for the multi-threading.
     find . -maxdepth 1 -name \*.png -exec xdg-open '{}' \;
+
+  To run every combination of inputs and configs, with the jobs for the same
+  input close together (use --product-order 1 to group by config instead):
+    %1$s -p 'simulate {} --config {}' 'inputs/*' 'configs/*'
+
+  Arguments can also be streamed in, jobs are started as the arguments arrive:
+    find . -name \*.png -print0 | %1$s -0 --input - 'optipng {}'
 )EOS";
 
     Options::Options() {
@@ -72,7 +117,42 @@ Example usage:
             ("quiet,q", "run quiet, no program output")
             ("output,o", "show program output")
             ("nooutput,s", "do not show program output")
+            ("output-mode", po::value<string>()->default_value("lines"), "how program output is shown: lines, grouped (all output of a job at once) or passthrough (unbuffered, can interleave)")
+            ("keep-order,k", "show the output of the jobs in the order of their arguments")
+            ("keep-order-memory", po::value<uint>()->default_value(64), "the maximum output in MiB kept in memory while waiting for earlier jobs with --keep-order, more output is written to a temporary file")
             ("nthreads,n", po::value<uint>()->default_value(System::getNbCores()), "the maximum number of threads to use")
+            ("input,a", po::value<string>(), "read the arguments from a file, fifo or stdin (-), one per line")
+            ("arg-file", po::value<string>(), "like --input, but maps the file into memory instead of reading it, which is faster for large files")
+            ("null,0", "arguments read using --input or --arg-file are separated by NUL characters instead of newlines")
+            ("delimiter,d", po::value<string>(), "arguments read using --input or --arg-file are separated by this character")
+            ("product,p", "run every combination of the arguments of the placeholders instead of combining the first arguments, the second arguments, ...")
+            ("product-order", po::value<string>(), "comma-separated placeholders, from the one that changes the slowest to the fastest with --product, implies --product")
+            ("batch,X", "pass as many arguments as fit to every invocation of the command, like xargs")
+            ("max-args,N", po::value<uint>(), "pass at most this many arguments to every invocation of the command, implies --batch")
+            ("cache", po::value<string>(), "skip jobs that succeeded before with the same command and input files, remembered in this file, and show their output again")
+            ("cache-contents", "compare the contents of input files for --cache, instead of their size and modification time")
+            ("cache-output", po::value<string>(), "the files every job writes, using placeholders like the command, e.g. '{0/%.c/.o}'. --cache only skips jobs whose output files are known, from this option or from > and >>")
+            ("journal", po::value<string>(), "record when every job starts and finishes in this file")
+            ("resume", "skip the jobs that succeeded according to --journal, with the same command")
+            ("summary", "print the number of jobs, their durations and the resources they used at the end")
+            ("stats", po::value<string>(), "write the duration, CPU time, memory, I/O and output of every job to this file, as JSON if it ends in .json and CSV otherwise")
+            ("history", po::value<string>(), "remember how long every job took in this file, for --longest-first")
+            ("longest-first", "start the jobs expected to take longest first, based on --history or the size of the files among their arguments. Jobs only start once --queue-size jobs are waiting, all jobs are generated or --input has to wait for more arguments")
+            ("timeout", po::value<double>(), "kill jobs that run longer than this many seconds, with SIGTERM and SIGKILL 5 seconds later")
+            ("speculate", po::value<double>(), "the jobs are idempotent: once all jobs have started, start a copy of the jobs that have been running this many times longer than the median job, and keep the result of the copy that finishes first")
+            ("queue-size", po::value<uint>()->default_value(1024), "the maximum number of jobs waiting to be executed, rounded up to a power of two")
+            ("max-cpu-pressure", po::value<double>(), "don't start new jobs while the cpu pressure (some avg10 in /proc/pressure/cpu) is above this percentage")
+            ("max-memory-pressure", po::value<double>(), "don't start new jobs while the memory pressure is above this percentage")
+            ("max-io-pressure", po::value<double>(), "don't start new jobs while the io pressure is above this percentage")
+            ("min-memory-available", po::value<uint>(), "don't start new jobs while less than this many MiB of memory are available (MemAvailable in /proc/meminfo)")
+            ("max-load", po::value<double>(), "don't start new jobs while the 1 minute load average is above this value")
+            ("affinity", po::value<string>(), "pin the jobs of every thread to a cpu, core or node, jobs get the thread number in $WORKER_SLOT either way (Linux only)")
+            ("affinity-policy", po::value<string>()->default_value("compact"), "how threads are placed with --affinity: compact (fill a node first) or scatter (spread over nodes and cores)")
+            ("spawn", po::value<string>()->default_value("posix_spawn"), "the way processes are created: posix_spawn, vfork or fork")
+            ("shell", "always execute commands using /bin/sh")
+            ("persistent", "run the jobs of every thread in one long-lived /bin/sh instead of starting a new process for every job")
+            ("coprocess", po::value<string>(), "like --persistent, but using this program, which gets every job followed by a NUL character on stdin and writes its exit status to fd 3")
+            ("event-loop", "run all jobs from a single thread instead of a thread per job (Linux only)")
             ("version", "print version info and exit");
     }
 
@@ -95,6 +175,37 @@ Example usage:
         );
     }
 
+    static bool parseDelimiter(const string &str, char &delimiter) {
+        if (str.length() == 1) {
+            delimiter = str[0];
+            return true;
+        }
+
+        if (str.length() != 2 || str[0] != '\\')
+            return false;
+
+        switch (str[1]) {
+        case '0':  delimiter = '\0'; return true;
+        case 'n':  delimiter = '\n'; return true;
+        case 't':  delimiter = '\t'; return true;
+        case '\\': delimiter = '\\'; return true;
+        default:   return false;
+        }
+    }
+
+    static bool parseOrder(const string &str, vector<uint> &order) {
+        stringstream s(str);
+        string item;
+
+        while (getline(s, item, ',')) {
+            if (item.empty() || item.find_first_not_of("0123456789") != string::npos)
+                return false;
+            order.push_back(uint(atoi(item.c_str())));
+        }
+
+        return !order.empty();
+    }
+
     Options &parseOptions(int argc, char **argv) {
         program_name = argv[0];
         createOptions();
@@ -150,11 +261,130 @@ Example usage:
 
         options.nthreads = vm.count("nthreads") ? vm["nthreads"].as<uint>() : System::getNbCores();
 
+        if (!System::parseOutputMode(vm["output-mode"].as<string>(), options.outputMode)) {
+            fprintf(stderr, "Invalid output mode \"%s\"\n", vm["output-mode"].as<string>().c_str());
+            Options::usage();
+            exit(1);
+        }
+
+        if (vm.count("keep-order")) {
+            options.outputMode = System::OUTPUT_ORDERED;
+        }
+        options.orderMemory = size_t(vm["keep-order-memory"].as<uint>()) << 20;
+
+        options.queueSize = vm["queue-size"].as<uint>();
+        options.useShell = vm.count("shell");
+        options.eventLoop = vm.count("event-loop");
+
+        if (vm.count("coprocess"))
+            options.coprocess = vm["coprocess"].as<string>();
+        options.persistent = vm.count("persistent") || vm.count("coprocess");
+
+        if (vm.count("product-order") && !parseOrder(vm["product-order"].as<string>(), options.productOrder)) {
+            fprintf(stderr, "Invalid product order \"%s\"\n", vm["product-order"].as<string>().c_str());
+            Options::usage();
+            exit(1);
+        }
+        options.product = vm.count("product") || vm.count("product-order");
+
+        if (vm.count("max-cpu-pressure"))
+            options.pressureLimits.cpu = vm["max-cpu-pressure"].as<double>();
+        if (vm.count("max-memory-pressure"))
+            options.pressureLimits.memory = vm["max-memory-pressure"].as<double>();
+        if (vm.count("max-io-pressure"))
+            options.pressureLimits.io = vm["max-io-pressure"].as<double>();
+        if (vm.count("min-memory-available"))
+            options.pressureLimits.memAvailable = uint64_t(vm["min-memory-available"].as<uint>()) << 20;
+        if (vm.count("max-load"))
+            options.pressureLimits.load = vm["max-load"].as<double>();
+
+        if (vm.count("cache"))
+            options.cache = vm["cache"].as<string>();
+        options.cacheContents = vm.count("cache-contents");
+        if (vm.count("cache-output"))
+            options.cacheOutput = vm["cache-output"].as<string>();
+
+        if (vm.count("journal"))
+            options.journal = vm["journal"].as<string>();
+        options.resume = vm.count("resume");
+        if (options.resume && options.journal.empty()) {
+            fprintf(stderr, "--resume requires --journal\n");
+            Options::usage();
+            exit(1);
+        }
+
+        options.summary = vm.count("summary");
+        if (vm.count("stats"))
+            options.stats = vm["stats"].as<string>();
+
+        if (vm.count("history"))
+            options.history = vm["history"].as<string>();
+        options.longestFirst = vm.count("longest-first");
+
+        options.timeout = vm.count("timeout") ? vm["timeout"].as<double>() : 0;
+        options.speculate = vm.count("speculate") ? vm["speculate"].as<double>() : 0;
+        if (options.timeout < 0 || options.speculate < 0) {
+            fprintf(stderr, "Invalid %s\n", (options.timeout < 0) ? "timeout" : "speculation factor");
+            Options::usage();
+            exit(1);
+        }
+        if ((options.timeout > 0 || options.speculate > 0) && options.persistent) {
+            // the jobs don't have their own processes to kill
+            fprintf(stderr, "--timeout and --speculate can't be used with persistent workers\n");
+            Options::usage();
+            exit(1);
+        }
+
+        if (vm.count("affinity"))
+            options.affinity = vm["affinity"].as<string>();
+        options.affinityPolicy = vm["affinity-policy"].as<string>();
+
+        options.maxArguments = vm.count("max-args") ? vm["max-args"].as<uint>() : 0;
+        options.batch = vm.count("batch") || options.maxArguments > 0;
+
+        if (!System::parseSpawnMethod(vm["spawn"].as<string>(), options.spawnMethod)) {
+            fprintf(stderr, "Invalid spawn method \"%s\"\n", vm["spawn"].as<string>().c_str());
+            Options::usage();
+            exit(1);
+        }
+
         if (!vm.count("command")) {
             Options::usage();
             exit(-2);
         }
         options.command = vm["command"].as<Options::command_t>();
+        options.delimiter = '\n';
+        if (vm.count("null")) {
+            options.delimiter = '\0';
+        } else if (vm.count("delimiter")) {
+            if (!parseDelimiter(vm["delimiter"].as<string>(), options.delimiter)) {
+                fprintf(stderr, "Invalid delimiter \"%s\"\n", vm["delimiter"].as<string>().c_str());
+                Options::usage();
+                exit(1);
+            }
+        }
+
+        if (vm.count("input") && vm.count("arg-file")) {
+            fprintf(stderr, "--input can't be combined with --arg-file\n");
+            Options::usage();
+            exit(-4);
+        }
+
+        if (vm.count("input") || vm.count("arg-file")) {
+            if (vm.count("input"))
+                options.input = vm["input"].as<string>();
+            else
+                options.argFile = vm["arg-file"].as<string>();
+
+            if (vm.count("arg")) {
+                fprintf(stderr, "Arguments can't be combined with %s\n", vm.count("input") ? "--input" : "--arg-file");
+                Options::usage();
+                exit(-4);
+            }
+
+            return options;
+        }
+
         if (!vm.count("arg")) {
             Options::usage();
             exit(-4);
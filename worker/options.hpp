@@ -5,6 +5,7 @@
 #include <vector>
 
 #include "api.hpp"
+#include "system.hpp"
 
 namespace worker {
 
@@ -22,10 +23,69 @@ namespace worker {
         bool version;
         
         uint nthreads;
+        uint queueSize;
+        
+        System::SpawnMethod spawnMethod;
+        System::OutputMode outputMode;
+        size_t orderMemory;
+        bool eventLoop;
+        PressureLimits pressureLimits;
+        
+        // pin the jobs of every slot to a cpu, core or node (Linux only)
+        std::string affinity;
+        std::string affinityPolicy;
+        bool useShell;
+        
+        // run the jobs of every thread in a single long-lived process,
+        // /bin/sh unless coprocess is set
+        bool persistent;
+        std::string coprocess;
+        
+        // pass the arguments of multiple jobs to a single invocation, with
+        // at most maxArguments jobs per invocation (0 is as many as fit)
+        bool batch;
+        uint maxArguments;
         
         command_t command;
         arglist_t arguments;
         
+        // run every combination of the arguments of the placeholders
+        // instead of combining the i-th arguments, see ProductGenerator
+        bool product;
+        std::vector<uint> productOrder;
+        
+        // skip jobs whose result is in this file, see ResultCache
+        std::string cache;
+        bool cacheContents;
+        // the files every job writes, as a template like the command
+        std::string cacheOutput;
+        
+        // record the jobs in this file, and skip the ones that succeeded
+        // according to it with resume, see Journal
+        std::string journal;
+        bool resume;
+        
+        // kill jobs after timeout seconds, and run a copy of jobs that take
+        // speculate times longer than the median, see Supervisor
+        double timeout;
+        double speculate;
+        
+        // remember how long jobs took in this file, and start the jobs
+        // expected to take longest first, see RuntimeHistory
+        std::string history;
+        bool longestFirst;
+        
+        // print a summary of the resources used by the jobs at the end,
+        // and write the usage of every job to this file, see RunStatistics
+        bool summary;
+        std::string stats;
+        
+        // read arguments from this file instead ("-" is stdin)
+        std::string input;
+        // or map this regular file, see MappedSource
+        std::string argFile;
+        char delimiter;
+        
         static void usage();
         
     private:
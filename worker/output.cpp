@@ -0,0 +1,237 @@
+#include "output.hpp"
+#include "api.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+using namespace std;
+
+namespace worker {
+
+    static const size_t CHUNK_SIZE = 64 * 1024;
+
+    // chunks kept when clearing, so one job with a huge output doesn't pin
+    // that memory for the rest of the run
+    static const size_t MAX_CACHED_CHUNKS = 16;
+
+    OutputBuffer::OutputBuffer() : length(0) {}
+
+    OutputBuffer::~OutputBuffer() {
+        for (vector<char *>::iterator i = chunks.begin(), e = chunks.end(); i != e; i++)
+            delete[] *i;
+    }
+
+    char *OutputBuffer::reserve(size_t &available) {
+        size_t chunk = length / CHUNK_SIZE;
+        size_t offset = length % CHUNK_SIZE;
+
+        if (chunk == chunks.size())
+            chunks.push_back(new char[CHUNK_SIZE]);
+
+        available = CHUNK_SIZE - offset;
+        return chunks[chunk] + offset;
+    }
+
+    void OutputBuffer::commit(size_t committed) {
+        length += committed;
+    }
+
+    void OutputBuffer::append(const char *data, size_t dataLength) {
+        while (dataLength > 0) {
+            size_t available;
+            char *target = reserve(available);
+
+            size_t nbCopied = min(available, dataLength);
+            memcpy(target, data, nbCopied);
+            commit(nbCopied);
+
+            data += nbCopied;
+            dataLength -= nbCopied;
+        }
+    }
+
+    void OutputBuffer::getBuffers(vector<iovec> &iov) const {
+        const size_t nbChunks = (length + CHUNK_SIZE - 1) / CHUNK_SIZE;
+
+        for (size_t i = 0; i < nbChunks; i++) {
+            iovec buffer;
+            buffer.iov_base = chunks[i];
+            buffer.iov_len = (i + 1 == nbChunks) ? length - i * CHUNK_SIZE : CHUNK_SIZE;
+            iov.push_back(buffer);
+        }
+    }
+
+    void OutputBuffer::flush() {
+        if (length == 0)
+            return;
+
+        vector<iovec> iov;
+        getBuffers(iov);
+
+        Output(&iov[0], iov.size());
+        clear();
+    }
+
+    void OutputBuffer::clear() {
+        length = 0;
+
+        while (chunks.size() > MAX_CACHED_CHUNKS) {
+            delete[] chunks.back();
+            chunks.pop_back();
+        }
+    }
+
+    OrderedOutput::OrderedOutput(size_t memoryLimit)
+        : memoryLimit(memoryLimit), memoryUsed(0), nextSequence(0), spillFd(-1), spillOffset(0), nbSpilled(0)
+    {}
+
+    OrderedOutput::~OrderedOutput() {
+        if (!pending.empty())
+            Error("%u jobs never wrote their output", uint(pending.size()));
+
+        if (spillFd >= 0)
+            close(spillFd);
+    }
+
+    int OrderedOutput::getSpillFd() {
+        if (spillFd >= 0)
+            return spillFd;
+
+        const char *tmpdir = getenv("TMPDIR");
+        string path = (tmpdir != NULL && *tmpdir != '\0') ? tmpdir : "/tmp";
+        path += "/worker-output.XXXXXX";
+
+        vector<char> pathBuffer(path.begin(), path.end());
+        pathBuffer.push_back('\0');
+
+        spillFd = mkstemp(&pathBuffer[0]);
+        if (spillFd < 0)
+            Fatal("Unable to create a temporary file in %s: %s", path.c_str(), strerror(errno));
+
+        // nobody else needs to see the file
+        unlink(&pathBuffer[0]);
+        fcntl(spillFd, F_SETFD, FD_CLOEXEC);
+
+        Debug("Created temporary file for ordered output");
+        return spillFd;
+    }
+
+    void OrderedOutput::store(uint64_t sequence, const vector<iovec> &iov, size_t length) {
+        Pending &entry = pending[sequence];
+        entry.length = length;
+
+        if (memoryUsed + length <= memoryLimit) {
+            entry.spilled = false;
+            entry.offset = 0;
+
+            entry.data.reserve(length);
+            for (vector<iovec>::const_iterator i = iov.begin(), e = iov.end(); i != e; i++)
+                entry.data.append(static_cast<const char *>(i->iov_base), i->iov_len);
+
+            memoryUsed += length;
+            return;
+        }
+
+        Debug("Waiting output exceeds %u bytes, writing output of job %u to disk", uint(memoryLimit), uint(sequence));
+
+        int fd = getSpillFd();
+        entry.spilled = true;
+        nbSpilled++;
+        entry.offset = spillOffset;
+
+        for (vector<iovec>::const_iterator i = iov.begin(), e = iov.end(); i != e; i++) {
+            const char *data = static_cast<const char *>(i->iov_base);
+            size_t remaining = i->iov_len;
+
+            while (remaining > 0) {
+                ssize_t written = pwrite(fd, data, remaining, spillOffset);
+                if (written < 0) {
+                    if (errno == EINTR)
+                        continue;
+                    Fatal("Unable to write to temporary file: %s", strerror(errno));
+                }
+
+                data += written;
+                remaining -= written;
+                spillOffset += written;
+            }
+        }
+    }
+
+    void OrderedOutput::write(const Pending &entry) {
+        if (entry.length == 0)
+            return;
+
+        iovec iov;
+
+        if (!entry.spilled) {
+            iov.iov_base = const_cast<char *>(entry.data.data());
+            iov.iov_len = entry.length;
+            Output(&iov, 1);
+            return;
+        }
+
+        vector<char> buffer(min(entry.length, CHUNK_SIZE));
+        size_t remaining = entry.length;
+        off_t offset = entry.offset;
+
+        while (remaining > 0) {
+            ssize_t nbRead = pread(spillFd, &buffer[0], min(remaining, buffer.size()), offset);
+            if (nbRead <= 0) {
+                if (nbRead < 0 && errno == EINTR)
+                    continue;
+                Fatal("Unable to read from temporary file: %s", strerror(errno));
+            }
+
+            iov.iov_base = &buffer[0];
+            iov.iov_len = nbRead;
+            Output(&iov, 1);
+
+            remaining -= nbRead;
+            offset += nbRead;
+        }
+    }
+
+    void OrderedOutput::complete(uint64_t sequence, const OutputBuffer &buffer) {
+        vector<iovec> iov;
+        buffer.getBuffers(iov);
+
+        unique_lock<std::mutex> lock(mutex);
+
+        if (sequence != nextSequence) {
+            store(sequence, iov, buffer.size());
+            return;
+        }
+
+        if (!iov.empty())
+            Output(&iov[0], iov.size());
+        nextSequence++;
+
+        // write everything that was waiting for this job
+        while (!pending.empty() && pending.begin()->first == nextSequence) {
+            const Pending &entry = pending.begin()->second;
+            write(entry);
+
+            if (entry.spilled)
+                nbSpilled--;
+            else
+                memoryUsed -= entry.length;
+
+            pending.erase(pending.begin());
+            nextSequence++;
+        }
+
+        // everything in the temporary file has been written
+        if (spillOffset > 0 && nbSpilled == 0) {
+            if (ftruncate(spillFd, 0) != 0)
+                Error("Unable to truncate temporary file: %s", strerror(errno));
+            spillOffset = 0;
+        }
+    }
+
+}
@@ -0,0 +1,111 @@
+#ifndef __WORKER_OUTPUT_
+#define __WORKER_OUTPUT_
+
+#include <cstddef>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+
+#include "api.hpp"
+
+namespace worker {
+
+    /*
+     * Collects the output of a job so it can be written in one go.
+     *
+     * The output is stored in fixed-size chunks that are kept when the
+     * buffer is cleared, so a buffer reused for many jobs stops allocating
+     * once it has grown to the size of a typical job's output.
+     */
+    class OutputBuffer {
+    public:
+        OutputBuffer();
+        ~OutputBuffer();
+
+        // returns a pointer to at least one free byte, length is set to the
+        // number of free bytes available. Call commit() after writing.
+        char *reserve(size_t &length);
+        void commit(size_t length);
+
+        void append(const char *data, size_t length);
+
+        inline size_t size() const {
+            return length;
+        }
+
+        inline bool empty() const {
+            return length == 0;
+        }
+
+        // writes the contents to stdout using a single Output() call and
+        // clears the buffer
+        void flush();
+
+        // appends an iovec for every chunk in use
+        void getBuffers(std::vector<struct iovec> &iov) const;
+
+        void clear();
+
+    private:
+        // no copying!
+        OutputBuffer(const OutputBuffer &o);
+
+        std::vector<char *> chunks;
+        size_t length;
+    };
+
+    /*
+     * Writes the output of jobs in the order the jobs were generated.
+     *
+     * The output of a job that finishes before all earlier jobs have
+     * finished is kept until it is its turn. Once more than memoryLimit
+     * bytes are waiting, the output of further jobs is written to a
+     * temporary file instead, so a slow job at the head of the line
+     * doesn't make the waiting output grow without bounds.
+     */
+    class OrderedOutput {
+    public:
+        OrderedOutput(size_t memoryLimit);
+        ~OrderedOutput();
+
+        // the job with the given sequence number has finished, buffer
+        // contains its output
+        void complete(uint64_t sequence, const OutputBuffer &buffer);
+
+    private:
+        // no copying!
+        OrderedOutput(const OrderedOutput &o);
+
+        struct Pending {
+            std::string data;
+
+            bool spilled;
+            off_t offset;
+            size_t length;
+        };
+
+        typedef std::map<uint64_t, Pending> pending_t;
+
+        void store(uint64_t sequence, const std::vector<struct iovec> &iov, size_t length);
+        void write(const Pending &pending);
+
+        int getSpillFd();
+
+        const size_t memoryLimit;
+        size_t memoryUsed;
+
+        uint64_t nextSequence;
+        pending_t pending;
+
+        int spillFd;
+        off_t spillOffset;
+        size_t nbSpilled;
+
+        std::mutex mutex;
+    };
+
+}
+
+#endif // !defined(__WORKER_OUTPUT_)
@@ -0,0 +1,178 @@
+#include "pressure.hpp"
+#include "api.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+using namespace std;
+
+namespace worker {
+
+    PressureLimits::PressureLimits()
+        : cpu(0), memory(0), io(0), memAvailable(0), load(0)
+    {}
+
+    bool PressureLimits::isEnabled() const {
+        return cpu > 0 || memory > 0 || io > 0 || memAvailable > 0 || load > 0;
+    }
+
+    const AdmissionControl::clock_t::duration AdmissionControl::SAMPLE_INTERVAL = chrono::milliseconds(250);
+
+    // the "some avg10" value of a /proc/pressure file, or a negative value
+    // if the kernel doesn't support PSI
+    static double readPressure(const char *file) {
+        FILE *f = fopen(file, "re");
+        if (f == NULL)
+            return -1;
+
+        double avg10 = -1;
+        if (fscanf(f, "some avg10=%lf", &avg10) != 1)
+            avg10 = -1;
+
+        fclose(f);
+        return avg10;
+    }
+
+    // MemAvailable in bytes, 0 if unknown
+    static uint64_t readMemAvailable() {
+        FILE *f = fopen("/proc/meminfo", "re");
+        if (f == NULL)
+            return 0;
+
+        char line[256];
+        unsigned long long kb = 0;
+        while (fgets(line, sizeof(line), f) != NULL) {
+            if (sscanf(line, "MemAvailable: %llu kB", &kb) == 1)
+                break;
+        }
+
+        fclose(f);
+        return uint64_t(kb) * 1024;
+    }
+
+    AdmissionControl::AdmissionControl(const PressureLimits &limits)
+        : limits(limits), nbRunning(0), throttled(false), lastResult(true)
+    {
+        // check which metrics are available once, so they aren't retried
+        const char * const files[] = { "/proc/pressure/cpu", "/proc/pressure/memory", "/proc/pressure/io" };
+        double * const values[] = { &this->limits.cpu, &this->limits.memory, &this->limits.io };
+
+        for (size_t i = 0; i < 3; i++) {
+            if (*values[i] > 0 && readPressure(files[i]) < 0) {
+                Warn("Unable to read %s, ignoring its limit", files[i]);
+                *values[i] = 0;
+            }
+        }
+
+        if (this->limits.memAvailable > 0 && readMemAvailable() == 0) {
+            Warn("Unable to read MemAvailable from /proc/meminfo, ignoring its limit");
+            this->limits.memAvailable = 0;
+        }
+
+        lastSample = clock_t::now() - SAMPLE_INTERVAL;
+    }
+
+    bool AdmissionControl::sample(string &reason) {
+        char description[128];
+
+        const char * const names[] = { "cpu", "memory", "io" };
+        const char * const files[] = { "/proc/pressure/cpu", "/proc/pressure/memory", "/proc/pressure/io" };
+        const double limit[] = { limits.cpu, limits.memory, limits.io };
+
+        for (size_t i = 0; i < 3; i++) {
+            if (limit[i] <= 0)
+                continue;
+
+            double value = readPressure(files[i]);
+            Debug("%s pressure is %.2f%%", names[i], value);
+
+            if (value > limit[i]) {
+                snprintf(description, sizeof(description), "%s pressure is %.2f%%, above %.2f%%", names[i], value, limit[i]);
+                reason = description;
+                return false;
+            }
+        }
+
+        if (limits.memAvailable > 0) {
+            uint64_t available = readMemAvailable();
+            Debug("%llu MiB of memory available", (unsigned long long)(available >> 20));
+
+            if (available < limits.memAvailable) {
+                snprintf(description, sizeof(description), "only %llu MiB of memory available, below %llu MiB",
+                        (unsigned long long)(available >> 20), (unsigned long long)(limits.memAvailable >> 20));
+                reason = description;
+                return false;
+            }
+        }
+
+        if (limits.load > 0) {
+            double load;
+            if (getloadavg(&load, 1) == 1) {
+                Debug("Load average is %.2f", load);
+
+                if (load > limits.load) {
+                    snprintf(description, sizeof(description), "load average is %.2f, above %.2f", load, limits.load);
+                    reason = description;
+                    return false;
+                }
+            }
+        }
+
+        return true;
+    }
+
+    bool AdmissionControl::isAdmissible() {
+        if (nbRunning == 0) {
+            if (throttled)
+                Debug("Starting a job although the pressure is high, none are running");
+            return true;
+        }
+
+        clock_t::time_point now = clock_t::now();
+        if (now - lastSample >= SAMPLE_INTERVAL) {
+            lastSample = now;
+            lastResult = sample(lastReason);
+        }
+
+        if (!lastResult) {
+            if (!throttled)
+                Info("Pausing new jobs with %u running: %s", nbRunning, lastReason.c_str());
+            throttled = true;
+            return false;
+        }
+
+        if (throttled)
+            Info("Resuming new jobs, the pressure has drained");
+        throttled = false;
+        return true;
+    }
+
+    void AdmissionControl::admit() {
+        lock_t lock(mutex);
+
+        while (!isAdmissible())
+            released.wait_for(lock, SAMPLE_INTERVAL);
+
+        nbRunning++;
+    }
+
+    bool AdmissionControl::tryAdmit() {
+        lock_t lock(mutex);
+
+        if (!isAdmissible())
+            return false;
+
+        nbRunning++;
+        return true;
+    }
+
+    void AdmissionControl::release() {
+        lock_t lock(mutex);
+
+        nbRunning--;
+        if (nbRunning == 0)
+            released.notify_all();
+    }
+
+}
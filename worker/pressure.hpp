@@ -0,0 +1,84 @@
+#ifndef __WORKER_PRESSURE_
+#define __WORKER_PRESSURE_
+
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+
+#include "api.hpp"
+
+namespace worker {
+
+    // the limits above which no new jobs are started, 0 disables a limit
+    struct PressureLimits {
+        // the "some avg10" percentage of /proc/pressure/{cpu,memory,io}
+        double cpu;
+        double memory;
+        double io;
+
+        // the minimum MemAvailable of /proc/meminfo, in bytes
+        uint64_t memAvailable;
+
+        // the 1 minute load average
+        double load;
+
+        PressureLimits();
+
+        bool isEnabled() const;
+    };
+
+    /*
+     * Holds back new jobs while the system is under pressure.
+     *
+     * The pressure is sampled at most every SAMPLE_INTERVAL, jobs that
+     * aren't admitted wait until the pressure has drained below all limits.
+     * A job is always admitted when none of our jobs are running, so the
+     * load of other processes can't stall us completely.
+     */
+    class AdmissionControl {
+    public:
+        typedef std::chrono::steady_clock clock_t;
+
+        static const clock_t::duration SAMPLE_INTERVAL;
+
+        AdmissionControl(const PressureLimits &limits);
+
+        // blocks until a new job may be started
+        void admit();
+
+        // returns false if no new job may be started right now
+        bool tryAdmit();
+
+        // a job that was admitted has finished
+        void release();
+
+    private:
+        // no copying!
+        AdmissionControl(const AdmissionControl &o);
+
+        typedef std::mutex                  mutex_t;
+        typedef std::unique_lock<mutex_t>   lock_t;
+
+        // whether a new job may be started, logs the changes
+        bool isAdmissible();
+
+        // reads the current pressure, returns false if a limit is exceeded
+        // and sets reason to a description of the first one
+        bool sample(std::string &reason);
+
+        PressureLimits limits;
+
+        mutex_t mutex;
+        std::condition_variable released;
+
+        uint nbRunning;
+        bool throttled;
+
+        clock_t::time_point lastSample;
+        bool lastResult;
+        std::string lastReason;
+    };
+
+}
+
+#endif // !defined(__WORKER_PRESSURE_)
@@ -0,0 +1,255 @@
+#ifndef __WORKER_QUEUE_
+#define __WORKER_QUEUE_
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "api.hpp"
+
+namespace worker {
+
+    namespace impl {
+
+        /*
+         * Bounded lock-free multi-producer multi-consumer queue, based on
+         * Dmitry Vyukov's bounded MPMC queue.
+         *
+         * Every cell carries a sequence number telling whether it is ready
+         * to be written (sequence == position) or read (sequence ==
+         * position + 1), so producers and consumers only contend on their
+         * own position counter.
+         *
+         * The capacity is rounded up to a power of two.
+         */
+        template <typename T>
+        class BoundedQueue {
+        public:
+            explicit BoundedQueue(size_t capacity)
+                : cells(new Cell[roundCapacity(capacity)]), mask(roundCapacity(capacity) - 1),
+                  enqueuePos(0), dequeuePos(0)
+            {
+                for (size_t i = 0; i <= mask; i++)
+                    cells[i].sequence.store(i, std::memory_order_relaxed);
+            }
+
+            ~BoundedQueue() {
+                delete[] cells;
+            }
+
+            inline size_t capacity() const {
+                return mask + 1;
+            }
+
+            // only exact when no other thread is using the queue
+            inline size_t size() const {
+                return enqueuePos.load(std::memory_order_relaxed) - dequeuePos.load(std::memory_order_relaxed);
+            }
+
+            // returns false if the queue is full, value is left untouched
+            bool tryPush(T &value) {
+                Cell *cell;
+                size_t pos = enqueuePos.load(std::memory_order_relaxed);
+
+                while (true) {
+                    cell = &cells[pos & mask];
+                    size_t seq = cell->sequence.load(std::memory_order_acquire);
+                    intptr_t diff = intptr_t(seq) - intptr_t(pos);
+
+                    if (diff == 0) {
+                        if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                            break;
+                    } else if (diff < 0) {
+                        return false;
+                    } else {
+                        pos = enqueuePos.load(std::memory_order_relaxed);
+                    }
+                }
+
+                cell->data = std::move(value);
+                cell->sequence.store(pos + 1, std::memory_order_release);
+                return true;
+            }
+
+            // returns false if the queue is empty
+            bool tryPop(T &value) {
+                Cell *cell;
+                size_t pos = dequeuePos.load(std::memory_order_relaxed);
+
+                while (true) {
+                    cell = &cells[pos & mask];
+                    size_t seq = cell->sequence.load(std::memory_order_acquire);
+                    intptr_t diff = intptr_t(seq) - intptr_t(pos + 1);
+
+                    if (diff == 0) {
+                        if (dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                            break;
+                    } else if (diff < 0) {
+                        return false;
+                    } else {
+                        pos = dequeuePos.load(std::memory_order_relaxed);
+                    }
+                }
+
+                value = std::move(cell->data);
+                cell->sequence.store(pos + mask + 1, std::memory_order_release);
+                return true;
+            }
+
+        private:
+            // no copying!
+            BoundedQueue(const BoundedQueue &o);
+
+            static size_t roundCapacity(size_t capacity) {
+                size_t result = 2;
+                while (result < capacity)
+                    result <<= 1;
+                return result;
+            }
+
+            struct Cell {
+                std::atomic<size_t> sequence;
+                T data;
+            };
+
+            static const size_t CACHE_LINE_SIZE = 64;
+
+            Cell * const cells;
+            const size_t mask;
+
+            // keep the producer and consumer positions on separate cache lines
+            char pad0[CACHE_LINE_SIZE];
+            std::atomic<size_t> enqueuePos;
+            char pad1[CACHE_LINE_SIZE];
+            std::atomic<size_t> dequeuePos;
+            char pad2[CACHE_LINE_SIZE];
+        };
+
+        /*
+         * Bounded queue returning the greatest value according to Compare
+         * first, a binary heap protected by a mutex.
+         */
+        template <typename T, typename Compare>
+        class PriorityQueue {
+        public:
+            explicit PriorityQueue(size_t capacity)
+                : maxSize(capacity)
+            {
+                heap.reserve(capacity);
+            }
+
+            inline size_t capacity() const {
+                return maxSize;
+            }
+
+            inline size_t size() const {
+                lock_t lock(mutex);
+                return heap.size();
+            }
+
+            // returns false if the queue is full, value is left untouched
+            bool tryPush(T &value) {
+                lock_t lock(mutex);
+                if (heap.size() >= maxSize)
+                    return false;
+
+                heap.push_back(std::move(value));
+                std::push_heap(heap.begin(), heap.end(), compare);
+                return true;
+            }
+
+            // returns false if the queue is empty
+            bool tryPop(T &value) {
+                lock_t lock(mutex);
+                if (heap.empty())
+                    return false;
+
+                std::pop_heap(heap.begin(), heap.end(), compare);
+                value = std::move(heap.back());
+                heap.pop_back();
+                return true;
+            }
+
+        private:
+            // no copying!
+            PriorityQueue(const PriorityQueue &o);
+
+            typedef std::mutex                  mutex_t;
+            typedef std::lock_guard<mutex_t>    lock_t;
+
+            const size_t maxSize;
+            Compare compare;
+
+            mutable mutex_t mutex;
+            std::vector<T> heap;
+        };
+
+        /*
+         * A BoundedQueue, or a PriorityQueue if prioritized is set. The
+         * lock-free queue is kept for the common case where the order
+         * doesn't matter.
+         *
+         * Values pushed one by one would be popped as soon as they arrive,
+         * so a prioritized queue holds them back until it has been full
+         * once or release() is called.
+         */
+        template <typename T, typename Compare>
+        class SchedulingQueue {
+        public:
+            SchedulingQueue(size_t capacity, bool prioritized)
+                : fifo(prioritized ? 1 : capacity), priority(prioritized ? capacity : 0),
+                  prioritized(prioritized), holding(prioritized)
+            {}
+
+            inline size_t capacity() const {
+                return prioritized ? priority.capacity() : fifo.capacity();
+            }
+
+            inline size_t size() const {
+                return prioritized ? priority.size() : fifo.size();
+            }
+
+            inline bool tryPush(T &value) {
+                if (!prioritized)
+                    return fifo.tryPush(value);
+
+                if (!priority.tryPush(value))
+                    return false;
+
+                if (holding.load() && priority.size() >= priority.capacity())
+                    holding.store(false);
+                return true;
+            }
+
+            inline bool tryPop(T &value) {
+                if (!prioritized)
+                    return fifo.tryPop(value);
+
+                return !holding.load() && priority.tryPop(value);
+            }
+
+            // no more values will be pushed for a while, returns false if
+            // nothing was held back anymore
+            inline bool release() {
+                return holding.exchange(false);
+            }
+
+        private:
+            // no copying!
+            SchedulingQueue(const SchedulingQueue &o);
+
+            BoundedQueue<T> fifo;
+            PriorityQueue<T, Compare> priority;
+            const bool prioritized;
+
+            std::atomic<bool> holding;
+        };
+
+    }
+
+}
+
+#endif // !defined(__WORKER_QUEUE_)
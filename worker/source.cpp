@@ -0,0 +1,305 @@
+#include "source.hpp"
+#include "api.hpp"
+
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+namespace worker {
+
+    ArgumentSource::~ArgumentSource() {}
+
+    GlobSource::GlobSource(const patterns_t &patterns)
+        : patterns(patterns), currentPattern(this->patterns.begin()), walker(NULL)
+    {}
+
+    GlobSource::GlobSource(const string &pattern)
+        : patterns(1, pattern), currentPattern(this->patterns.begin()), walker(NULL)
+    {}
+
+    GlobSource::~GlobSource() {
+        delete walker;
+    }
+
+    bool GlobSource::next(string &argument) {
+        while (true) {
+            if (walker == NULL) {
+                if (currentPattern == patterns.end())
+                    return false;
+
+                Debug("Parsing glob \"%s\"", currentPattern->c_str());
+                walker = new GlobWalker(*currentPattern++);
+            }
+
+            if (walker->next(argument))
+                return true;
+
+            delete walker;
+            walker = NULL;
+        }
+    }
+
+    static const size_t STREAM_BUFFER_SIZE = 64 * 1024;
+
+    StreamSource::StreamSource(int fd, char delimiter)
+        : fd(fd), delimiter(delimiter), eof(false),
+          buffer(new char[STREAM_BUFFER_SIZE]), start(0), end(0)
+    {}
+
+    StreamSource::~StreamSource() {
+        if (fd > 0)
+            close(fd);
+        delete[] buffer;
+    }
+
+    bool StreamSource::fill() {
+        if (eof)
+            return false;
+
+        start = end = 0;
+
+        if (onWait) {
+            struct pollfd pfd;
+            pfd.fd = fd;
+            pfd.events = POLLIN;
+            if (poll(&pfd, 1, 0) == 0)
+                onWait();
+        }
+
+        while (true) {
+            ssize_t nbRead = read(fd, buffer, STREAM_BUFFER_SIZE);
+
+            if (nbRead > 0) {
+                end = nbRead;
+                return true;
+            }
+
+            if (nbRead < 0 && errno == EINTR)
+                continue;
+
+            if (nbRead < 0)
+                Error("Error while reading arguments: %s", strerror(errno));
+
+            eof = true;
+            return false;
+        }
+    }
+
+    bool StreamSource::next(string &argument) {
+        argument.clear();
+
+        while (true) {
+            if (start == end && !fill()) {
+                // the final record needn't be terminated
+                return !argument.empty();
+            }
+
+            const char *begin = buffer + start;
+            const char *found = static_cast<const char *>(memchr(begin, delimiter, end - start));
+
+            if (found == NULL) {
+                argument.append(begin, end - start);
+                start = end;
+                continue;
+            }
+
+            argument.append(begin, found - begin);
+            start = found - buffer + 1;
+
+            if (!argument.empty())
+                return true;
+        }
+    }
+
+    const size_t MappedSource::RELEASE_INTERVAL = 64 * 1024 * 1024;
+
+    MappedSource::MappedSource(const string &path, char delimiter)
+        : delimiter(delimiter), data(NULL), size(0), position(0), released(0)
+    {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            Fatal("Unable to open \"%s\": %s", path.c_str(), strerror(errno));
+
+        struct stat st;
+        if (fstat(fd, &st) != 0)
+            Fatal("Unable to stat \"%s\": %s", path.c_str(), strerror(errno));
+        if (!S_ISREG(st.st_mode))
+            Fatal("\"%s\" is not a regular file, use --input to read it instead", path.c_str());
+
+        size = st.st_size;
+        if (size > 0) {
+            void *mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapping == MAP_FAILED)
+                Fatal("Unable to map \"%s\": %s", path.c_str(), strerror(errno));
+
+            data = static_cast<char *>(mapping);
+            madvise(data, size, MADV_SEQUENTIAL);
+        }
+
+        // the mapping stays valid
+        close(fd);
+        Debug("Mapped %llu bytes of arguments from \"%s\"", (unsigned long long)size, path.c_str());
+    }
+
+    MappedSource::~MappedSource() {
+        if (data != NULL)
+            munmap(data, size);
+    }
+
+    bool MappedSource::next(string &argument) {
+        while (position < size) {
+            const char *begin = data + position;
+            const char *found = static_cast<const char *>(memchr(begin, delimiter, size - position));
+            const size_t length = (found == NULL) ? size - position : found - begin;
+
+            position += length + 1;
+
+            if (position - released >= RELEASE_INTERVAL) {
+                const size_t pageSize = sysconf(_SC_PAGESIZE);
+                const size_t end = (begin - data) / pageSize * pageSize;
+
+                madvise(data + released, end - released, MADV_DONTNEED);
+                released = end;
+            }
+
+            if (length > 0) {
+                // reuses the storage of argument, which the generators keep
+                argument.assign(begin, length);
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    ArgumentGenerator::~ArgumentGenerator() {}
+
+    ZipGenerator::ZipGenerator(const sources_t &sources)
+        : sources(sources), nbGenerated(0), failed(false)
+    {}
+
+    ZipGenerator::~ZipGenerator() {
+        for (sources_t::iterator i = sources.begin(), e = sources.end(); i != e; i++)
+            delete *i;
+    }
+
+    bool ZipGenerator::next(arguments_t &arguments) {
+        const size_t nbSources = sources.size();
+        arguments.resize(nbSources);
+
+        if (nbSources == 0 || failed)
+            return false;
+
+        bool first = sources[0]->next(arguments[0]);
+
+        for (size_t i = 1; i < nbSources; i++) {
+            if (sources[i]->next(arguments[i]) == first)
+                continue;
+
+            // the jobs generated so far are running already, let them
+            // finish instead of exiting
+            if (first) {
+                Error("Placeholder %u matches %u items while placeholder 0 matches more items!", i, nbGenerated);
+            } else {
+                Error("Placeholder %u matches more items than placeholder 0, which matches %u items!", i, nbGenerated);
+            }
+
+            failed = true;
+            return false;
+        }
+
+        if (first)
+            nbGenerated++;
+
+        return first;
+    }
+
+    ProductGenerator::ProductGenerator(const sources_t &sources, const order_t &order)
+        : sources(sources), values(sources.size()), started(false), done(false), nbGenerated(0)
+    {
+        const size_t nbSources = sources.size();
+        vector<bool> listed(nbSources, false);
+
+        for (order_t::const_iterator i = order.begin(), e = order.end(); i != e; i++) {
+            if (*i >= nbSources)
+                Fatal("Invalid placeholder %u in the product order, there are only %u placeholders", *i, uint(nbSources));
+            if (listed[*i])
+                Fatal("Placeholder %u occurs more than once in the product order", *i);
+
+            listed[*i] = true;
+            this->order.push_back(*i);
+        }
+
+        for (uint i = 0; i < nbSources; i++) {
+            if (!listed[i])
+                this->order.push_back(i);
+        }
+    }
+
+    ProductGenerator::~ProductGenerator() {
+        for (sources_t::iterator i = sources.begin(), e = sources.end(); i != e; i++)
+            delete *i;
+    }
+
+    bool ProductGenerator::start() {
+        const size_t nbSources = order.size();
+        if (nbSources == 0)
+            return false;
+
+        for (size_t k = 1; k < nbSources; k++) {
+            vector<string> &list = values[order[k]];
+            string value;
+
+            while (sources[order[k]]->next(value))
+                list.push_back(value);
+
+            Debug("Placeholder %u has %u values", order[k], uint(list.size()));
+            if (list.empty())
+                return false;
+        }
+
+        digits.assign(nbSources, 0);
+        return sources[order[0]]->next(first);
+    }
+
+    bool ProductGenerator::next(arguments_t &arguments) {
+        if (done)
+            return false;
+
+        const size_t nbSources = order.size();
+
+        if (!started) {
+            started = true;
+            done = !start();
+        } else {
+            // increment the counter, the last digit changes the fastest
+            size_t k = nbSources;
+            while (--k > 0) {
+                if (++digits[k] < values[order[k]].size())
+                    break;
+                digits[k] = 0;
+            }
+
+            if (k == 0)
+                done = !sources[order[0]]->next(first);
+        }
+
+        if (done)
+            return false;
+
+        arguments.resize(nbSources);
+        arguments[order[0]] = first;
+        for (size_t k = 1; k < nbSources; k++)
+            arguments[order[k]] = values[order[k]][digits[k]];
+
+        nbGenerated++;
+        return true;
+    }
+
+}
@@ -0,0 +1,193 @@
+#ifndef __WORKER_SOURCE_
+#define __WORKER_SOURCE_
+
+#include <string>
+#include <vector>
+#include <functional>
+
+#include "api.hpp"
+#include "walker.hpp"
+
+namespace worker {
+
+    // produces the values for a single placeholder, one at a time
+    struct ArgumentSource {
+        virtual ~ArgumentSource();
+
+        // returns false when the source is exhausted
+        virtual bool next(std::string &argument) = 0;
+    };
+
+    // expands a list of glob patterns, one pattern at a time, returning
+    // the matches of a pattern as they are found
+    struct GlobSource : public ArgumentSource {
+        typedef std::vector<std::string> patterns_t;
+
+        GlobSource(const patterns_t &patterns);
+        GlobSource(const std::string &pattern);
+        ~GlobSource();
+
+        bool next(std::string &argument);
+
+    private:
+        // no copying!
+        GlobSource(const GlobSource &o);
+
+        patterns_t patterns;
+        patterns_t::const_iterator currentPattern;
+
+        GlobWalker *walker;
+    };
+
+    // reads delimited records from a file descriptor (stdin, a pipe, a
+    // fifo, ...) as they arrive, empty records are skipped
+    struct StreamSource : public ArgumentSource {
+        // takes ownership of fd
+        StreamSource(int fd, char delimiter);
+        ~StreamSource();
+
+        bool next(std::string &argument);
+
+        // called whenever reading would block until more input arrives
+        inline void setWaitHandler(const std::function<void()> &handler) {
+            onWait = handler;
+        }
+
+    private:
+        // no copying!
+        StreamSource(const StreamSource &o);
+
+        bool fill();
+
+        int fd;
+        const char delimiter;
+        bool eof;
+
+        std::function<void()> onWait;
+
+        char *buffer;
+        size_t start, end;
+    };
+
+    /*
+     * Splits a regular file into delimited records using a read-only
+     * memory map, so even huge files are never read into memory as a
+     * whole. Empty records are skipped.
+     *
+     * The pages before the current record are given back to the kernel
+     * every RELEASE_INTERVAL bytes, only the records in between are
+     * resident.
+     */
+    struct MappedSource : public ArgumentSource {
+        static const size_t RELEASE_INTERVAL;
+
+        MappedSource(const std::string &path, char delimiter);
+        ~MappedSource();
+
+        bool next(std::string &argument);
+
+    private:
+        // no copying!
+        MappedSource(const MappedSource &o);
+
+        const char delimiter;
+
+        char *data;
+        size_t size;
+        size_t position;
+
+        // the pages before this offset have been released
+        size_t released;
+    };
+
+    // produces the arguments for a single job, one job at a time
+    struct ArgumentGenerator {
+        typedef std::vector<std::string> arguments_t;
+        typedef std::vector<ArgumentSource *> sources_t;
+
+        virtual ~ArgumentGenerator();
+
+        // returns false when all jobs have been generated
+        virtual bool next(arguments_t &arguments) = 0;
+
+        virtual uint getNbGenerated() const = 0;
+
+        // whether next() stopped early because of an error, which has
+        // been logged already
+        virtual bool hasFailed() const {
+            return false;
+        }
+    };
+
+    // takes the i-th value of every source for the i-th job
+    struct ZipGenerator : public ArgumentGenerator {
+        // takes ownership of the sources
+        ZipGenerator(const sources_t &sources);
+        ~ZipGenerator();
+
+        bool next(arguments_t &arguments);
+
+        inline uint getNbGenerated() const {
+            return nbGenerated;
+        }
+
+        inline bool hasFailed() const {
+            return failed;
+        }
+
+    private:
+        // no copying!
+        ZipGenerator(const ZipGenerator &o);
+
+        sources_t sources;
+        uint nbGenerated;
+        bool failed;
+    };
+
+    /*
+     * Generates every combination of the values of the sources.
+     *
+     * order lists the sources from the one that changes the slowest to the
+     * one that changes the fastest, sources that aren't listed follow in
+     * their own order. The combinations are enumerated using a mixed-radix
+     * counter, so only the values of the sources are kept in memory, and
+     * the values of the first source in order are even read one at a time.
+     */
+    struct ProductGenerator : public ArgumentGenerator {
+        typedef std::vector<uint> order_t;
+
+        // takes ownership of the sources
+        ProductGenerator(const sources_t &sources, const order_t &order);
+        ~ProductGenerator();
+
+        bool next(arguments_t &arguments);
+
+        inline uint getNbGenerated() const {
+            return nbGenerated;
+        }
+
+    private:
+        // no copying!
+        ProductGenerator(const ProductGenerator &o);
+
+        bool start();
+
+        sources_t sources;
+        order_t order;
+
+        // the values of every source except order[0]
+        std::vector<std::vector<std::string> > values;
+
+        // the current value of order[0] and the index in the values of the
+        // other sources, both in order
+        std::string first;
+        std::vector<size_t> digits;
+
+        bool started;
+        bool done;
+        uint nbGenerated;
+    };
+
+}
+
+#endif // !defined(__WORKER_SOURCE_)
@@ -0,0 +1,217 @@
+#include "stats.hpp"
+#include "api.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <errno.h>
+#include <sys/resource.h>
+
+using namespace std;
+
+namespace worker {
+
+    static double toSeconds(const struct timeval &tv) {
+        return double(tv.tv_sec) + double(tv.tv_usec) / 1e6;
+    }
+
+    JobUsage::JobUsage()
+        : slot(-1), wallTime(0), spawnTime(0), userTime(0), systemTime(0),
+        inBlocks(0), outBlocks(0), voluntarySwitches(0), involuntarySwitches(0),
+        maxRss(0), outputBytes(0)
+    {}
+
+    void JobUsage::add(const struct rusage &usage) {
+        userTime += toSeconds(usage.ru_utime);
+        systemTime += toSeconds(usage.ru_stime);
+        inBlocks += usage.ru_inblock;
+        outBlocks += usage.ru_oublock;
+        voluntarySwitches += usage.ru_nvcsw;
+        involuntarySwitches += usage.ru_nivcsw;
+
+    #if defined(WORKER_IS_OSX)
+        // in bytes instead of KiB
+        maxRss = max(maxRss, long(usage.ru_maxrss / 1024));
+    #else
+        maxRss = max(maxRss, long(usage.ru_maxrss));
+    #endif
+    }
+
+    // writes str as a JSON string
+    static void writeJsonString(FILE *file, const string &str) {
+        fputc('"', file);
+        for (string::const_iterator c = str.begin(), e = str.end(); c != e; c++) {
+            switch (*c) {
+            case '"':  fputs("\\\"", file); break;
+            case '\\': fputs("\\\\", file); break;
+            case '\n': fputs("\\n", file); break;
+            case '\t': fputs("\\t", file); break;
+            default:
+                if ((unsigned char)*c < 0x20)
+                    fprintf(file, "\\u%04x", (unsigned char)*c);
+                else
+                    fputc(*c, file);
+            }
+        }
+        fputc('"', file);
+    }
+
+    // writes str as a CSV field
+    static void writeCsvString(FILE *file, const string &str) {
+        fputc('"', file);
+        for (string::const_iterator c = str.begin(), e = str.end(); c != e; c++) {
+            if (*c == '"')
+                fputc('"', file);
+            fputc(*c, file);
+        }
+        fputc('"', file);
+    }
+
+    RunStatistics::RunStatistics(uint nbSlots, const string &path)
+        : nbSlots(max(nbSlots, 1u)), start(clock_t::now()), dump(NULL), json(false),
+        nbJobs(0), nbFailed(0), totalWallTime(0), totalSpawnTime(0), totalUserTime(0), totalSystemTime(0),
+        maxRss(0), totalInBlocks(0), totalOutBlocks(0), totalVoluntarySwitches(0), totalInvoluntarySwitches(0),
+        totalOutputBytes(0)
+    {
+        if (path.empty())
+            return;
+
+        if ((dump = fopen(path.c_str(), "w")) == NULL)
+            Fatal("Unable to open \"%s\": %s", path.c_str(), strerror(errno));
+
+        json = path.size() >= 5 && path.compare(path.size() - 5, 5, ".json") == 0;
+        if (json)
+            fputs("{\"jobs\": [", dump);
+        else
+            fputs("sequence,slot,status,start,wall_time,spawn_time,user_time,system_time,max_rss_kib,"
+                "in_blocks,out_blocks,voluntary_switches,involuntary_switches,output_bytes,command\n", dump);
+    }
+
+    RunStatistics::~RunStatistics() {
+        if (dump == NULL)
+            return;
+
+        if (json) {
+            Summary summary;
+            getSummary(summary);
+
+            fprintf(dump, "\n], \"summary\": {\"jobs\": %llu, \"failed\": %llu, \"elapsed\": %.6f, \"throughput\": %.3f, "
+                "\"utilization\": %.4f, \"p50\": %.6f, \"p90\": %.6f, \"p99\": %.6f, \"max\": %.6f, "
+                "\"user_time\": %.6f, \"system_time\": %.6f, \"max_rss_kib\": %ld, \"in_blocks\": %ld, \"out_blocks\": %ld, "
+                "\"voluntary_switches\": %ld, \"involuntary_switches\": %ld, \"spawn_time\": %.6f, "
+                "\"overhead\": %.6f, \"output_bytes\": %llu}}\n",
+                (unsigned long long)summary.nbJobs, (unsigned long long)summary.nbFailed, summary.elapsed, summary.throughput,
+                summary.utilization, summary.p50, summary.p90, summary.p99, summary.max,
+                summary.userTime, summary.systemTime, summary.maxRss, summary.inBlocks, summary.outBlocks,
+                summary.voluntarySwitches, summary.involuntarySwitches, summary.spawnTime,
+                summary.overhead, (unsigned long long)summary.outputBytes);
+        }
+
+        if (fclose(dump) != 0)
+            Error("Unable to write the statistics: %s", strerror(errno));
+    }
+
+    void RunStatistics::record(const Job &job, int status, const JobUsage &usage) {
+        const double finished = chrono::duration<double>(clock_t::now() - start).count();
+
+        lock_t lock(mutex);
+
+        nbJobs++;
+        if (status != 0)
+            nbFailed++;
+
+        wallTimes.push_back(float(usage.wallTime));
+        totalWallTime += usage.wallTime;
+        totalSpawnTime += usage.spawnTime;
+        totalUserTime += usage.userTime;
+        totalSystemTime += usage.systemTime;
+        maxRss = max(maxRss, usage.maxRss);
+        totalInBlocks += usage.inBlocks;
+        totalOutBlocks += usage.outBlocks;
+        totalVoluntarySwitches += usage.voluntarySwitches;
+        totalInvoluntarySwitches += usage.involuntarySwitches;
+        totalOutputBytes += usage.outputBytes;
+
+        if (dump == NULL)
+            return;
+
+        if (json) {
+            fprintf(dump, "%s\n{\"sequence\": %llu, \"slot\": %d, \"status\": %d, \"start\": %.6f, \"wall_time\": %.6f, "
+                "\"spawn_time\": %.6f, \"user_time\": %.6f, \"system_time\": %.6f, \"max_rss_kib\": %ld, "
+                "\"in_blocks\": %ld, \"out_blocks\": %ld, \"voluntary_switches\": %ld, \"involuntary_switches\": %ld, "
+                "\"output_bytes\": %llu, \"command\": ",
+                (nbJobs > 1) ? "," : "",
+                (unsigned long long)job.sequence, usage.slot, status, finished - usage.wallTime, usage.wallTime,
+                usage.spawnTime, usage.userTime, usage.systemTime, usage.maxRss,
+                usage.inBlocks, usage.outBlocks, usage.voluntarySwitches, usage.involuntarySwitches,
+                (unsigned long long)usage.outputBytes);
+            writeJsonString(dump, job.command);
+            fputc('}', dump);
+        } else {
+            fprintf(dump, "%llu,%d,%d,%.6f,%.6f,%.6f,%.6f,%.6f,%ld,%ld,%ld,%ld,%ld,%llu,",
+                (unsigned long long)job.sequence, usage.slot, status, finished - usage.wallTime, usage.wallTime,
+                usage.spawnTime, usage.userTime, usage.systemTime, usage.maxRss,
+                usage.inBlocks, usage.outBlocks, usage.voluntarySwitches, usage.involuntarySwitches,
+                (unsigned long long)usage.outputBytes);
+            writeCsvString(dump, job.command);
+            fputc('\n', dump);
+        }
+    }
+
+    // the value below which the given fraction of the sorted values lie
+    static double getPercentile(const vector<float> &sorted, double fraction) {
+        if (sorted.empty())
+            return 0;
+
+        size_t index = size_t(fraction * double(sorted.size() - 1) + 0.5);
+        return sorted[min(index, sorted.size() - 1)];
+    }
+
+    void RunStatistics::getSummary(Summary &summary) {
+        lock_t lock(mutex);
+
+        sort(wallTimes.begin(), wallTimes.end());
+
+        struct rusage self;
+        getrusage(RUSAGE_SELF, &self);
+
+        summary.nbJobs = nbJobs;
+        summary.nbFailed = nbFailed;
+        summary.elapsed = chrono::duration<double>(clock_t::now() - start).count();
+        summary.throughput = (summary.elapsed > 0) ? double(nbJobs) / summary.elapsed : 0;
+        summary.utilization = (summary.elapsed > 0) ? totalWallTime / (summary.elapsed * nbSlots) : 0;
+        summary.p50 = getPercentile(wallTimes, 0.50);
+        summary.p90 = getPercentile(wallTimes, 0.90);
+        summary.p99 = getPercentile(wallTimes, 0.99);
+        summary.max = wallTimes.empty() ? 0 : wallTimes.back();
+        summary.userTime = totalUserTime;
+        summary.systemTime = totalSystemTime;
+        summary.maxRss = maxRss;
+        summary.inBlocks = totalInBlocks;
+        summary.outBlocks = totalOutBlocks;
+        summary.voluntarySwitches = totalVoluntarySwitches;
+        summary.involuntarySwitches = totalInvoluntarySwitches;
+        summary.spawnTime = nbJobs ? totalSpawnTime / nbJobs : 0;
+        summary.overhead = nbJobs ? (toSeconds(self.ru_utime) + toSeconds(self.ru_stime)) / nbJobs : 0;
+        summary.outputBytes = totalOutputBytes;
+    }
+
+    void RunStatistics::printSummary() {
+        Summary summary;
+        getSummary(summary);
+
+        fprintf(stderr, "Jobs:        %llu (%llu failed) in %.3f s, %.1f jobs/s\n",
+            (unsigned long long)summary.nbJobs, (unsigned long long)summary.nbFailed, summary.elapsed, summary.throughput);
+        fprintf(stderr, "Slots:       %u, %.1f%% busy\n", nbSlots, summary.utilization * 100);
+        fprintf(stderr, "Job time:    p50 %.3f s, p90 %.3f s, p99 %.3f s, max %.3f s\n",
+            summary.p50, summary.p90, summary.p99, summary.max);
+        fprintf(stderr, "Job usage:   %.3f s user, %.3f s system, max RSS %ld KiB\n",
+            summary.userTime, summary.systemTime, summary.maxRss);
+        fprintf(stderr, "Job I/O:     %ld blocks in, %ld blocks out, %llu bytes of output\n",
+            summary.inBlocks, summary.outBlocks, (unsigned long long)summary.outputBytes);
+        fprintf(stderr, "Switches:    %ld voluntary, %ld involuntary\n",
+            summary.voluntarySwitches, summary.involuntarySwitches);
+        fprintf(stderr, "Overhead:    %.1f us spawning and %.1f us of worker CPU per job\n",
+            summary.spawnTime * 1e6, summary.overhead * 1e6);
+    }
+
+}
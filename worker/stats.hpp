@@ -0,0 +1,118 @@
+#ifndef __WORKER_STATS_
+#define __WORKER_STATS_
+
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "api.hpp"
+#include "job.hpp"
+
+struct rusage;
+
+namespace worker {
+
+    // what running a job cost
+    struct JobUsage {
+        // the slot the job ran in, -1 if unknown
+        int slot;
+
+        // in seconds, spawnTime is the part of wallTime spent starting the
+        // processes of the job
+        double wallTime;
+        double spawnTime;
+
+        // the sum over all processes of the job, as reported by wait4()
+        double userTime;
+        double systemTime;
+        long inBlocks;
+        long outBlocks;
+        long voluntarySwitches;
+        long involuntarySwitches;
+
+        // the largest resident set of its processes, in KiB
+        long maxRss;
+
+        uint64_t outputBytes;
+
+        JobUsage();
+
+        // adds the usage of a process of the job
+        void add(const struct rusage &usage);
+    };
+
+    /*
+     * Collects the usage of every finished job, for a summary at the end
+     * of the run and optionally a dump of all jobs.
+     *
+     * The dump is written while the jobs finish, as JSON if the path ends
+     * in ".json" and as CSV otherwise. The JSON dump ends with the summary.
+     */
+    class RunStatistics {
+    public:
+        typedef std::chrono::steady_clock clock_t;
+
+        // path is empty for no dump
+        RunStatistics(uint nbSlots, const std::string &path);
+
+        // completes the dump
+        ~RunStatistics();
+
+        void record(const Job &job, int status, const JobUsage &usage);
+
+        // writes the summary to stderr
+        void printSummary();
+
+    private:
+        // no copying!
+        RunStatistics(const RunStatistics &o);
+
+        typedef std::mutex                  mutex_t;
+        typedef std::unique_lock<mutex_t>   lock_t;
+
+        struct Summary {
+            uint64_t nbJobs;
+            uint64_t nbFailed;
+            double elapsed;
+            double throughput;
+            double utilization;
+            double p50, p90, p99, max;
+            double userTime;
+            double systemTime;
+            long maxRss;
+            long inBlocks, outBlocks;
+            long voluntarySwitches, involuntarySwitches;
+            double spawnTime;
+            // CPU time used by worker itself
+            double overhead;
+            uint64_t outputBytes;
+        };
+
+        void getSummary(Summary &summary);
+
+        const uint nbSlots;
+        const clock_t::time_point start;
+
+        mutex_t mutex;
+
+        FILE *dump;
+        bool json;
+
+        uint64_t nbJobs;
+        uint64_t nbFailed;
+        std::vector<float> wallTimes;
+        double totalWallTime;
+        double totalSpawnTime;
+        double totalUserTime;
+        double totalSystemTime;
+        long maxRss;
+        long totalInBlocks, totalOutBlocks;
+        long totalVoluntarySwitches, totalInvoluntarySwitches;
+        uint64_t totalOutputBytes;
+    };
+
+}
+
+#endif // !defined(__WORKER_STATS_)
@@ -0,0 +1,361 @@
+#include "supervisor.hpp"
+#include "api.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+using namespace std;
+
+namespace worker {
+
+    namespace impl {
+
+        struct Attempt {
+            // owned by the caller of begin(), valid until end()
+            const Job *job;
+
+            Supervisor::clock_t::time_point start;
+
+            // when nextSignal is sent, time_point::max() if never
+            Supervisor::clock_t::time_point deadline;
+            int nextSignal;
+
+            // the group of the current pipeline, -1 between pipelines
+            pid_t group;
+            // the strongest signal sent so far, sent to every new group
+            int signalled;
+
+            bool isCopy;
+            bool timedOut;
+
+            // a copy was requested by findStraggler()
+            bool copied;
+            // the other execution of the same job, if any
+            Attempt *twin;
+            // the other execution finished first
+            bool lost;
+        };
+
+    }
+
+    using impl::Attempt;
+
+    const Supervisor::clock_t::duration Supervisor::KILL_DELAY = chrono::seconds(5);
+    const uint Supervisor::MIN_SAMPLES = 3;
+
+    static const int FORWARDED_SIGNALS[] = { SIGINT, SIGTERM, SIGHUP };
+
+    // the handler can only write the signal to the forwarder, 0 stops it
+    static int signalPipe[2] = { -1, -1 };
+
+    static void onSignal(int sig) {
+        const int savedErrno = errno;
+        const unsigned char c = sig;
+        if (write(signalPipe[1], &c, 1) < 0) {
+            // nothing to be done in a signal handler
+        }
+        errno = savedErrno;
+    }
+
+    static void setSignalHandler(void (*handler)(int)) {
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = handler;
+        action.sa_flags = SA_RESTART;
+        sigemptyset(&action.sa_mask);
+
+        for (size_t i = 0; i < sizeof(FORWARDED_SIGNALS) / sizeof(FORWARDED_SIGNALS[0]); i++) {
+            // like the shell of a background job, a signal that was
+            // ignored when worker started stays ignored
+            struct sigaction previous;
+            sigaction(FORWARDED_SIGNALS[i], NULL, &previous);
+            if (previous.sa_handler != SIG_IGN)
+                sigaction(FORWARDED_SIGNALS[i], &action, NULL);
+        }
+    }
+
+    Supervisor::Supervisor(double timeout, double speculate)
+            : timeout(chrono::duration_cast<clock_t::duration>(chrono::duration<double>(timeout))),
+            speculate(speculate), stopping(false), nbSamples(0), median(clock_t::duration::zero()),
+            nextDeadline(clock_t::time_point::max()) {
+        if (timeout > 0)
+            watchdog = thread(&Supervisor::watch, this);
+
+        if (pipe(signalPipe) < 0)
+            Fatal("Unable to create a pipe: %s", strerror(errno));
+        fcntl(signalPipe[0], F_SETFD, FD_CLOEXEC);
+        fcntl(signalPipe[1], F_SETFD, FD_CLOEXEC);
+
+        forwarder = thread(&Supervisor::forwardSignals, this);
+        setSignalHandler(onSignal);
+    }
+
+    Supervisor::~Supervisor() {
+        {
+            lock_t lock(mutex);
+            stopping = true;
+        }
+        deadlineChanged.notify_all();
+
+        if (watchdog.joinable())
+            watchdog.join();
+
+        setSignalHandler(SIG_DFL);
+        onSignal(0);
+        forwarder.join();
+        close(signalPipe[0]);
+        close(signalPipe[1]);
+
+        for (vector<Attempt *>::iterator a = running.begin(), e = running.end(); a != e; a++)
+            delete *a;
+    }
+
+    Attempt *Supervisor::begin(const Job &job) {
+        Attempt *attempt = new Attempt;
+        attempt->job = &job;
+        attempt->start = clock_t::now();
+        attempt->deadline = (timeout > clock_t::duration::zero()) ? attempt->start + timeout : clock_t::time_point::max();
+        attempt->nextSignal = SIGTERM;
+        attempt->group = -1;
+        attempt->signalled = 0;
+        attempt->isCopy = false;
+        attempt->timedOut = false;
+        attempt->copied = false;
+        attempt->twin = NULL;
+        attempt->lost = false;
+
+        lock_t lock(mutex);
+
+        if (pendingCopies.erase(job.sequence) > 0) {
+            attempt->isCopy = true;
+
+            unordered_map<uint64_t, Attempt *>::iterator original = originals.find(job.sequence);
+            if (original != originals.end() && !original->second->lost) {
+                attempt->twin = original->second;
+                original->second->twin = attempt;
+            } else {
+                // finished before the copy could begin
+                attempt->lost = true;
+                attempt->signalled = SIGKILL;
+            }
+        } else {
+            originals[job.sequence] = attempt;
+        }
+
+        running.push_back(attempt);
+
+        if (attempt->deadline < nextDeadline) {
+            nextDeadline = attempt->deadline;
+            deadlineChanged.notify_one();
+        }
+
+        return attempt;
+    }
+
+    void Supervisor::signal(Attempt &attempt, int sig) {
+        if (attempt.signalled != SIGKILL)
+            attempt.signalled = sig;
+
+        if (attempt.group > 0) {
+            Debug("Sending signal %d to process group %d", sig, attempt.group);
+            kill(-attempt.group, sig);
+        }
+    }
+
+    void Supervisor::setGroup(Attempt *attempt, pid_t group) {
+        lock_t lock(mutex);
+        attempt->group = group;
+
+        // the deadline passed between two pipelines
+        if (attempt->signalled != 0)
+            signal(*attempt, attempt->signalled);
+    }
+
+    void Supervisor::clearGroup(Attempt *attempt) {
+        lock_t lock(mutex);
+        attempt->group = -1;
+    }
+
+    bool Supervisor::end(Attempt *attempt) {
+        const clock_t::time_point now = clock_t::now();
+
+        lock_t lock(mutex);
+
+        running.erase(find(running.begin(), running.end(), attempt));
+
+        unordered_map<uint64_t, Attempt *>::iterator original = originals.find(attempt->job->sequence);
+        if (original != originals.end() && original->second == attempt)
+            originals.erase(original);
+
+        const bool won = !attempt->lost;
+
+        if (attempt->timedOut)
+            Warn("Command \"%s\" timed out", attempt->job->command.c_str());
+
+        if (won && attempt->twin != NULL) {
+            Attempt &twin = *attempt->twin;
+            Debug("Command \"%s\" finished first as %s, killing the %s",
+                attempt->job->command.c_str(), attempt->isCopy ? "copy" : "original", attempt->isCopy ? "original" : "copy");
+
+            twin.twin = NULL;
+            twin.lost = true;
+            twin.deadline = clock_t::time_point::max();
+            signal(twin, SIGKILL);
+        }
+
+        // copies would only skew the median towards the stragglers
+        if (won && !attempt->isCopy && !attempt->timedOut && speculate > 0)
+            durations.push_back(now - attempt->start);
+
+        // whatever the outcome, the threads waiting for a straggler may
+        // have nothing left to wait for
+        jobFinished.notify_all();
+
+        delete attempt;
+        return won;
+    }
+
+    Supervisor::clock_t::duration Supervisor::getMedian() {
+        if (nbSamples != durations.size()) {
+            nbSamples = durations.size();
+
+            vector<clock_t::duration>::iterator middle = durations.begin() + nbSamples / 2;
+            nth_element(durations.begin(), middle, durations.end());
+            median = *middle;
+        }
+
+        return median;
+    }
+
+    bool Supervisor::findStraggler(Job &job, clock_t::time_point &retry, bool &possible) {
+        retry = clock_t::time_point::max();
+        possible = false;
+
+        if (speculate <= 0)
+            return false;
+
+        const bool enoughSamples = durations.size() >= MIN_SAMPLES;
+        const clock_t::duration threshold = enoughSamples
+            ? chrono::duration_cast<clock_t::duration>(getMedian() * speculate)
+            : clock_t::duration::zero();
+        const clock_t::time_point now = clock_t::now();
+
+        Attempt *straggler = NULL;
+        for (vector<Attempt *>::const_iterator a = running.begin(), e = running.end(); a != e; a++) {
+            Attempt &attempt = **a;
+            if (attempt.isCopy || attempt.copied || attempt.lost || attempt.signalled != 0)
+                continue;
+
+            possible = true;
+            if (!enoughSamples)
+                continue;
+
+            const clock_t::time_point at = attempt.start + threshold;
+            if (at > now)
+                retry = min(retry, at);
+            else if (straggler == NULL || attempt.start < straggler->start)
+                straggler = &attempt;
+        }
+
+        if (straggler == NULL)
+            return false;
+
+        Debug("Command \"%s\" is taking more than %g times the median, starting a copy",
+            straggler->job->command.c_str(), speculate);
+
+        straggler->copied = true;
+        pendingCopies.insert(straggler->job->sequence);
+        job = *straggler->job;
+        return true;
+    }
+
+    bool Supervisor::findStraggler(Job &job, clock_t::time_point &retry) {
+        lock_t lock(mutex);
+
+        bool possible;
+        return findStraggler(job, retry, possible);
+    }
+
+    bool Supervisor::waitForStraggler(Job &job) {
+        lock_t lock(mutex);
+
+        while (true) {
+            clock_t::time_point retry;
+            bool possible;
+
+            if (findStraggler(job, retry, possible))
+                return true;
+            if (!possible)
+                return false;
+
+            if (retry == clock_t::time_point::max())
+                jobFinished.wait(lock);
+            else
+                jobFinished.wait_until(lock, retry);
+        }
+    }
+
+    void Supervisor::forwardSignals() {
+        unsigned char sig;
+        while (true) {
+            const ssize_t nbRead = read(signalPipe[0], &sig, 1);
+            if (nbRead < 0 && errno == EINTR)
+                continue;
+            if (nbRead <= 0 || sig == 0)
+                return;
+
+            {
+                lock_t lock(mutex);
+                Debug("Received signal %d, sending it to every running job", sig);
+
+                for (vector<Attempt *>::iterator a = running.begin(), e = running.end(); a != e; a++)
+                    signal(**a, sig);
+            }
+
+            // and die of it the way worker would have without a handler
+            setSignalHandler(SIG_DFL);
+            raise(sig);
+        }
+    }
+
+    void Supervisor::watch() {
+        lock_t lock(mutex);
+
+        while (!stopping) {
+            const clock_t::time_point now = clock_t::now();
+            nextDeadline = clock_t::time_point::max();
+
+            for (vector<Attempt *>::iterator a = running.begin(), e = running.end(); a != e; a++) {
+                Attempt &attempt = **a;
+
+                if (attempt.deadline <= now) {
+                    if (attempt.nextSignal == SIGTERM) {
+                        Debug("Command \"%s\" timed out, terminating it", attempt.job->command.c_str());
+                        attempt.timedOut = true;
+                        attempt.nextSignal = SIGKILL;
+                        attempt.deadline = now + KILL_DELAY;
+                        signal(attempt, SIGTERM);
+
+                        // it can't become a straggler anymore
+                        jobFinished.notify_all();
+                    } else {
+                        attempt.deadline = clock_t::time_point::max();
+                        signal(attempt, SIGKILL);
+                    }
+                }
+
+                nextDeadline = min(nextDeadline, attempt.deadline);
+            }
+
+            if (nextDeadline == clock_t::time_point::max())
+                deadlineChanged.wait(lock);
+            else
+                deadlineChanged.wait_until(lock, nextDeadline);
+        }
+    }
+
+}
@@ -0,0 +1,129 @@
+#ifndef __WORKER_SUPERVISOR_
+#define __WORKER_SUPERVISOR_
+
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <sys/types.h>
+
+#include "api.hpp"
+#include "job.hpp"
+
+namespace worker {
+
+    namespace impl {
+        struct Attempt;
+    }
+
+    /*
+     * Kills jobs that run for too long, and starts a second copy of jobs
+     * that take much longer than the others once there is nothing else to
+     * run, keeping the result of the copy that finishes first. The latter
+     * is only correct for idempotent jobs.
+     *
+     * Every pipeline runs in its own process group, which is signalled as
+     * a whole: SIGTERM when the timeout expires, SIGKILL KILL_DELAY later.
+     * A group is only signalled between setGroup() and clearGroup(), the
+     * latter has to be called before its processes are reaped so the id
+     * can't have been reused.
+     *
+     * Since the groups don't get the signals of the terminal, SIGINT,
+     * SIGTERM and SIGHUP are sent to every group before worker exits
+     * because of them.
+     */
+    class Supervisor {
+    public:
+        typedef std::chrono::steady_clock clock_t;
+        typedef impl::Attempt attempt_t;
+
+        static const clock_t::duration KILL_DELAY;
+
+        // the number of jobs that have to finish before the median is
+        // considered meaningful
+        static const uint MIN_SAMPLES;
+
+        // jobs are killed after timeout seconds, and copied after running
+        // speculate times longer than the median job, 0 disables either
+        Supervisor(double timeout, double speculate);
+        ~Supervisor();
+
+        // an execution of job starts, a copy if job was returned by one of
+        // the straggler functions
+        attempt_t *begin(const Job &job);
+
+        // the processes of the attempt's current pipeline are in group
+        void setGroup(attempt_t *attempt, pid_t group);
+
+        // the processes of the group have exited but haven't been reaped
+        void clearGroup(attempt_t *attempt);
+
+        // the attempt has finished and is freed, returns false if its
+        // result has to be discarded because another copy finished first
+        bool end(attempt_t *attempt);
+
+        // used by the EventLoop: returns a job to run a copy of, or false
+        // and the time at which to look again
+        bool findStraggler(Job &job, clock_t::time_point &retry);
+
+        // used by the ThreadPool: waits for a job to run a copy of, false
+        // once no running job can become a straggler anymore
+        bool waitForStraggler(Job &job);
+
+        inline bool isSpeculating() const {
+            return speculate > 0;
+        }
+
+    private:
+        // no copying!
+        Supervisor(const Supervisor &o);
+
+        typedef std::mutex                  mutex_t;
+        typedef std::unique_lock<mutex_t>   lock_t;
+
+        // kills the attempts whose deadline has passed
+        void watch();
+        // forwards the signals worker receives to every group, then exits
+        void forwardSignals();
+
+        // must be called with the mutex locked
+        void signal(attempt_t &attempt, int sig);
+        bool findStraggler(Job &job, clock_t::time_point &retry, bool &possible);
+        clock_t::duration getMedian();
+
+        const clock_t::duration timeout;
+        const double speculate;
+
+        mutex_t mutex;
+        // signalled when the first deadline may have changed
+        std::condition_variable deadlineChanged;
+        // signalled when a job finishes
+        std::condition_variable jobFinished;
+        bool stopping;
+
+        std::vector<attempt_t *> running;
+
+        // the first execution of every running job, by sequence
+        std::unordered_map<uint64_t, attempt_t *> originals;
+        // the jobs returned by findStraggler() whose copy hasn't begun yet
+        std::unordered_set<uint64_t> pendingCopies;
+
+        // the durations of the finished jobs, the median is recomputed
+        // when jobs have finished since the last time
+        std::vector<clock_t::duration> durations;
+        size_t nbSamples;
+        clock_t::duration median;
+
+        // when the watchdog wakes up next
+        clock_t::time_point nextDeadline;
+
+        std::thread watchdog;
+        std::thread forwarder;
+    };
+
+}
+
+#endif // !defined(__WORKER_SUPERVISOR_)
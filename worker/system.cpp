@@ -1,20 +1,37 @@
 #include <cstdlib>
+#include <cstring>
 #include <errno.h>
+#include <fcntl.h>
 
 #include "api.hpp"
 #include "system.hpp"
+#include "cache.hpp"
+#include "journal.hpp"
+#include "supervisor.hpp"
+#include "history.hpp"
+#include "stats.hpp"
 
-#if !defined(WORKER_IS_WINDOWS)
+#if defined(WORKER_IS_OSX) || defined(WORKER_IS_OPENBSD)
 #include <sys/sysctl.h>
 #endif
 
-#if defined(WORKER_IS_LINUX) || defined(WORKER_IS_OPENBSD)
+#if !defined(WORKER_IS_WINDOWS)
 #include <unistd.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
 #endif
 
 #include <boost/iostreams/device/file_descriptor.hpp>
 #include <boost/iostreams/stream.hpp>
-#include <boost/scoped_array.hpp>
+
+#include <vector>
+#include <algorithm>
+#include <chrono>
+
+#if !defined(WORKER_IS_WINDOWS)
+extern char **environ;
+#endif
 
 using namespace std;
 namespace io = boost::iostreams;
@@ -54,65 +71,367 @@ namespace worker {
     #endif
     }
 
-    void realexec(const string &command) {
-        boost::scoped_array<char> cmd_writable(new char[command.size() + 1]);
-        copy(command.begin(), command.end(), cmd_writable.get());
-        cmd_writable[command.size()] = '\0';
+    size_t System::getMaxArgumentsLength() {
+        long argMax = sysconf(_SC_ARG_MAX);
+        if (argMax <= 0)
+            argMax = 128 * 1024;
 
-        char arg0[] = "sh";
-        char arg1[] = "-c";
+        // the environment is passed on to every job
+        size_t used = 0;
+        for (char **env = environ; *env != NULL; env++)
+            used += strlen(*env) + 1 + sizeof(char *);
 
-        char * args[4];
-        args[0] = arg0;
-        args[1] = arg1;
-        args[2] = cmd_writable.get();
-        args[3] = NULL;
+        // some headroom for the program name, the terminating NULL
+        // pointers, ... as recommended by POSIX
+        used += 2048;
 
-        execv("/bin/sh", args);
+        if (size_t(argMax) <= used + 4096)
+            return 4096;
+
+        return size_t(argMax) - used;
     }
 
-    int System::exec(const string &command, bool quiet) {
-        Debug("Executing %s", command.c_str());
+    size_t System::getMaxArgumentLength() {
+    #if defined(WORKER_IS_LINUX)
+        // MAX_ARG_STRLEN, the limit on a single argument or variable
+        const size_t maxLength = 32 * size_t(sysconf(_SC_PAGESIZE));
+        return min(maxLength, getMaxArgumentsLength());
+    #else
+        return getMaxArgumentsLength();
+    #endif
+    }
+
+    System::SpawnMethod System::spawnMethod = System::SPAWN_POSIX;
+    System::OutputMode System::outputMode = System::OUTPUT_LINES;
+    OrderedOutput *System::orderedOutput = NULL;
+    AdmissionControl *System::admissionControl = NULL;
+    const SlotAffinity *System::slotAffinity = NULL;
+    ResultCache *System::resultCache = NULL;
+    Journal *System::journal = NULL;
+    Supervisor *System::supervisor = NULL;
+    RuntimeHistory *System::runtimeHistory = NULL;
+    RunStatistics *System::statistics = NULL;
+
+    void System::setSpawnMethod(SpawnMethod method) {
+        Debug("Using spawn method %s", getSpawnMethodName(method));
+        spawnMethod = method;
+    }
+
+    System::SpawnMethod System::getSpawnMethod() {
+        return spawnMethod;
+    }
+
+    bool System::parseSpawnMethod(const string &name, SpawnMethod &method) {
+        if (name == "fork") {
+            method = SPAWN_FORK;
+        } else if (name == "vfork") {
+            method = SPAWN_VFORK;
+        } else if (name == "posix_spawn") {
+            method = SPAWN_POSIX;
+        } else {
+            return false;
+        }
+
+        return true;
+    }
+
+    const char *System::getSpawnMethodName(SpawnMethod method) {
+        switch (method) {
+        case SPAWN_FORK:  return "fork";
+        case SPAWN_VFORK: return "vfork";
+        case SPAWN_POSIX: return "posix_spawn";
+        default:          return "unknown";
+        }
+    }
+
+    typedef vector<SpawnAction> spawn_actions_t;
+    typedef spawn_actions_t::const_iterator spawn_actions_citer_t;
+
+    void System::setOutputMode(OutputMode mode) {
+        outputMode = mode;
+    }
+
+    System::OutputMode System::getOutputMode() {
+        return outputMode;
+    }
+
+    bool System::isOutputBuffered() {
+        return outputMode == OUTPUT_GROUPED || outputMode == OUTPUT_ORDERED;
+    }
+
+    void System::setOrderedOutput(OrderedOutput *output) {
+        orderedOutput = output;
+    }
+
+    OrderedOutput *System::getOrderedOutput() {
+        return orderedOutput;
+    }
+
+    void System::setAdmissionControl(AdmissionControl *admission) {
+        admissionControl = admission;
+    }
+
+    AdmissionControl *System::getAdmissionControl() {
+        return admissionControl;
+    }
+
+    void System::setSlotAffinity(const SlotAffinity *affinity) {
+        slotAffinity = affinity;
+    }
+
+    const SlotAffinity *System::getSlotAffinity() {
+        return slotAffinity;
+    }
+
+    void System::writeOutput(const Job &job, OutputBuffer &buffer) {
+        if (outputMode == OUTPUT_ORDERED) {
+            orderedOutput->complete(job.sequence, buffer);
+            buffer.clear();
+        } else {
+            buffer.flush();
+        }
+    }
+
+    void System::startJob(const Job &job) {
+        if (journal != NULL)
+            journal->start(job);
+        if (runtimeHistory != NULL)
+            runtimeHistory->start(job);
+    }
+
+    void System::finishJob(const Job &job, int status, OutputBuffer *buffer, const JobUsage &usage) {
+        if (statistics != NULL)
+            statistics->record(job, status, usage);
+        if (journal != NULL)
+            journal->finish(job, status);
+        if (runtimeHistory != NULL)
+            runtimeHistory->finish(job, status);
+
+        if (resultCache != NULL && status == 0)
+            resultCache->store(job, buffer);
+
+        if (buffer != NULL)
+            writeOutput(job, *buffer);
+    }
+
+    void System::setResultCache(ResultCache *cache) {
+        resultCache = cache;
+    }
+
+    ResultCache *System::getResultCache() {
+        return resultCache;
+    }
+
+    void System::setJournal(Journal *journal) {
+        System::journal = journal;
+    }
+
+    Journal *System::getJournal() {
+        return journal;
+    }
+
+    void System::setSupervisor(Supervisor *supervisor) {
+        System::supervisor = supervisor;
+    }
+
+    Supervisor *System::getSupervisor() {
+        return supervisor;
+    }
+
+    void System::setRuntimeHistory(RuntimeHistory *history) {
+        runtimeHistory = history;
+    }
+
+    RuntimeHistory *System::getRuntimeHistory() {
+        return runtimeHistory;
+    }
+
+    void System::setStatistics(RunStatistics *statistics) {
+        System::statistics = statistics;
+    }
+
+    RunStatistics *System::getStatistics() {
+        return statistics;
+    }
+
+    bool System::parseOutputMode(const string &name, OutputMode &mode) {
+        if (name == "lines") {
+            mode = OUTPUT_LINES;
+        } else if (name == "passthrough") {
+            mode = OUTPUT_PASSTHROUGH;
+        } else if (name == "grouped") {
+            mode = OUTPUT_GROUPED;
+        } else {
+            return false;
+        }
+
+        return true;
+    }
+
+    int System::getNullFd() {
+        static int nullFd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+
+        if (nullFd < 0)
+            Fatal("Unable to open /dev/null: %s", strerror(errno));
+
+        return nullFd;
+    }
+
+    static thread_local int currentSlot = -1;
+
+    void System::setSlot(int slot) {
+        currentSlot = slot;
+    }
 
-        int pipe_fd[2];
-        pipe(pipe_fd);
-        Debug("Pipe created, reading from %d and writing to %d", pipe_fd[0], pipe_fd[1]);
+    int System::getSlot() {
+        return currentSlot;
+    }
 
-        pid_t exec_pid;
+    // the environment for processes started by the calling thread, with
+    // WORKER_SLOT set if the thread runs jobs for a slot
+    static char * const *getEnvironment() {
+        static thread_local int environmentSlot = -1;
+        static thread_local vector<char *> environment;
+        static thread_local string slotVariable;
 
-        if ((exec_pid = fork()) == 0) {
-            // close reading end of the pipe
-            close(pipe_fd[0]);
+        if (currentSlot < 0)
+            return environ;
 
-            // replace stdout and stderr
-            dup2(pipe_fd[1], 1);
-            dup2(pipe_fd[1], 2);
+        if (environmentSlot != currentSlot || environment.empty()) {
+            environmentSlot = currentSlot;
+            slotVariable = "WORKER_SLOT=" + itoa(currentSlot);
 
-            // close pipe
-            close(pipe_fd[1]);
+            environment.clear();
+            for (char **env = environ; *env != NULL; env++) {
+                if (strncmp(*env, "WORKER_SLOT=", 12) != 0)
+                    environment.push_back(*env);
+            }
+            environment.push_back(const_cast<char *>(slotVariable.c_str()));
+            environment.push_back(NULL);
+        }
 
-            // close stdin
-            close(0);
+        return &environment[0];
+    }
 
-            realexec(command);
+    static pid_t forkspawn(const char *file, char * const argv[], char * const envp[], const spawn_actions_t &actions, bool useVfork) {
+        pid_t pid = useVfork ? vfork() : fork();
+
+        if (pid == 0) {
+            // only async-signal-safe calls from here on, we might be
+            // sharing our address space with the parent
+            for (spawn_actions_citer_t a = actions.begin(), e = actions.end(); a != e; a++) {
+                switch (a->type) {
+                case SpawnAction::ACTION_DUP2:
+                    if (a->source == a->fd)
+                        fcntl(a->fd, F_SETFD, 0);
+                    else if (dup2(a->source, a->fd) < 0)
+                        _exit(127);
+                    break;
+                case SpawnAction::ACTION_CLOSE:
+                    close(a->fd);
+                    break;
+                case SpawnAction::ACTION_SETPGID:
+                    setpgid(0, a->source);
+                    break;
+                }
+            }
 
-            exit(errno);
+        #if defined(WORKER_IS_LINUX)
+            execvpe(file, argv, envp);
+        #else
+            execvp(file, argv);
+        #endif
+
+            _exit(127);
         }
 
-        if (exec_pid < 0) {
-            Fatal("Failed to fork, aborting...");
+        return pid;
+    }
+
+    static pid_t posixspawn(const char *file, char * const argv[], char * const envp[], const spawn_actions_t &actions) {
+        posix_spawn_file_actions_t fileActions;
+        posix_spawn_file_actions_init(&fileActions);
+
+        posix_spawnattr_t attributes;
+        posix_spawnattr_init(&attributes);
+
+        for (spawn_actions_citer_t a = actions.begin(), e = actions.end(); a != e; a++) {
+            switch (a->type) {
+            case SpawnAction::ACTION_DUP2:
+                posix_spawn_file_actions_adddup2(&fileActions, a->source, a->fd);
+                break;
+            case SpawnAction::ACTION_CLOSE:
+                posix_spawn_file_actions_addclose(&fileActions, a->fd);
+                break;
+            case SpawnAction::ACTION_SETPGID:
+                posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETPGROUP);
+                posix_spawnattr_setpgroup(&attributes, a->source);
+                break;
+            }
+        }
+
+        pid_t pid;
+        int error = posix_spawnp(&pid, file, &fileActions, &attributes, argv, envp);
+
+        posix_spawn_file_actions_destroy(&fileActions);
+        posix_spawnattr_destroy(&attributes);
+
+        if (error != 0) {
+            errno = error;
+            return -1;
+        }
+
+        return pid;
+    }
+
+    bool System::createPipe(int fds[2]) {
+    #if defined(WORKER_IS_LINUX)
+        return pipe2(fds, O_CLOEXEC) == 0;
+    #else
+        if (pipe(fds) != 0)
+            return false;
+
+        fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+        fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+        return true;
+    #endif
+    }
+
+    pid_t System::spawn(const char *file, char * const argv[], const spawn_actions_t &actions) {
+        char * const *envp = getEnvironment();
+
+        switch (spawnMethod) {
+        case SPAWN_FORK:
+            return forkspawn(file, argv, envp, actions, false);
+        case SPAWN_VFORK:
+            return forkspawn(file, argv, envp, actions, true);
+        case SPAWN_POSIX:
+        default:
+            return posixspawn(file, argv, envp, actions);
         }
+    }
 
-        // close writing end
-        close(pipe_fd[1]);
+    pid_t System::spawn(const char *file, char * const argv[], int outputFd) {
+        spawn_actions_t actions;
+        actions.reserve(3);
 
-        Debug("Forked with pid %d, start listening to output", exec_pid);
+        // replace stdout and stderr, close stdin
+        actions.push_back(SpawnAction(SpawnAction::ACTION_DUP2, 1, outputFd));
+        actions.push_back(SpawnAction(SpawnAction::ACTION_DUP2, 2, outputFd));
+        actions.push_back(SpawnAction(SpawnAction::ACTION_CLOSE, 0));
 
-        io::stream<io::file_descriptor_source> cmd_output(pipe_fd[0], io::never_close_handle);
+        return spawn(file, argv, actions);
+    }
+
+    // returns the number of bytes read
+    static uint64_t readOutput(int fd, bool quiet) {
+        io::stream<io::file_descriptor_source> cmd_output(fd, io::never_close_handle);
         string line;
+        uint64_t nbBytes = 0;
 
         while (cmd_output.good()) {
             getline(cmd_output, line);
+            nbBytes += line.size() + (cmd_output.eof() ? 0 : 1);
 
             if (!quiet && (!cmd_output.eof() || line.size())) {
                 Output(line.c_str());
@@ -124,12 +443,252 @@ namespace worker {
             Error("Error occured when trying to read process output");
         }
 
-        close(pipe_fd[0]);
+        return nbBytes;
+    }
+
+    Job::pipeline_t System::getShellPipeline(const string &command) {
+        Job::pipeline_t pipeline(1);
+
+        pipeline[0].words.reserve(3);
+        pipeline[0].words.push_back("/bin/sh");
+        pipeline[0].words.push_back("-c");
+        pipeline[0].words.push_back(command);
+
+        return pipeline;
+    }
+
+    void System::startPipeline(const Job::pipeline_t &pipeline, int outputFd, RunningPipeline &running) {
+        const size_t nbStages = pipeline.size();
+        running.pids.assign(nbStages, -1);
+        running.statuses.assign(nbStages, 0);
+
+        const chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+        // the first program started leads the group of the others
+        const bool grouped = (supervisor != NULL);
+        running.group = -1;
+
+        // read end of the pipe connected to the previous stage
+        int input = -1;
+
+        for (size_t i = 0; i < nbStages; i++) {
+            const Job::stage_t &stage = pipeline[i];
+            const bool last = (i + 1 == nbStages);
+
+            int next_fd[2] = { -1, -1 };
+            if (!last && !createPipe(next_fd)) {
+                Fatal("Failed to create pipe, aborting...");
+            }
+
+            spawn_actions_t actions;
+            actions.reserve(4 + stage.redirections.size());
+
+            if (grouped)
+                actions.push_back(SpawnAction(SpawnAction::ACTION_SETPGID, -1, max(running.group, 0)));
+
+            if (input >= 0)
+                actions.push_back(SpawnAction(SpawnAction::ACTION_DUP2, 0, input));
+            else
+                actions.push_back(SpawnAction(SpawnAction::ACTION_CLOSE, 0));
+            actions.push_back(SpawnAction(SpawnAction::ACTION_DUP2, 1, last ? outputFd : next_fd[1]));
+            actions.push_back(SpawnAction(SpawnAction::ACTION_DUP2, 2, outputFd));
+
+            // the redirections are opened here rather than in the child,
+            // so failures can be reported properly
+            vector<int> redirection_fds;
+            bool redirectionFailed = false;
+
+            typedef vector<Job::stage_t::redirection_t>::const_iterator redirection_citer_t;
+            for (redirection_citer_t r = stage.redirections.begin(), e = stage.redirections.end(); r != e; r++) {
+                int fd;
+                switch (r->type) {
+                case REDIRECT_IN:
+                    fd = open(r->target.c_str(), O_RDONLY|O_CLOEXEC);
+                    break;
+                case REDIRECT_APPEND:
+                    fd = open(r->target.c_str(), O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC, 0666);
+                    break;
+                case REDIRECT_OUT:
+                default:
+                    fd = open(r->target.c_str(), O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0666);
+                    break;
+                }
+
+                if (fd < 0) {
+                    Warn("%s: %s", r->target.c_str(), strerror(errno));
+                    redirectionFailed = true;
+                    break;
+                }
+
+                redirection_fds.push_back(fd);
+                actions.push_back(SpawnAction(SpawnAction::ACTION_DUP2, (r->type == REDIRECT_IN) ? 0 : 1, fd));
+            }
+
+            vector<char *> argv;
+            argv.reserve(stage.words.size() + 1);
+            for (vector<string>::const_iterator w = stage.words.begin(), e = stage.words.end(); w != e; w++)
+                argv.push_back(const_cast<char *>(w->c_str()));
+            argv.push_back(NULL);
+
+            if (redirectionFailed) {
+                running.statuses[i] = 1 << 8;
+            } else if ((running.pids[i] = spawn(argv[0], &argv[0], actions)) < 0) {
+                Warn("Failed to execute \"%s\": %s", argv[0], strerror(errno));
+                // mimic the shell's "command not found"
+                running.statuses[i] = 127 << 8;
+            } else {
+                Debug("Spawned \"%s\" with pid %d", argv[0], running.pids[i]);
+
+                if (grouped) {
+                    // the child may not have done it yet after fork()
+                    setpgid(running.pids[i], max(running.group, 0));
+                    if (running.group < 0)
+                        running.group = running.pids[i];
+                }
+            }
 
-        Debug("Waiting for pid to die");
+            for (vector<int>::const_iterator fd = redirection_fds.begin(), e = redirection_fds.end(); fd != e; fd++)
+                close(*fd);
+
+            if (input >= 0)
+                close(input);
+            if (!last)
+                close(next_fd[1]);
+            input = next_fd[0];
+        }
+
+        running.spawnTime = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    }
+
+    static void readOutput(int fd, OutputBuffer &buffer) {
+        while (true) {
+            size_t available;
+            char *target = buffer.reserve(available);
+
+            ssize_t nbRead = read(fd, target, available);
+            if (nbRead > 0) {
+                buffer.commit(nbRead);
+            } else if (nbRead == 0) {
+                Debug("Process output closed.");
+                return;
+            } else if (errno != EINTR) {
+                Error("Error occured when trying to read process output");
+                return;
+            }
+        }
+    }
+
+    /*
+     * Runs a single pipeline, returns the exit status of its last program.
+     *
+     * The output is discarded if quiet is set, otherwise it is handled
+     * according to the output mode. If buffer isn't NULL the output is
+     * appended to it.
+     */
+    static int execPipeline(const Job::pipeline_t &pipeline, bool quiet, OutputBuffer *buffer, Supervisor::attempt_t *attempt, JobUsage &usage) {
+        Supervisor *supervisor = System::getSupervisor();
+        System::RunningPipeline running;
+
+        if (quiet || System::getOutputMode() == System::OUTPUT_PASSTHROUGH) {
+            // nothing to read, the processes write to their final destination
+            System::startPipeline(pipeline, quiet ? System::getNullFd() : 1, running);
+            if (attempt != NULL)
+                supervisor->setGroup(attempt, running.group);
+        } else {
+            int output_fd[2];
+            if (!System::createPipe(output_fd)) {
+                Fatal("Failed to create pipe, aborting...");
+            }
+            Debug("Pipe created, reading from %d and writing to %d", output_fd[0], output_fd[1]);
+
+            System::startPipeline(pipeline, output_fd[1], running);
+            if (attempt != NULL)
+                supervisor->setGroup(attempt, running.group);
+
+            // close writing end
+            close(output_fd[1]);
+
+            if (buffer != NULL) {
+                size_t before = buffer->size();
+                readOutput(output_fd[0], *buffer);
+                usage.outputBytes += buffer->size() - before;
+            } else {
+                usage.outputBytes += readOutput(output_fd[0], quiet);
+            }
+            close(output_fd[0]);
+        }
+
+        usage.spawnTime += running.spawnTime;
+
+        Debug("Waiting for pipeline to die");
+
+        if (attempt != NULL) {
+            // the group can't be signalled anymore once it's reaped
+            for (size_t i = 0, e = running.pids.size(); i < e; i++) {
+                siginfo_t info;
+                while (running.pids[i] >= 0 && waitid(P_PID, running.pids[i], &info, WEXITED | WNOWAIT) < 0 && errno == EINTR)
+                    ;
+            }
+            supervisor->clearGroup(attempt);
+        }
+
+        for (size_t i = 0, e = running.pids.size(); i < e; i++) {
+            struct rusage rusage;
+            if (running.pids[i] >= 0 && wait4(running.pids[i], &running.statuses[i], 0, &rusage) >= 0)
+                usage.add(rusage);
+        }
+
+        return running.statuses.back();
+    }
+
+    int System::exec(const string &command, bool quiet) {
+        Job job;
+        job.sequence = 0;
+        job.mode = EXEC_SHELL;
+        job.command = command;
+        job.cost = 0;
+
+        return exec(job, quiet);
+    }
+
+    int System::exec(const Job &job, bool quiet) {
+        Debug("Executing %s%s", job.command.c_str(), (job.mode == EXEC_SHELL) ? "" : " without shell");
+
+        int result = 0;
+
+        // reused for all jobs executed by this thread
+        static thread_local OutputBuffer groupedOutput;
+        OutputBuffer *buffer = (isOutputBuffered() && !quiet) ? &groupedOutput : NULL;
+
+        JobUsage usage;
+        usage.slot = currentSlot;
+        const chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+        Supervisor::attempt_t *attempt = (supervisor != NULL) ? supervisor->begin(job) : NULL;
+        startJob(job);
+
+        if (job.mode == EXEC_SHELL) {
+            result = execPipeline(getShellPipeline(job.command), quiet, buffer, attempt, usage);
+        } else {
+            typedef vector<Job::pipeline_t>::const_iterator pipeline_citer_t;
+            for (pipeline_citer_t p = job.script.pipelines.begin(), e = job.script.pipelines.end(); p != e; p++) {
+                result = execPipeline(*p, quiet, buffer, attempt, usage);
+
+                // &&
+                if (result != 0)
+                    break;
+            }
+        }
+
+        if (attempt != NULL && !supervisor->end(attempt)) {
+            Debug("Discarding the result of \"%s\", another copy finished first", job.command.c_str());
+            if (buffer != NULL)
+                buffer->clear();
+            return 0;
+        }
 
-        int result;
-        waitpid(exec_pid, &result, 0);
+        usage.wallTime = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        finishJob(job, result, buffer, usage);
 
         if (result == 0) {
             Debug("Process exited with success status");
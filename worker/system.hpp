@@ -2,19 +2,190 @@
 #define __WORKER_SYSTEM_
 
 #include <string>
+#include <vector>
+#include <sys/types.h>
+
+#include "api.hpp"
+#include "job.hpp"
+#include "output.hpp"
+#include "pressure.hpp"
 
 namespace worker {
 
+    class SlotAffinity;
+    class ResultCache;
+    class Journal;
+    class Supervisor;
+    class RuntimeHistory;
+    class RunStatistics;
+    struct JobUsage;
+
+    // an operation performed in the child before exec
+    struct SpawnAction {
+        typedef enum { ACTION_DUP2, ACTION_CLOSE, ACTION_SETPGID } Type;
+
+        Type type;
+        int fd;
+
+        // ACTION_DUP2: the descriptor to duplicate onto fd
+        // ACTION_SETPGID: the process group to join, 0 for a new one
+        int source;
+
+        SpawnAction(Type type, int fd, int source = -1)
+            : type(type), fd(fd), source(source)
+        {}
+    };
+
     struct System {
 
+        /*
+         * The way child processes are created:
+         *  - SPAWN_FORK:  fork() + execv(), copies the page tables of the
+         *                 entire worker process for every job
+         *  - SPAWN_VFORK: vfork() + execv(), the child borrows our address
+         *                 space until it calls execv()
+         *  - SPAWN_POSIX: posix_spawn(), which glibc implements using
+         *                 clone(CLONE_VM|CLONE_VFORK)
+         */
+        typedef enum { SPAWN_FORK, SPAWN_VFORK, SPAWN_POSIX } SpawnMethod;
+
+        /*
+         * What happens with the output of a job:
+         *  - OUTPUT_LINES:       read line by line and written as soon as a
+         *                        line is complete
+         *  - OUTPUT_PASSTHROUGH: the job writes to our stdout directly,
+         *                        output of concurrent jobs can interleave
+         *  - OUTPUT_GROUPED:     collected and written in one go when the
+         *                        job finishes
+         *  - OUTPUT_ORDERED:     collected and written in the order the jobs
+         *                        were generated, see OrderedOutput
+         */
+        typedef enum { OUTPUT_LINES, OUTPUT_PASSTHROUGH, OUTPUT_GROUPED, OUTPUT_ORDERED } OutputMode;
+
+        // the processes of a pipeline that has been started, the status of
+        // processes that couldn't be started is already filled in
+        struct RunningPipeline {
+            std::vector<pid_t> pids;
+            std::vector<int> statuses;
+
+            // the process group of all programs, -1 if they're in ours
+            pid_t group;
+
+            // seconds spent starting the programs
+            double spawnTime;
+        };
+
         static uint getNbCores();
+
+        // the space left for the arguments of a job after the environment,
+        // based on ARG_MAX
+        static size_t getMaxArgumentsLength();
+        // the maximum length of a single argument
+        static size_t getMaxArgumentLength();
+
+        // returns the exit status, or 0 if another copy of the job started
+        // by the Supervisor finished first
         static  int exec(const std::string &command, bool quiet);
+        static  int exec(const Job &job, bool quiet);
+
+        // starts every program in the pipeline, with their stderr and the
+        // stdout of the last program redirected to outputFd. The programs
+        // get their own process group if a Supervisor is set.
+        static void startPipeline(const Job::pipeline_t &pipeline, int outputFd, RunningPipeline &running);
+
+        // the pipeline executing command using /bin/sh
+        static Job::pipeline_t getShellPipeline(const std::string &command);
+
+        // creates a pipe that isn't inherited by spawned processes
+        static bool createPipe(int fds[2]);
+
+        // spawns file with the given arguments, stdout and stderr are
+        // redirected to outputFd and stdin is closed
+        static pid_t spawn(const char *file, char * const argv[], int outputFd);
+
+        // spawns file (searched in $PATH) after performing the given actions
+        static pid_t spawn(const char *file, char * const argv[], const std::vector<SpawnAction> &actions);
+
+        static void setSpawnMethod(SpawnMethod method);
+        static SpawnMethod getSpawnMethod();
+
+        static bool parseSpawnMethod(const std::string &name, SpawnMethod &method);
+        static const char *getSpawnMethodName(SpawnMethod method);
+
+        static void setOutputMode(OutputMode mode);
+        static OutputMode getOutputMode();
+
+        // whether the output of a job is collected in an OutputBuffer
+        static bool isOutputBuffered();
+
+        // used with OUTPUT_ORDERED
+        static void setOrderedOutput(OrderedOutput *output);
+        static OrderedOutput *getOrderedOutput();
+
+        // the slot (0 up to the number of threads) the calling thread runs
+        // jobs for, passed to the jobs as WORKER_SLOT. -1 if none.
+        static void setSlot(int slot);
+        static int getSlot();
+
+        // pins the jobs of every slot to some CPUs, NULL if disabled
+        static void setSlotAffinity(const SlotAffinity *affinity);
+        static const SlotAffinity *getSlotAffinity();
+
+        // holds back new jobs under pressure, NULL if disabled
+        static void setAdmissionControl(AdmissionControl *admission);
+        static AdmissionControl *getAdmissionControl();
+
+        // writes the output of a finished job collected in buffer
+        static void writeOutput(const Job &job, OutputBuffer &buffer);
+
+        // a job is about to be executed
+        static void startJob(const Job &job);
+
+        // a job has finished with the given status, writes its output if
+        // it was collected in buffer and caches its result
+        static void finishJob(const Job &job, int status, OutputBuffer *buffer, const JobUsage &usage);
+
+        // remembers successful jobs, NULL if disabled
+        static void setResultCache(ResultCache *cache);
+        static ResultCache *getResultCache();
+
+        // records the jobs started and finished, NULL if disabled
+        static void setJournal(Journal *journal);
+        static Journal *getJournal();
+
+        // kills or copies jobs that take too long, NULL if disabled
+        static void setSupervisor(Supervisor *supervisor);
+        static Supervisor *getSupervisor();
+
+        // records how long jobs take, NULL if disabled
+        static void setRuntimeHistory(RuntimeHistory *history);
+        static RuntimeHistory *getRuntimeHistory();
+
+        // collects the usage of all jobs, NULL if disabled
+        static void setStatistics(RunStatistics *statistics);
+        static RunStatistics *getStatistics();
+
+        static bool parseOutputMode(const std::string &name, OutputMode &mode);
+
+        // a descriptor for /dev/null, used as output for quiet jobs
+        static int getNullFd();
 
     private:
         System();
         ~System();
+
+        static SpawnMethod spawnMethod;
+        static OutputMode outputMode;
+        static OrderedOutput *orderedOutput;
+        static AdmissionControl *admissionControl;
+        static const SlotAffinity *slotAffinity;
+        static ResultCache *resultCache;
+        static Journal *journal;
+        static Supervisor *supervisor;
+        static RuntimeHistory *runtimeHistory;
+        static RunStatistics *statistics;
     };
 
 }
 
-#endif // !defined(__WORKER_SYSTEM_)
\ No newline at end of file
+#endif // !defined(__WORKER_SYSTEM_)
@@ -1,6 +1,10 @@
 #include "threadpool.hpp"
 #include "system.hpp"
 #include "api.hpp"
+#include "affinity.hpp"
+#include "supervisor.hpp"
+#include "command.hpp"
+#include "cache.hpp"
 
 #include <sstream>
 #include <functional>
@@ -9,12 +13,40 @@ using namespace std;
 
 namespace worker {
 
-    ThreadPool::ThreadPool(uint size, bool quiet) : quiet(quiet),
-            threads(new thread[size]), size(size), nbThreadsAlive(size),
-            joining(false), terminating(false), joined(false) {
-        Debug("Creating threadpool with %u threads", size);
+    // number of times a thread polls the queue before going to sleep
+    static const uint SPIN_COUNT = 16;
+
+    static void executeJob(const Job &job, bool quiet) {
+        const string &command = job.command;
+
+        Debug("running command \"%s\"", command.c_str());
+        int retval = System::exec(job, quiet);
+        if (retval != 0)
+            Warn("command \"%s\" exited with code %d", command.c_str(), retval);
+        else
+            Debug("Command \"%s\" executed successfully", command.c_str());
+    }
+
+    ThreadPool::ThreadPool(uint size, bool quiet, uint capacity, bool prioritized)
+            : handler(bind(executeJob, placeholders::_1, quiet)),
+            threads(new thread[size]), size(size), queue(max(capacity, 1u), prioritized),
+            joining(false), terminating(false), nbParkedThreads(0), nbParkedProducers(0),
+            joined(false) {
+        start();
+    }
+
+    ThreadPool::ThreadPool(uint size, uint capacity, const job_handler_t &handler, bool prioritized)
+            : handler(handler),
+            threads(new thread[size]), size(size), queue(max(capacity, 1u), prioritized),
+            joining(false), terminating(false), nbParkedThreads(0), nbParkedProducers(0),
+            joined(false) {
+        start();
+    }
+
+    void ThreadPool::start() {
+        Debug("Creating threadpool with %u threads and a queue of %u jobs", size, uint(queue.capacity()));
         for (uint i = 0; i < size; i++) {
-            threads[i] = thread(impl::execute, ref(*this), ref(threads[i]));
+            threads[i] = thread(impl::execute, ref(*this), i);
         }
         Debug("ThreadPool initialised");
     }
@@ -24,10 +56,6 @@ namespace worker {
         if (!isJoined())
             terminate();
 
-        for (uint i = 0; i < size; i++)
-            if (threads[i].joinable())
-                threads[i].detach();
-
         delete[] threads;
         Debug("ThreadPool destructed");
     }
@@ -35,79 +63,35 @@ namespace worker {
     // joining stuff
 
     void ThreadPool::terminate() {
-        lock_t lock(joinMutex);
         Debug("ThreadPool::terminate() called");
+        stop(true);
+    }
 
-        if (joined)
-            return;
-
-        if (!terminating) {
-            terminating = true;
-            thread_nop.notify_all();
-        }
-
-        bool threadsAlreadyEnded = false;
-        {
-            lock_t lockNbTA(nbTAMutex);
-            if (nbThreadsAlive == 0)
-                threadsAlreadyEnded = true;
-        }
-
-        if (!joining && !threadsAlreadyEnded) {
-            Debug("Notifying threads that the ThreadPool is joining");
-            joining = true;
-            thread_nop.notify_all();
-        }
+    void ThreadPool::join() {
+        Debug("ThreadPool::join() called");
+        stop(false);
+    }
 
-        if (!threadsAlreadyEnded) {
-            Debug("Waiting until join completes");
-            joinCV.wait(lock, [this]{ return this->nbThreadsAlive == 0; });
-            Debug("Waiting ended");
-        }
+    void ThreadPool::stop(bool terminate) {
+        lock_t lock(joinMutex);
 
         if (joined) {
             Debug("Already joined thread objects");
             return;
         }
 
-        Debug("Joining thread objects");
-        for (uint i = 0; i < size; i++)
-            threads[i].join();
-        Debug("Joining done");
-
-        joining = false;
-        joined = true;
-    }
-
-    void ThreadPool::join() const {
-        lock_t lock(joinMutex);
-        Debug("ThreadPool::join() called");
-
-        if (joined)
-            return;
+        if (terminate)
+            terminating.store(true);
+        // before joining is set, or a thread could see it while the
+        // queue still holds back the last jobs
+        queue.release();
+        joining.store(true);
 
-        bool threadsAlreadyEnded = false;
+        Debug("Notifying threads that the ThreadPool is joining");
         {
-            lock_t lockNbTA(nbTAMutex);
-            if (nbThreadsAlive == 0)
-                threadsAlreadyEnded = true;
-        }
-
-        if (!joining && !threadsAlreadyEnded) {
-            Debug("Notifying threads that the ThreadPool is joining");
-            joining = true;
-            thread_nop.notify_all();
-        }
-
-        if (!threadsAlreadyEnded) {
-            Debug("Waiting until join completes");
-            joinCV.wait(lock, [this]{ return this->nbThreadsAlive == 0; });
-            Debug("Waiting ended");
-        }
-
-        if (joined) {
-            Debug("Already joined thread objects");
-            return;
+            lock_t parkLock(parkMutex);
+            jobAvailable.notify_all();
+            spaceAvailable.notify_all();
         }
 
         Debug("Joining thread objects");
@@ -115,13 +99,11 @@ namespace worker {
             threads[i].join();
         Debug("Joining done");
 
-        joining = false;
         joined = true;
     }
 
     bool ThreadPool::isJoining() const {
-        lock_t lock(joinMutex);
-        return joining;
+        return joining.load();
     }
 
     bool ThreadPool::isJoined() const {
@@ -129,101 +111,154 @@ namespace worker {
         return joined;
     }
 
-    bool ThreadPool::isTerminating() const {
-        lock_t lock(joinMutex);
-        return terminating;
+    // scheduling sutff
+
+    void ThreadPool::wakeThread() {
+        // pairs with the increment of nbParkedThreads in getNextCommand:
+        // either the thread sees our job, or we see the thread
+        atomic_thread_fence(memory_order_seq_cst);
+
+        if (nbParkedThreads.load(memory_order_relaxed) > 0) {
+            lock_t lock(parkMutex);
+            jobAvailable.notify_one();
+        }
     }
 
-    void ThreadPool::setThreadFinished() {
-        lock_t lock(nbTAMutex);
-        nbThreadsAlive --;
-        Debug("Deactivating thread, active thread count = %u", nbThreadsAlive);
+    void ThreadPool::wakeProducer() {
+        atomic_thread_fence(memory_order_seq_cst);
 
-        if (nbThreadsAlive == 0)
-            joinCV.notify_all();
+        if (nbParkedProducers.load(memory_order_relaxed) > 0) {
+            lock_t lock(parkMutex);
+            spaceAvailable.notify_all();
+        }
     }
 
-    // scheduling sutff
+    void ThreadPool::schedule(Job &job) {
+        Debug("Scheduling job %llu", (unsigned long long)job.sequence);
+
+        if (!queue.tryPush(job)) {
+            Debug("Queue is full, waiting");
 
-    void ThreadPool::schedule(string command) {
-        lock_t lock(queueMutex);
-        Debug("Scheduling \"%s\", %u commands in queue already", command.c_str(), queue.size());
+            lock_t lock(parkMutex);
+            nbParkedProducers.fetch_add(1);
 
-        bool empty = queue.empty();
-        queue.push(command);
+            while (!queue.tryPush(job)) {
+                if (terminating.load()) {
+                    nbParkedProducers.fetch_sub(1);
+                    return;
+                }
+
+                spaceAvailable.wait(lock);
+            }
 
-        if (empty) {
-            thread_nop.notify_all();
+            nbParkedProducers.fetch_sub(1);
         }
+
+        wakeThread();
+    }
+
+    void ThreadPool::release() {
+        if (!queue.release())
+            return;
+
+        Debug("Releasing the jobs held back by the queue");
+        lock_t lock(parkMutex);
+        jobAvailable.notify_all();
     }
 
-    string ThreadPool::getNextCommand() {
-        lock_t lock(queueMutex);
-        Debug("Requesting command, current queue size is %u", queue.size());
+    bool ThreadPool::getNextCommand(Job &job) {
+        for (uint i = 0; i < SPIN_COUNT; i++) {
+            if (terminating.load(memory_order_relaxed))
+                return false;
 
-        if (queue.empty()) {
-            if (!isJoining())
-                thread_nop.wait(lock);
-            return "";
+            if (queue.tryPop(job)) {
+                wakeProducer();
+                return true;
+            }
+
+            // no more jobs will be scheduled and the queue is empty
+            if (joining.load())
+                return queue.tryPop(job);
+
+            this_thread::yield();
         }
 
-        Debug("queue size: %u", queue.size());
-        string command(queue.front());
-        queue.pop();
+        Debug("Queue is empty, waiting");
 
-        return command;
-    }
+        lock_t lock(parkMutex);
+        nbParkedThreads.fetch_add(1);
+
+        bool result;
+        while (true) {
+            if (terminating.load()) {
+                result = false;
+                break;
+            }
+
+            if (queue.tryPop(job)) {
+                result = true;
+                break;
+            }
+
+            if (joining.load()) {
+                result = false;
+                break;
+            }
 
-    bool ThreadPool::isQueueEmpty() const {
-        lock_t lock(queueMutex);
-        return queue.empty();
+            jobAvailable.wait(lock);
+        }
+
+        nbParkedThreads.fetch_sub(1);
+        lock.unlock();
+
+        if (result)
+            wakeProducer();
+
+        return result;
     }
 
     // run function
 
     namespace impl {
-        void execute(ThreadPool &pool, thread &thread) {
-            Debug("Thread started.");
-
-            while(true) {
-                if (pool.isJoining()) {
-                    if (pool.isTerminating()) {
-                        // terminating, ignore queue length
-                        Debug("Terminating thread");
-                        break;
-                    }
-
-                    if (pool.isQueueEmpty()) {
-                        // joining & queue is empty
-                        Debug("Joining thread");
-                        break;
-                    } else {
-                        Debug("Pool is joining but queue is not empty yet");
-                    }
-
-                    // joining but queue is not empty yet!
-                }
+        void execute(ThreadPool &pool, uint slot) {
+            Debug("Thread started for slot %u.", slot);
 
-                Debug("Trying to get next command");
-                string command = pool.getNextCommand();
+            // the jobs started by this thread inherit its affinity
+            System::setSlot(int(slot));
+        #if defined(WORKER_IS_LINUX)
+            if (System::getSlotAffinity() != NULL)
+                System::getSlotAffinity()->pin(slot);
+        #endif
 
-                if (command == "") {
-                    Debug("Got empty command, continuing");
+            AdmissionControl *admission = System::getAdmissionControl();
+            Supervisor *supervisor = System::getSupervisor();
+            ResultCache *cache = System::getResultCache();
+
+            auto run = [&pool, admission](const Job &job) {
+                if (admission != NULL)
+                    admission->admit();
+
+                pool.handler(job);
+
+                if (admission != NULL)
+                    admission->release();
+            };
+
+            Job job;
+            while (pool.getNextCommand(job)) {
+                if (cache != NULL && cache->replay(job))
                     continue;
-                }
 
-                Debug("running command \"%s\"", command.c_str());
-                int retval = System::exec(command, pool.quiet);
-                if (retval != 0)
-                    Warn("command \"%s\" exited with code %d", command.c_str(), retval);
-                else
-                    Debug("Command \"%s\" executed successfully", command.c_str());
+                // rendered here so the threads share the work
+                Command::render(job);
+                run(job);
             }
 
-            Debug("Thread shutting down.");
+            // the queue is drained, help out the slowest jobs
+            while (supervisor != NULL && supervisor->isSpeculating() && !pool.terminating && supervisor->waitForStraggler(job))
+                run(job);
 
-            pool.setThreadFinished();
             Debug("Thread ended");
-        } // void execute(ThreadPool&)
+        } // void execute(ThreadPool&, uint)
     } // namespace impl
 }
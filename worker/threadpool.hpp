@@ -2,29 +2,39 @@
 #define __WORKER_THREADPOOL_
 
 #include <string>
-#include <queue>
+#include <atomic>
+#include <functional>
 
 #include <thread>
 #include <mutex>
 #include <condition_variable>
 
 #include "api.hpp"
+#include "job.hpp"
+#include "queue.hpp"
+#include "executor.hpp"
 
 namespace worker {
 
     struct ThreadPool;
 
     namespace impl {
-        void execute(ThreadPool &pool, std::thread &thread);
+        void execute(ThreadPool &pool, uint slot);
     }
 
-    struct ThreadPool {
+    struct ThreadPool : public Executor {
+        typedef std::function<void(const Job &)> job_handler_t;
 
-        ThreadPool(uint size, bool quiet);
+        // schedule() blocks while capacity jobs are waiting in the queue,
+        // the waiting jobs with the highest cost are started first if
+        // prioritized is set
+        ThreadPool(uint size, bool quiet, uint capacity, bool prioritized = false);
+        ThreadPool(uint size, uint capacity, const job_handler_t &handler, bool prioritized = false);
         ~ThreadPool();
 
-        void schedule(std::string command);
-        void join() const;
+        void schedule(Job &job);
+        void release();
+        void join();
         void terminate();
 
         bool isJoining() const;
@@ -39,37 +49,45 @@ namespace worker {
         typedef std::unique_lock<mutex_t>   lock_t;
         typedef std::condition_variable     condition_var_t;
 
-        typedef std::queue<std::string>     queue_t;
-        
-        const bool quiet;
+        typedef impl::SchedulingQueue<Job, impl::JobCostOrder> queue_t;
+
+        const job_handler_t handler;
 
         thread_t * const threads;
         const uint size;
 
-        uint nbThreadsAlive;
-        mutable mutex_t nbTAMutex;
+        queue_t queue;
+
+        // set by join(), no jobs will be scheduled anymore
+        std::atomic<bool> joining;
+        // set by terminate(), the threads stop without emptying the queue
+        std::atomic<bool> terminating;
 
-        mutable condition_var_t thread_nop;
-        mutable condition_var_t joinCV;
+        // threads and producers sleeping on the condition variables below,
+        // used to skip the notifications when nobody is sleeping
+        std::atomic<uint> nbParkedThreads;
+        std::atomic<uint> nbParkedProducers;
 
-        queue_t queue;
-        mutable mutex_t queueMutex;
+        mutable mutex_t parkMutex;
+        condition_var_t jobAvailable;
+        condition_var_t spaceAvailable;
 
-        mutable bool joining;
-        bool terminating;
-        mutable bool joined;
+        bool joined;
         mutable mutex_t joinMutex;
 
-        void setThreadFinished();
+        void start();
+        void stop(bool terminate);
 
-        bool isTerminating() const;
-        bool isQueueEmpty() const;
+        void wakeThread();
+        void wakeProducer();
 
-        std::string getNextCommand();
+        // blocks until a job is available, returns false when the thread
+        // should shut down
+        bool getNextCommand(Job &job);
 
-        friend void impl::execute(ThreadPool&,std::thread&);
+        friend void impl::execute(ThreadPool&, uint);
     };
 
 }
 
-#endif // !defined(__WORKER_THREADPOOL_)
\ No newline at end of file
+#endif // !defined(__WORKER_THREADPOOL_)
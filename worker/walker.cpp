@@ -0,0 +1,651 @@
+#include "walker.hpp"
+#include "system.hpp"
+#include "api.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <pwd.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#if defined(WORKER_IS_LINUX)
+#include <sys/syscall.h>
+#endif
+
+using namespace std;
+
+namespace worker {
+
+    namespace impl {
+
+        typedef enum { SEGMENT_LITERAL, SEGMENT_MAGIC, SEGMENT_GLOBSTAR } SegmentType;
+
+        // a single component of a pattern, between two slashes
+        struct GlobSegment {
+            SegmentType type;
+            // unescaped for literals, as given to fnmatch() otherwise
+            std::string text;
+
+            // "*" and "*suffix" are matched without fnmatch()
+            bool matchAll;
+            bool matchSuffix;
+            std::string suffix;
+
+            bool matches(const char *name, size_t length) const {
+                if (matchAll)
+                    return name[0] != '.';
+                if (matchSuffix)
+                    return name[0] != '.' && length >= suffix.length()
+                        && memcmp(name + length - suffix.length(), suffix.data(), suffix.length()) == 0;
+
+                return fnmatch(text.c_str(), name, FNM_PERIOD) == 0;
+            }
+        };
+
+        // a pattern without braces
+        struct GlobPattern {
+            // the directories before the first wildcard, "" or ending with
+            // a slash
+            std::string base;
+            std::vector<GlobSegment> segments;
+
+            // the pattern ends with a slash, it only matches directories
+            bool directoriesOnly;
+
+            // the whole pattern if it contains no wildcards, unescaped
+            std::string literal;
+        };
+
+    }
+
+    using impl::GlobSegment;
+    using impl::GlobPattern;
+    using impl::WalkTask;
+    using impl::WalkNode;
+
+    const size_t GlobWalker::MAX_PENDING = 64 * 1024;
+
+    static const size_t READ_BUFFER_SIZE = 1024 * 1024;
+    static const size_t PUBLISH_BATCH = 256;
+    static const uint MAX_THREADS = 8;
+
+    static bool hasWildcards(const string &str) {
+        for (size_t i = 0; i < str.length(); i++) {
+            if (str[i] == '\\')
+                i++;
+            else if (str[i] == '*' || str[i] == '?' || str[i] == '[')
+                return true;
+        }
+
+        return false;
+    }
+
+    static string unescape(const string &str) {
+        string result;
+        result.reserve(str.length());
+
+        for (size_t i = 0; i < str.length(); i++) {
+            if (str[i] == '\\' && i + 1 < str.length())
+                i++;
+            result += str[i];
+        }
+
+        return result;
+    }
+
+    // appends the patterns the first brace with a comma expands to,
+    // recursively, or pattern itself if there is none
+    static void expandBraces(const string &pattern, vector<string> &out) {
+        const size_t length = pattern.length();
+
+        for (size_t open = 0; open < length; open++) {
+            if (pattern[open] == '\\') {
+                open++;
+                continue;
+            }
+            if (pattern[open] != '{')
+                continue;
+
+            vector<size_t> separators;
+            size_t close = string::npos;
+            uint depth = 0;
+
+            for (size_t i = open; i < length && close == string::npos; i++) {
+                if (pattern[i] == '\\')
+                    i++;
+                else if (pattern[i] == '{')
+                    depth++;
+                else if (pattern[i] == '}' && --depth == 0)
+                    close = i;
+                else if (pattern[i] == ',' && depth == 1)
+                    separators.push_back(i);
+            }
+
+            // unbalanced braces are taken literally
+            if (close == string::npos)
+                break;
+            if (separators.empty())
+                continue;
+
+            separators.push_back(close);
+
+            size_t start = open + 1;
+            for (vector<size_t>::const_iterator s = separators.begin(), e = separators.end(); s != e; s++) {
+                expandBraces(pattern.substr(0, open) + pattern.substr(start, *s - start) + pattern.substr(close + 1), out);
+                start = *s + 1;
+            }
+
+            return;
+        }
+
+        out.push_back(pattern);
+    }
+
+    // replaces a leading ~ or ~user by the home directory
+    static string expandTilde(const string &pattern) {
+        if (pattern.empty() || pattern[0] != '~')
+            return pattern;
+
+        const size_t slash = pattern.find('/');
+        const string user = pattern.substr(1, (slash == string::npos) ? string::npos : slash - 1);
+        const char *home = NULL;
+
+        if (user.empty() && (home = getenv("HOME")) == NULL) {
+            struct passwd *entry = getpwuid(getuid());
+            if (entry != NULL)
+                home = entry->pw_dir;
+        } else if (!user.empty()) {
+            struct passwd *entry = getpwnam(user.c_str());
+            if (entry != NULL)
+                home = entry->pw_dir;
+        }
+
+        if (home == NULL)
+            return pattern;
+
+        return (slash == string::npos) ? string(home) : home + pattern.substr(slash);
+    }
+
+    static GlobPattern *compile(const string &pattern) {
+        GlobPattern *result = new GlobPattern;
+        result->directoriesOnly = pattern.length() > 1 && pattern[pattern.length() - 1] == '/';
+
+        // the start of the first component with wildcards
+        size_t first = string::npos;
+        for (size_t start = 0; start <= pattern.length(); ) {
+            size_t slash = pattern.find('/', start);
+            if (hasWildcards(pattern.substr(start, (slash == string::npos) ? string::npos : slash - start))) {
+                first = start;
+                break;
+            }
+
+            if (slash == string::npos)
+                break;
+            start = slash + 1;
+        }
+
+        if (first == string::npos) {
+            result->literal = unescape(pattern);
+            return result;
+        }
+
+        result->base = unescape(pattern.substr(0, first));
+
+        for (size_t start = first; start < pattern.length(); ) {
+            size_t slash = pattern.find('/', start);
+            if (slash == string::npos)
+                slash = pattern.length();
+
+            const string component = pattern.substr(start, slash - start);
+            start = slash + 1;
+
+            if (component.empty())
+                continue;
+
+            GlobSegment segment;
+            segment.matchAll = false;
+            segment.matchSuffix = false;
+
+            if (component == "**") {
+                // ** matches any number of directories already
+                if (!result->segments.empty() && result->segments.back().type == impl::SEGMENT_GLOBSTAR)
+                    continue;
+
+                segment.type = impl::SEGMENT_GLOBSTAR;
+            } else if (hasWildcards(component)) {
+                segment.type = impl::SEGMENT_MAGIC;
+                segment.text = component;
+
+                const string rest = component.substr(1);
+                if (component[0] == '*' && !hasWildcards(rest) && rest.find('\\') == string::npos) {
+                    segment.matchAll = rest.empty();
+                    segment.matchSuffix = !rest.empty();
+                    segment.suffix = rest;
+                }
+            } else {
+                segment.type = impl::SEGMENT_LITERAL;
+                segment.text = unescape(component);
+            }
+
+            result->segments.push_back(segment);
+        }
+
+        return result;
+    }
+
+    // type is the d_type of the entry at path
+    static bool isDirectory(const string &path, unsigned char type, bool followLinks) {
+        if (type == DT_DIR)
+            return true;
+        if (type != DT_UNKNOWN && (type != DT_LNK || !followLinks))
+            return false;
+
+        struct stat st;
+        int ret = followLinks ? stat(path.c_str(), &st) : lstat(path.c_str(), &st);
+        return ret == 0 && S_ISDIR(st.st_mode);
+    }
+
+    bool GlobWalker::isPattern(const string &pattern) {
+        return (!pattern.empty() && pattern[0] == '~')
+            || pattern.find_first_of("*?[{\\") != string::npos;
+    }
+
+    GlobWalker::GlobWalker(const string &pattern, uint nbThreads)
+        : pattern(pattern), currentAlternative(0), current(NULL), nbActive(0), done(false), stopping(false),
+        wanted(NULL), nbBuffered(0), nbMatches(0), nextReady(0), returnedPattern(false)
+    {
+        if (!isPattern(pattern)) {
+            done = true;
+            return;
+        }
+
+        vector<string> expanded;
+        expandBraces(pattern, expanded);
+
+        bool literal = true;
+        for (vector<string>::const_iterator p = expanded.begin(), e = expanded.end(); p != e; p++) {
+            alternatives.push_back(compile(expandTilde(*p)));
+            literal = literal && alternatives.back()->segments.empty();
+        }
+
+        lock_t lock(mutex);
+        startAlternative();
+
+        // literal alternatives are handled by startAlternative() itself
+        if (literal)
+            return;
+
+        if (nbThreads == 0)
+            nbThreads = min(System::getNbCores(), MAX_THREADS);
+
+        Debug("Walking \"%s\" using %u threads", pattern.c_str(), nbThreads);
+        for (uint i = 0; i < nbThreads; i++)
+            threads.push_back(thread(&GlobWalker::run, this));
+    }
+
+    GlobWalker::~GlobWalker() {
+        {
+            lock_t lock(mutex);
+            stopping = true;
+        }
+        taskAvailable.notify_all();
+        spaceAvailable.notify_all();
+
+        for (vector<thread>::iterator t = threads.begin(), e = threads.end(); t != e; t++)
+            t->join();
+
+        // the positions own the children they haven't visited yet
+        for (vector<impl::WalkPosition>::reverse_iterator p = cursor.rbegin(), e = cursor.rend(); p != e; p++) {
+            for (size_t i = p->nextChild; i < p->node->children.size(); i++)
+                deleteTree(p->node->children[i]);
+            delete p->node;
+        }
+
+        for (deque<WalkNode *>::iterator r = roots.begin(), e = roots.end(); r != e; r++)
+            deleteTree(*r);
+
+        for (vector<GlobPattern *>::iterator a = alternatives.begin(), e = alternatives.end(); a != e; a++)
+            delete *a;
+    }
+
+    void GlobWalker::deleteTree(WalkNode *node) {
+        for (vector<WalkNode *>::iterator c = node->children.begin(), e = node->children.end(); c != e; c++)
+            deleteTree(*c);
+        delete node;
+    }
+
+    void GlobWalker::startAlternative() {
+        while (currentAlternative < alternatives.size()) {
+            current = alternatives[currentAlternative++];
+
+            WalkNode *root = new WalkNode;
+            root->taken = false;
+            root->walked = false;
+            roots.push_back(root);
+
+            if (!current->segments.empty()) {
+                root->task.path = current->base;
+                root->task.segment = 0;
+                root->task.nested = false;
+                tasks.push_front(root);
+
+                taskAvailable.notify_all();
+                return;
+            }
+
+            // like glob(3), a pattern without wildcards has to exist
+            root->taken = root->walked = true;
+            struct stat st;
+            if (lstat(current->literal.c_str(), &st) == 0) {
+                root->matches.push_back(current->literal);
+                nbBuffered++;
+                nbMatches++;
+            }
+        }
+
+        done = true;
+        taskAvailable.notify_all();
+        matchAvailable.notify_all();
+    }
+
+    WalkNode *GlobWalker::takeTask() {
+        if (tasks.empty())
+            return NULL;
+
+        WalkNode *node = NULL;
+        if (wanted != NULL) {
+            deque<WalkNode *>::iterator w = find(tasks.begin(), tasks.end(), wanted);
+            if (w != tasks.end()) {
+                node = *w;
+                tasks.erase(w);
+            }
+            wanted = NULL;
+        }
+
+        // the others only while next() keeps up, or nothing would move
+        if (node == NULL && (nbBuffered < MAX_PENDING || nbActive == 0)) {
+            node = tasks.front();
+            tasks.pop_front();
+        }
+
+        if (node != NULL)
+            node->taken = true;
+        return node;
+    }
+
+    bool GlobWalker::advance() {
+        while (true) {
+            if (cursor.empty()) {
+                if (roots.empty())
+                    return done || !ready.empty();
+
+                impl::WalkPosition position = { roots.front(), 0 };
+                cursor.push_back(position);
+                roots.pop_front();
+            }
+
+            impl::WalkPosition &position = cursor.back();
+            WalkNode *node = position.node;
+
+            if (!node->matches.empty()) {
+                nbBuffered -= node->matches.size();
+                ready.insert(ready.end(), make_move_iterator(node->matches.begin()), make_move_iterator(node->matches.end()));
+                node->matches.clear();
+
+                spaceAvailable.notify_all();
+                taskAvailable.notify_all();
+            }
+
+            if (!node->walked) {
+                if (!ready.empty())
+                    return true;
+
+                if (!node->taken) {
+                    wanted = node;
+                    taskAvailable.notify_one();
+                }
+                return false;
+            }
+
+            if (position.nextChild < node->children.size()) {
+                impl::WalkPosition child = { node->children[position.nextChild++], 0 };
+                cursor.push_back(child);
+                continue;
+            }
+
+            delete node;
+            cursor.pop_back();
+        }
+    }
+
+    bool GlobWalker::next(string &match) {
+        if (nextReady == ready.size()) {
+            ready.clear();
+            nextReady = 0;
+
+            lock_t lock(mutex);
+            while (!advance())
+                matchAvailable.wait(lock);
+
+            if (ready.empty()) {
+                if (nbMatches > 0 || returnedPattern)
+                    return false;
+
+                Debug("\"%s\" matches nothing, passing it as is", pattern.c_str());
+                returnedPattern = true;
+                match = pattern;
+                return true;
+            }
+        }
+
+        match.swap(ready[nextReady++]);
+        return true;
+    }
+
+    void GlobWalker::publish(WalkNode &node, matches_t &matches) {
+        if (matches.empty())
+            return;
+
+        lock_t lock(mutex);
+
+        // the other directories can't wait, next() may need them to be
+        // walked before it gets to their matches
+        while (node.matches.size() >= MAX_PENDING && !cursor.empty() && cursor.back().node == &node && !stopping)
+            spaceAvailable.wait(lock);
+
+        if (!stopping) {
+            nbMatches += matches.size();
+            nbBuffered += matches.size();
+            node.matches.insert(node.matches.end(), make_move_iterator(matches.begin()), make_move_iterator(matches.end()));
+            matchAvailable.notify_one();
+        }
+
+        matches.clear();
+    }
+
+    void GlobWalker::run() {
+        vector<char> buffer(READ_BUFFER_SIZE);
+        matches_t matches;
+        tasks_t found;
+
+        lock_t lock(mutex);
+
+        while (true) {
+            WalkNode *node = NULL;
+            while (!done && !stopping && (node = takeTask()) == NULL)
+                taskAvailable.wait(lock);
+
+            if (node == NULL)
+                return;
+
+            nbActive++;
+
+            lock.unlock();
+            walk(*node, buffer, matches, found);
+            publish(*node, matches);
+            lock.lock();
+
+            // the subdirectories come right after their parent, in the
+            // order they were found
+            for (tasks_t::iterator f = found.begin(), e = found.end(); f != e; f++) {
+                WalkNode *child = new WalkNode;
+                child->task.path.swap(f->path);
+                child->task.segment = f->segment;
+                child->task.nested = f->nested;
+                child->taken = false;
+                child->walked = false;
+                node->children.push_back(child);
+            }
+            found.clear();
+
+            tasks.insert(tasks.begin(), node->children.begin(), node->children.end());
+            node->walked = true;
+
+            matchAvailable.notify_one();
+            if (!node->children.empty())
+                taskAvailable.notify_all();
+
+            if (--nbActive == 0 && tasks.empty() && !stopping)
+                startAlternative();
+        }
+    }
+
+    void GlobWalker::matchLiteral(const string &path, uint segment, matches_t &matches, tasks_t &found) {
+        const GlobPattern &pattern = *current;
+        const string full = path + pattern.segments[segment].text;
+        struct stat st;
+
+        if (segment + 1 < pattern.segments.size()) {
+            if (stat(full.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+                WalkTask task;
+                task.path = full + '/';
+                task.segment = segment + 1;
+                task.nested = false;
+                found.push_back(task);
+            }
+        } else if (!pattern.directoriesOnly) {
+            if (lstat(full.c_str(), &st) == 0)
+                matches.push_back(full);
+        } else if (stat(full.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+            matches.push_back(full + '/');
+        }
+    }
+
+    void GlobWalker::walk(WalkNode &node, vector<char> &buffer, matches_t &matches, tasks_t &found) {
+        const WalkTask &task = node.task;
+        const GlobPattern &pattern = *current;
+        const uint nbSegments = pattern.segments.size();
+
+        // ** matches the entries of this directory with the next segment,
+        // and the subdirectories with itself
+        const bool recurse = pattern.segments[task.segment].type == impl::SEGMENT_GLOBSTAR;
+        const uint segment = recurse ? task.segment + 1 : task.segment;
+        const GlobSegment *matcher = (segment < nbSegments) ? &pattern.segments[segment] : NULL;
+        const bool last = segment + 1 >= nbSegments;
+
+        // like with bash's globstar, a final ** also matches zero
+        // directories: the directory it starts in
+        if (recurse && segment == nbSegments && !task.nested && !task.path.empty())
+            matches.push_back(task.path);
+
+        if (matcher != NULL && matcher->type == impl::SEGMENT_LITERAL) {
+            matchLiteral(task.path, segment, matches, found);
+            if (!recurse)
+                return;
+
+            matcher = NULL;
+        }
+
+        const bool matchEntries = matcher != NULL || segment == nbSegments;
+
+        auto handle = [&](const char *name, size_t length, unsigned char type) {
+            if (name[0] == '.' && (length == 1 || (length == 2 && name[1] == '.')))
+                return;
+
+            const bool matched = matchEntries && ((matcher == NULL) ? name[0] != '.' : matcher->matches(name, length));
+            const bool descend = recurse && name[0] != '.';
+            if (!matched && !descend)
+                return;
+
+            string path = task.path;
+            path.append(name, length);
+
+            if (matched) {
+                if (!last) {
+                    if (isDirectory(path, type, true)) {
+                        WalkTask next;
+                        next.path = path + '/';
+                        next.segment = segment + 1;
+                        next.nested = false;
+                        found.push_back(next);
+                    }
+                } else if (!pattern.directoriesOnly) {
+                    matches.push_back(path);
+                } else if (isDirectory(path, type, true)) {
+                    matches.push_back(path + '/');
+                }
+
+                if (matches.size() >= PUBLISH_BATCH)
+                    publish(node, matches);
+            }
+
+            // symbolic links aren't followed, so there are no cycles
+            if (descend && isDirectory(path, type, false)) {
+                WalkTask next;
+                next.path = path + '/';
+                next.segment = task.segment;
+                next.nested = true;
+                found.push_back(next);
+            }
+        };
+
+        const char *directory = task.path.empty() ? "." : task.path.c_str();
+
+    #if defined(WORKER_IS_LINUX)
+        struct linux_dirent64 {
+            ino64_t         d_ino;
+            off64_t         d_off;
+            unsigned short  d_reclen;
+            unsigned char   d_type;
+            char            d_name[];
+        };
+
+        int fd = open(directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0) {
+            Debug("Unable to read directory \"%s\": %s", directory, strerror(errno));
+            return;
+        }
+
+        long nbRead;
+        while ((nbRead = syscall(SYS_getdents64, fd, &buffer[0], buffer.size())) > 0) {
+            for (long offset = 0; offset < nbRead; ) {
+                const linux_dirent64 *entry = reinterpret_cast<const linux_dirent64 *>(&buffer[offset]);
+                handle(entry->d_name, strlen(entry->d_name), entry->d_type);
+                offset += entry->d_reclen;
+            }
+        }
+
+        close(fd);
+    #else
+        DIR *dir = opendir(directory);
+        if (dir == NULL) {
+            Debug("Unable to read directory \"%s\": %s", directory, strerror(errno));
+            return;
+        }
+
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL)
+            handle(entry->d_name, strlen(entry->d_name), entry->d_type);
+
+        closedir(dir);
+    #endif
+    }
+
+}
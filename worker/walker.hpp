@@ -0,0 +1,153 @@
+#ifndef __WORKER_WALKER_
+#define __WORKER_WALKER_
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "api.hpp"
+
+namespace worker {
+
+    namespace impl {
+
+        struct GlobPattern;
+
+        struct WalkTask {
+            // the directory to read, "" for the current one, otherwise
+            // ending with a slash
+            std::string path;
+            uint segment;
+            // the directory was found by ** descending into it, rather than
+            // by the segments before the **
+            bool nested;
+        };
+
+        // a directory to walk, with the directories found in it
+        struct WalkNode {
+            WalkTask task;
+
+            // the matches found in the directory that haven't been
+            // returned yet
+            std::vector<std::string> matches;
+            std::vector<WalkNode *> children;
+
+            // a thread is walking or has walked the directory
+            bool taken;
+            // the directory has been read, children is complete
+            bool walked;
+        };
+
+        // where next() is in the tree of an alternative
+        struct WalkPosition {
+            WalkNode *node;
+            size_t nextChild;
+        };
+
+    }
+
+    /*
+     * Expands a glob pattern like glob(3) with GLOB_BRACE, GLOB_TILDE and
+     * GLOB_NOSORT, and ** to match any number of directories, returning
+     * the matches while the directories are still being read.
+     *
+     * Directories are read by a few threads at once, with getdents64 and a
+     * large buffer on Linux. The matches are returned in the same order
+     * however many threads there are: the entries of a directory in the
+     * order they are read, followed by the matches in the directories found
+     * in it, one directory after the other, and the alternatives of a brace
+     * one after the other. Like glob(3), hidden files are only matched by a
+     * segment starting with a dot, and a pattern without any matches is
+     * returned as is.
+     */
+    class GlobWalker {
+    public:
+        // the number of matches that may be waiting for next(), the
+        // walkers only start reading the directory next() waits for once
+        // there are more, and stop reading the one it returns from
+        static const size_t MAX_PENDING;
+
+        // uses as many threads as there are cores, at most 8, if
+        // nbThreads is 0
+        explicit GlobWalker(const std::string &pattern, uint nbThreads = 0);
+        ~GlobWalker();
+
+        // returns false once all matches have been returned
+        bool next(std::string &match);
+
+        // whether pattern contains wildcards or braces, patterns without
+        // them are returned as is without touching the file system
+        static bool isPattern(const std::string &pattern);
+
+    private:
+        // no copying!
+        GlobWalker(const GlobWalker &o);
+
+        typedef std::mutex                  mutex_t;
+        typedef std::unique_lock<mutex_t>   lock_t;
+        typedef std::vector<std::string>    matches_t;
+
+        typedef std::vector<impl::WalkTask> tasks_t;
+
+        void run();
+        void walk(impl::WalkNode &node, std::vector<char> &buffer, matches_t &matches, tasks_t &found);
+        void matchLiteral(const std::string &path, uint segment, matches_t &matches, tasks_t &found);
+
+        // must be called with the mutex locked
+        void startAlternative();
+        impl::WalkNode *takeTask();
+        // moves the matches that are next in order to ready, returns false
+        // if next() has to wait for more
+        bool advance();
+
+        // moves matches to node, waiting for space if next() is returning
+        // the matches of node
+        void publish(impl::WalkNode &node, matches_t &matches);
+
+        static void deleteTree(impl::WalkNode *node);
+
+        const std::string pattern;
+
+        // the patterns the braces expand to, walked one by one
+        std::vector<impl::GlobPattern *> alternatives;
+        size_t currentAlternative;
+        // the alternative being walked, only changes when no tasks are left
+        const impl::GlobPattern *current;
+
+        mutex_t mutex;
+        std::condition_variable taskAvailable;
+        std::condition_variable matchAvailable;
+        std::condition_variable spaceAvailable;
+
+        // the directories no thread has taken yet, roughly in the order
+        // their matches are returned
+        std::deque<impl::WalkNode *> tasks;
+        uint nbActive;
+        bool done;
+        bool stopping;
+
+        // the trees of the alternatives next() hasn't started returning
+        std::deque<impl::WalkNode *> roots;
+        // from the root to the directory whose matches next() returns
+        std::vector<impl::WalkPosition> cursor;
+        // the directory next() waits for, taken before all others
+        impl::WalkNode *wanted;
+
+        // the matches in the tree that haven't been returned yet
+        size_t nbBuffered;
+        size_t nbMatches;
+
+        // the matches taken from the tree by next(), at once
+        matches_t ready;
+        size_t nextReady;
+        bool returnedPattern;
+
+        std::vector<std::thread> threads;
+    };
+
+}
+
+#endif // !defined(__WORKER_WALKER_)